@@ -1234,6 +1234,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cpuparams.poll = std::stoul(value);
         }
     ));
+    add_opt(common_arg(
+        {"--poll-adaptive"},
+        "spin for a calibrated interval (bounded by --poll), then park on a futex (default: disabled)\n"
+        "not available in OpenMP builds (GGML_OPENMP), where it is ignored with a warning",
+        [](common_params & params) {
+            params.cpuparams.poll_adaptive = true;
+        }
+    ));
     add_opt(common_arg(
         {"-Cb", "--cpu-mask-batch"}, "M",
         "CPU affinity mask: arbitrarily long hex. Complements cpu-range-batch (default: same as --cpu-mask)",
@@ -2145,15 +2153,42 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         "- distribute: spread execution evenly over all nodes\n"
         "- isolate: only spawn threads on CPUs on the node that execution started on\n"
         "- numactl: use the CPU map provided by numactl\n"
+        "- shard: bind threads to nodes in blocks and split the rows of each weight matrix across the nodes\n"
         "if run without this previously, it is recommended to drop the system page cache before using this\n"
         "see https://github.com/ggml-org/llama.cpp/issues/1437",
         [](common_params & params, const std::string & value) {
             /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
             else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
             else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+            else if (value == "shard") { params.numa = GGML_NUMA_STRATEGY_SHARD; }
             else { throw std::invalid_argument("invalid value"); }
         }
     ).set_env("LLAMA_ARG_NUMA"));
+    add_opt(common_arg(
+        {"--tp-size"}, "N",
+        string_format("number of processes that split the attention heads and FFN of the model between them (default: %d)\n"
+            "start one process per rank with the same arguments and a different --tp-rank", params.tp_size),
+        [](common_params & params, int value) {
+            if (value < 1) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.tp_size = value;
+        }
+    ).set_env("LLAMA_ARG_TP_SIZE"));
+    add_opt(common_arg(
+        {"--tp-rank"}, "N",
+        string_format("tensor parallel rank of this process, in [0, --tp-size) (default: %d)", params.tp_rank),
+        [](common_params & params, int value) {
+            params.tp_rank = value;
+        }
+    ).set_env("LLAMA_ARG_TP_RANK"));
+    add_opt(common_arg(
+        {"--tp-shm"}, "NAME",
+        string_format("shared memory object used by the tensor parallel processes (default: %s)", params.tp_shm.c_str()),
+        [](common_params & params, const std::string & value) {
+            params.tp_shm = value;
+        }
+    ).set_env("LLAMA_ARG_TP_SHM"));
     add_opt(common_arg(
         {"-dev", "--device"}, "<dev1,dev2,..>",
         "comma-separated list of devices to use for offloading (none = don't offload)\n"
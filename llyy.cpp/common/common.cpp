@@ -1068,6 +1068,9 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.tp_rank         = params.tp_rank;
+    mparams.tp_size         = params.tp_size;
+    mparams.tp_shm          = params.tp_shm.c_str();
 
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1137,6 +1140,7 @@ struct ggml_threadpool_params ggml_threadpool_params_from_cpu_params(const cpu_p
 
     tpp.prio       = params.priority;
     tpp.poll       = params.poll;
+    tpp.poll_adaptive = params.poll_adaptive;
     tpp.strict_cpu = params.strict_cpu;
 
     return tpp;
@@ -53,6 +53,7 @@ struct cpu_params {
     enum ggml_sched_priority  priority   = GGML_SCHED_PRIO_NORMAL;  // Scheduling prio : (0 - normal, 1 - medium, 2 - high, 3 - realtime)
     bool     strict_cpu                  = false;   // Use strict CPU placement
     uint32_t poll                        = 50;      // Polling (busywait) level (0 - no polling, 100 - mostly polling)
+    bool     poll_adaptive               = false;   // Calibrate the spin time to the observed idle gaps (poll is the upper bound)
 };
 
 int32_t cpu_get_num_physical_cores();
@@ -246,6 +247,10 @@ struct common_params {
 
     enum llama_split_mode split_mode = LLAMA_SPLIT_MODE_LAYER; // how to split the model across GPUs
 
+    int32_t     tp_rank = 0;          // rank of this process for tensor parallelism
+    int32_t     tp_size = 1;          // number of tensor parallel processes (1 = disabled)
+    std::string tp_shm  = "llama-tp"; // shared memory object used by the tensor parallel processes
+
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
 
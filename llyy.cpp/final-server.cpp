@@ -8,12 +8,17 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cmath>
+#include <csignal>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <numeric>
 #include <string>
 #include <vector>
 
@@ -21,10 +26,27 @@
 #include "llama.h"
 #include <nlohmann/json.hpp>
 #include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <thread>
 
 #define PORT 8080
 #define BUFFER_SIZE 4096
+#define MAX_REQUEST_SIZE (64 * 1024 * 1024) // 请求体上限(嵌入请求可能包含上千个文本块)
+#define EMBD_N_BATCH 2048                    // 嵌入批处理的token数上限，一个批次就是一个ubatch
+#define EMBD_N_SEQ_MAX 64                    // 嵌入批处理中的最大序列数
+#define DISCONNECT_CHECK_US 1000             // 计算过程中检查客户端断开的最小间隔(微秒)
+#define QUEUE_MAX_SIZE 64                    // 请求队列的最大长度
+#define QUEUE_KV_CONTEXTS 4                  // 排队请求预测KV占用的上限(以上下文大小n_ctx为单位)
+#define QUEUE_BATCH_SHARE 0.5                // batch类请求最多占用的KV预算比例，其余留给交互式请求
+#define DEFAULT_PREDICT_TOKENS 256           // 请求未指定max_tokens时预测的生成token数
+#define DEFAULT_DEADLINE_MS 60000            // 请求未指定deadline_ms时的默认截止时间
+#define RECV_TIMEOUT_MS 10000                // 接收完整请求的截止时间，超时后关闭连接
+#define RECV_MAX_CONNECTIONS 64              // 同时接收请求的连接数上限，超出时直接返回503
+#define DEFAULT_PREFILL_CHUNK 512            // 默认的prefill分块大小(每次llama_decode最多处理的token数)
+#define BENCH_PROMPT_TOKENS 128              // 性能测试(-bench)中prefill的token数
+#define TRACE_BUFFER_SIZE 65536              // 追踪事件环形缓冲区的大小，写满后覆盖最早的事件
 #define MIMETYPE_JSON "application/json; charset=utf-8"
 
 enum error_type
@@ -55,24 +77,155 @@ std::string format_error_response(const std::string &error, const enum error_typ
     return std::string(response);
 }
 
+/**
+ * @brief 格式化过载响应(503 + Retry-After)
+ * @param error 错误信息
+ * @param retry_after 建议客户端重试的等待时间(秒)
+ * @return 格式化后的HTTP响应字符串
+ */
+std::string format_unavailable_response(const std::string &error, int retry_after)
+{
+    std::string body = "{\"error\":{\"message\":\"" + error + "\",\"type\":503,\"code\":503}}";
+    return std::string("HTTP/1.1 503 Service Unavailable\r\n"
+                       "Content-Type: " MIMETYPE_JSON "\r\n"
+                       "Retry-After: ") +
+           std::to_string(retry_after) + "\r\n"
+                                         "Connection: close\r\n"
+                                         "Content-Length: " +
+           std::to_string(body.length()) + "\r\n"
+                                           "\r\n" +
+           body;
+}
+
 std::string format_success_response(const std::string &data)
 {
-    char response[BUFFER_SIZE];
-    snprintf(response, sizeof(response),
-             "HTTP/1.1 200 OK\r\n"
-             "Content-Type: %s\r\n"
-             "Content-Length: %zu\r\n"
-             "\r\n"
-             "%s",
-             MIMETYPE_JSON, data.length(), data.c_str());
-    return std::string(response);
+    // 响应体可能很大(例如嵌入向量)，不能使用固定大小的缓冲区
+    return std::string("HTTP/1.1 200 OK\r\n"
+                       "Content-Type: " MIMETYPE_JSON "\r\n"
+                       "Content-Length: ") +
+           std::to_string(data.length()) + "\r\n"
+                                           "\r\n" +
+           data;
+}
+
+/**
+ * @brief 发送全部数据(send可能只发送一部分)
+ * @param client_socket 客户端socket
+ * @param data 要发送的数据
+ * @return 是否全部发送成功
+ */
+bool send_all(int client_socket, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.length())
+    {
+        ssize_t n = send(client_socket, data.data() + sent, data.length() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+/**
+ * @brief 检查客户端是否已断开连接(不阻塞)
+ * @param client_socket 客户端socket
+ * @param read_closed 客户端发送请求后已经关闭了写方向(shutdown(SHUT_WR)，如 nc -N)
+ * @return 对端已关闭或连接出错时返回true
+ * @note 半关闭的客户端仍在等待响应，此时对端关闭写方向(POLLRDHUP)不算断开，只有连接出错才算
+ */
+bool client_disconnected(int client_socket, bool read_closed)
+{
+    struct pollfd pfd;
+    pfd.fd = client_socket;
+    pfd.events = POLLRDHUP;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) < 0)
+    {
+        return false;
+    }
+    const short hangup = read_closed ? 0 : POLLRDHUP;
+    return (pfd.revents & (hangup | POLLHUP | POLLERR | POLLNVAL)) != 0;
+}
+
+/**
+ * @brief 接收完整的HTTP请求(请求头 + Content-Length指定长度的请求体)
+ * @param client_socket 客户端socket
+ * @param request 输出的完整请求
+ * @param read_closed 输出客户端是否已关闭写方向(发送完请求后半关闭)
+ * @return 是否接收成功，超过RECV_TIMEOUT_MS仍未收完时返回false
+ * @note 每个连接在自己的线程中接收，截止时间保证不发送或只发送部分请求的客户端不会一直占用线程
+ */
+bool recv_http_request(int client_socket, std::string &request, bool &read_closed)
+{
+    read_closed = false;
+
+    char buffer[BUFFER_SIZE];
+    size_t header_end = std::string::npos;
+    size_t content_length = 0;
+    const int64_t t_deadline_us = ggml_time_us() + (int64_t)RECV_TIMEOUT_MS * 1000;
+
+    while (true)
+    {
+        if (header_end == std::string::npos)
+        {
+            header_end = request.find("\r\n\r\n");
+            if (header_end != std::string::npos)
+            {
+                header_end += 4;
+
+                // 解析Content-Length(不区分大小写)
+                std::string headers = request.substr(0, header_end);
+                std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+                size_t pos = headers.find("content-length:");
+                if (pos != std::string::npos)
+                {
+                    content_length = strtoull(headers.c_str() + pos + strlen("content-length:"), nullptr, 10);
+                }
+                if (content_length > MAX_REQUEST_SIZE)
+                {
+                    return false;
+                }
+            }
+        }
+        if (header_end != std::string::npos && request.length() >= header_end + content_length)
+        {
+            // 紧跟在请求之后的半关闭(没有更多数据可读，recv返回0)
+            char c;
+            read_closed = recv(client_socket, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+            return true;
+        }
+
+        const int64_t t_left_us = t_deadline_us - ggml_time_us();
+        struct pollfd pfd = {client_socket, POLLIN, 0};
+        if (t_left_us <= 0 || poll(&pfd, 1, (int)((t_left_us + 999) / 1000)) <= 0)
+        {
+            printf("[ERROR] Timed out receiving the request\n");
+            return false;
+        }
+
+        ssize_t n = recv(client_socket, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+        {
+            // 对端关闭连接：只要收到了请求头就按已收到的内容处理
+            read_closed = n == 0;
+            return header_end != std::string::npos || !request.empty();
+        }
+        request.append(buffer, n);
+        if (header_end == std::string::npos && request.length() > MAX_REQUEST_SIZE)
+        {
+            return false;
+        }
+    }
 }
 
 // SSE工具函数声明
-void send_sse_headers(int client_socket);
-void send_sse_message(int client_socket, const std::string &data);
-void send_sse_error(int client_socket, const std::string &error);
-void send_sse_done(int client_socket);
+bool send_sse_headers(int client_socket);
+bool send_sse_message(int client_socket, const std::string &data);
+bool send_sse_error(int client_socket, const std::string &error);
+bool send_sse_done(int client_socket);
 
 // 前向声明LLaMAServer类
 class LLaMAServer;
@@ -80,6 +233,15 @@ class LLaMAServer;
 // metrics处理函数声明
 void handle_metrics_request(int client_socket, LLaMAServer &llama);
 
+// embeddings处理函数声明
+void handle_embeddings_request(int client_socket, const char *request_body, LLaMAServer &llama);
+
+// rerank处理函数声明
+void handle_rerank_request(int client_socket, const char *request_body, LLaMAServer &llama);
+
+// 请求分发函数声明
+void process_request(int client_socket, const std::string &request, LLaMAServer &llama);
+
 // 使用nlohmann::json
 using json = nlohmann::json;
 
@@ -262,20 +424,431 @@ struct server_metrics
     }
 };
 
+
+// 追踪事件(Chrome trace的一个完整事件，ph = "X")
+struct trace_event
+{
+    const char *name = nullptr;       // 事件名称(静态字符串)
+    uint64_t request_id = 0;          // 所属请求，0表示不属于任何请求
+    int64_t t_start_us = 0;           // 开始时间
+    int64_t t_dur_us = 0;             // 持续时间
+    int tid = 0;                      // 记录事件的线程
+    const char *value_name = nullptr; // 附加数值的名称(token数、字节数等)，nullptr表示没有
+    int64_t value = 0;                // 附加数值
+};
+
+/**
+ * @brief 请求追踪的环形缓冲区
+ * @note 每个事件只是一次加锁和一个结构体的写入，开销可以忽略；
+ *       GET /trace 按需导出为Chrome trace JSON(chrome://tracing 或 Perfetto 打开)
+ */
+class trace_buffer
+{
+public:
+    void record(const char *name, uint64_t request_id, int64_t t_start_us, int64_t t_end_us,
+                const char *value_name = nullptr, int64_t value = 0)
+    {
+        static std::atomic<int> n_threads{0};
+        thread_local int tid = n_threads++;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        trace_event &ev = events[n_events % TRACE_BUFFER_SIZE];
+        ev.name = name;
+        ev.request_id = request_id;
+        ev.t_start_us = t_start_us;
+        ev.t_dur_us = t_end_us - t_start_us;
+        ev.tid = tid;
+        ev.value_name = value_name;
+        ev.value = value;
+        n_events++;
+    }
+
+    // 导出为Chrome trace JSON
+    json to_chrome_trace()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        json trace_events = json::array();
+        const uint64_t first = n_events > TRACE_BUFFER_SIZE ? n_events - TRACE_BUFFER_SIZE : 0;
+        for (uint64_t i = first; i < n_events; i++)
+        {
+            const trace_event &ev = events[i % TRACE_BUFFER_SIZE];
+            json args = {{"request", ev.request_id}};
+            if (ev.value_name)
+            {
+                args[ev.value_name] = ev.value;
+            }
+            trace_events.push_back({{"name", ev.name},
+                                    {"cat", "server"},
+                                    {"ph", "X"},
+                                    {"ts", ev.t_start_us},
+                                    {"dur", ev.t_dur_us},
+                                    {"pid", 1},
+                                    {"tid", ev.tid},
+                                    {"args", args}});
+        }
+
+        return {{"traceEvents", trace_events},
+                {"displayTimeUnit", "ms"},
+                {"otherData", {{"dropped_events", first}}}};
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<trace_event> events = std::vector<trace_event>(TRACE_BUFFER_SIZE);
+    uint64_t n_events = 0;
+};
+
+trace_buffer g_trace;
+
+// 作用域追踪：构造时记录开始时间，析构时写入一个事件
+struct trace_span
+{
+    trace_span(const char *name, uint64_t request_id, const char *value_name = nullptr, int64_t value = 0)
+        : name(name), request_id(request_id), value_name(value_name), value(value), t_start_us(ggml_time_us())
+    {
+    }
+
+    ~trace_span()
+    {
+        g_trace.record(name, request_id, t_start_us, ggml_time_us(), value_name, value);
+    }
+
+    const char *name;
+    uint64_t request_id;
+    const char *value_name;
+    int64_t value;
+    int64_t t_start_us;
+};
+
+// 请求优先级，数值越小越先处理
+enum request_priority
+{
+    PRIORITY_INTERACTIVE = 0, // 交互式请求(聊天)
+    PRIORITY_BATCH = 1,       // 批处理请求(嵌入、重排序等离线任务)
+    PRIORITY_COUNT
+};
+
+// 排队中的请求
+struct queued_request
+{
+    int client_socket = -1;
+    uint64_t id = 0;                                // 请求编号，用于追踪
+    std::string request;                            // 完整的HTTP请求
+    request_priority priority = PRIORITY_INTERACTIVE;
+    int64_t t_arrival_us = 0;                       // 到达时间
+    bool read_closed = false;                       // 客户端发送请求后关闭了写方向，仍在等待响应
+    int64_t t_deadline_us = 0;                      // 截止时间，超过后不再处理
+    int64_t n_predict_tokens = 0;                   // 预测的KV占用(prompt token数 + max_tokens)
+    uint64_t seq = 0;                               // 到达序号，优先级和截止时间相同时先到先服务
+};
+
+/**
+ * @brief 有界优先级请求队列
+ * @note 接收线程做准入控制并入队，推理线程按(优先级, 截止时间, 到达顺序)出队。
+ *       准入依据是排队和运行中请求的预测KV占用：超出预算的请求直接返回503和Retry-After，
+ *       而不是在TCP层超时，已在运行的请求的延迟不受影响。
+ */
+class request_queue
+{
+public:
+    explicit request_queue(int64_t kv_budget) : kv_budget(kv_budget) {}
+
+    /**
+     * @brief 准入控制并入队
+     * @param req 请求
+     * @param retry_after 被拒绝时建议的重试等待时间(秒)
+     * @param reason 被拒绝的原因
+     * @return 是否已入队
+     */
+    bool push(queued_request &&req, int &retry_after, std::string &reason)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        const int64_t t_now_us = ggml_time_us();
+
+        // 同优先级及更高优先级的请求都排在前面
+        int64_t kv_ahead = 0;
+        for (int p = 0; p <= req.priority; p++)
+        {
+            kv_ahead += kv_pending[p];
+        }
+        const int64_t kv_total = kv_pending[PRIORITY_INTERACTIVE] + kv_pending[PRIORITY_BATCH];
+        const int64_t kv_limit = req.priority == PRIORITY_BATCH ? (int64_t)(kv_budget * QUEUE_BATCH_SHARE) : kv_budget;
+
+        if (heap.size() >= QUEUE_MAX_SIZE)
+        {
+            reason = "Request queue is full";
+            retry_after = estimate_seconds(kv_ahead);
+        }
+        else if (kv_total > 0 && kv_total + req.n_predict_tokens > kv_limit)
+        {
+            reason = "Server overloaded";
+            retry_after = estimate_seconds(kv_total + req.n_predict_tokens - kv_limit);
+        }
+        else if (t_now_us + estimate_us(kv_ahead + req.n_predict_tokens) > req.t_deadline_us)
+        {
+            reason = "Deadline cannot be met";
+            retry_after = estimate_seconds(kv_ahead);
+        }
+        else
+        {
+            req.seq = n_seq++;
+            kv_pending[req.priority] += req.n_predict_tokens;
+            heap.push_back(std::move(req));
+            std::push_heap(heap.begin(), heap.end(), later);
+            cv.notify_one();
+            return true;
+        }
+
+        n_rejected++;
+        return false;
+    }
+
+    /**
+     * @brief 取出下一个要处理的请求(阻塞)
+     * @param req 输出的请求
+     */
+    void pop(queued_request &req)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]
+                { return !heap.empty(); });
+
+        std::pop_heap(heap.begin(), heap.end(), later);
+        req = std::move(heap.back());
+        heap.pop_back();
+    }
+
+    /**
+     * @brief 请求处理完成(或过期丢弃)，释放其KV预算并更新吞吐量估计
+     * @param req 请求
+     * @param t_processing_us 处理耗时，过期丢弃的请求为0
+     */
+    void on_done(const queued_request &req, int64_t t_processing_us)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        kv_pending[req.priority] -= req.n_predict_tokens;
+
+        if (t_processing_us > 0 && req.n_predict_tokens > 0)
+        {
+            // 指数滑动平均
+            const double rate = (double)req.n_predict_tokens / t_processing_us;
+            tokens_per_us = tokens_per_us > 0.0 ? 0.8 * tokens_per_us + 0.2 * rate : rate;
+        }
+        if (t_processing_us == 0)
+        {
+            n_expired++;
+        }
+    }
+
+    // 获取队列指标JSON
+    json get_metrics()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {
+            {"queue_size", heap.size()},
+            {"queue_kv_pending_interactive", kv_pending[PRIORITY_INTERACTIVE]},
+            {"queue_kv_pending_batch", kv_pending[PRIORITY_BATCH]},
+            {"queue_kv_budget", kv_budget},
+            {"queue_rejected_requests", n_rejected},
+            {"queue_expired_requests", n_expired}};
+    }
+
+private:
+    // 堆比较函数：a比b后处理时返回true
+    static bool later(const queued_request &a, const queued_request &b)
+    {
+        if (a.priority != b.priority)
+        {
+            return a.priority > b.priority;
+        }
+        if (a.t_deadline_us != b.t_deadline_us)
+        {
+            return a.t_deadline_us > b.t_deadline_us;
+        }
+        return a.seq > b.seq;
+    }
+
+    // 按当前吞吐量估计处理n_tokens所需的时间(微秒)，还没有测量值时认为很快
+    int64_t estimate_us(int64_t n_tokens) const
+    {
+        return tokens_per_us > 0.0 ? (int64_t)(n_tokens / tokens_per_us) : 0;
+    }
+
+    int estimate_seconds(int64_t n_tokens) const
+    {
+        const int64_t seconds = (estimate_us(n_tokens) + 999999) / 1000000;
+        return (int)std::min<int64_t>(std::max<int64_t>(seconds, 1), 60);
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<queued_request> heap;
+
+    const int64_t kv_budget;
+    int64_t kv_pending[PRIORITY_COUNT] = {0}; // 排队及运行中请求的预测KV占用
+    double tokens_per_us = 0.0;               // 吞吐量估计
+    uint64_t n_seq = 0;
+    uint64_t n_rejected = 0;
+    uint64_t n_expired = 0;
+};
+
+/**
+ * @brief 异步token输出流水线
+ * @note 推理线程采样出token后只把它放入队列，马上开始下一步decode；
+ *       detokenize和阻塞的socket发送由输出线程完成，与下一步的计算重叠。
+ *       输出线程每次取出所有已到达的token，合并成一次发送。
+ */
+class token_streamer
+{
+public:
+    /**
+     * @param vocab 词表
+     * @param client_socket SSE客户端socket，-1表示只收集文本不发送
+     * @param request_id 请求编号，用于追踪
+     * @param t_arrival_us 请求到达时间，用于记录首token延迟(TTFT)
+     */
+    token_streamer(const llama_vocab *vocab, int client_socket, uint64_t request_id, int64_t t_arrival_us)
+        : vocab(vocab), client_socket(client_socket), request_id(request_id), t_arrival_us(t_arrival_us)
+    {
+        worker = std::thread(&token_streamer::run, this);
+    }
+
+    ~token_streamer()
+    {
+        finish();
+    }
+
+    // 放入一个新采样的token
+    void push(llama_token token)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(token);
+        }
+        cv.notify_one();
+    }
+
+    // 等待所有token处理完毕并结束输出线程
+    void finish()
+    {
+        if (!worker.joinable())
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+
+    // 客户端是否已断开(发送失败)，推理线程据此取消请求
+    bool send_failed() const { return failed.load(std::memory_order_relaxed); }
+
+    // 以下只能在finish()之后调用
+    const std::string &get_text() const { return text; }
+    const std::string &get_error() const { return error; }
+
+private:
+    void run()
+    {
+        std::vector<llama_token> tokens;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]
+                        { return done || !pending.empty(); });
+                if (pending.empty())
+                {
+                    return; // done且没有剩余的token
+                }
+                tokens.swap(pending);
+            }
+
+            std::string messages;
+            for (llama_token token : tokens)
+            {
+                char buf[256];
+                int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
+                if (n < 0)
+                {
+                    error = "Failed to convert token to text";
+                    break;
+                }
+                text.append(buf, n);
+                messages += "data: " + std::string(buf, n) + "\n\n";
+            }
+            tokens.clear();
+
+            if (client_socket != -1 && !failed.load(std::memory_order_relaxed) && !messages.empty())
+            {
+                trace_span span("send", request_id, "bytes", messages.size());
+                if (!send_all(client_socket, messages))
+                {
+                    failed.store(true, std::memory_order_relaxed);
+                }
+            }
+            if (!first_sent && !text.empty())
+            {
+                // 首token延迟：从请求到达到第一段文本发出(非流式请求为第一段文本产生)
+                g_trace.record("ttft", request_id, t_arrival_us, ggml_time_us());
+                first_sent = true;
+            }
+            if (!error.empty())
+            {
+                failed.store(true, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    const llama_vocab *vocab;
+    const int client_socket;
+    const uint64_t request_id;
+    const int64_t t_arrival_us;
+    bool first_sent = false;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<llama_token> pending;
+    bool done = false;
+
+    std::atomic<bool> failed{false};
+    std::string text;
+    std::string error;
+
+    std::thread worker;
+};
+
 // LLaMA模型管理器类
 class LLaMAServer
 {
 private:
     llama_model *model = nullptr;
     llama_context *ctx = nullptr;
+    llama_context *ctx_embd = nullptr; // 嵌入专用上下文(多序列 + 池化)，首次请求时创建
+    llama_context *ctx_rank = nullptr; // 重排序专用上下文(多序列 + 分类头)，首次请求时创建
     llama_sampler *smpl = nullptr;
     std::vector<llama_chat_message> messages;
     std::vector<char> formatted;
-    int prev_len = 0;
+    llama_chat_renderer *renderer = nullptr; // 编译后的聊天模板，每轮只渲染新增的消息
     int client_socket = -1;
+    int watch_socket = -1;       // 当前请求的连接，用于检测客户端断开(流式和非流式请求都会设置)
+    bool cancelled = false;      // 当前请求是否因客户端断开而取消
+    int64_t t_last_check_us = 0; // 上次检查连接状态的时间
     server_metrics metrics;
     server_slot slot;
+    request_queue *queue = nullptr; // 请求队列，只用于导出队列指标
+    uint64_t request_id = 0;        // 当前请求的编号
+    int64_t request_t_arrival_us = 0;
+    bool request_read_closed = false; // 当前请求的客户端已半关闭，见client_disconnected
     std::string active_backend; // 添加后端状态记录
+    std::atomic<int> n_past{0}; // 对话在KV缓存中已占用的位置数，由处理线程更新，接收线程用于准入预测
 
 public:
     /**
@@ -321,9 +894,13 @@ public:
      * @param model_path 模型文件路
      * @param n_ctx 上下文窗口大小
      * @param n_gpu_layers GPU加速层数
+     * @param n_prefill_chunk prefill分块大小，即每步llama_decode的token预算
+     * @param n_layer_stream 流式加载层权重时提前预取的层数，0表示关闭(模型大于内存时使用)
+     * @param use_hugepages 是否用2MB大页存放CPU上的权重和KV缓存(减少解码时的TLB miss)
      * @return 初始化是否成功
      */
-    bool initialize(const std::string &model_path, int n_ctx = 2048, int n_gpu_layers = 99)
+    bool initialize(const std::string &model_path, int n_ctx = 2048, int n_gpu_layers = 99,
+                    int n_prefill_chunk = DEFAULT_PREFILL_CHUNK, int n_layer_stream = 0, bool use_hugepages = false)
     {
         // 首先初始化后端
         if (!initialize_backends())
@@ -335,6 +912,8 @@ public:
         // 初始化模型参数
         llama_model_params model_params = llama_model_default_params();
         model_params.n_gpu_layers = n_gpu_layers;
+        model_params.n_layer_stream = n_layer_stream;
+        model_params.use_hugepages = use_hugepages;
 
         // 加载模型
         model = llama_load_model_from_file(model_path.c_str(), model_params);
@@ -347,7 +926,8 @@ public:
         // 初始化上下文
         llama_context_params ctx_params = llama_context_default_params();
         ctx_params.n_ctx = n_ctx;
-        ctx_params.n_batch = n_ctx;
+        // 长prompt分块prefill，每步的token数(以及计算缓冲区)不超过一个分块
+        ctx_params.n_batch = std::min(n_ctx, n_prefill_chunk);
 
         ctx = llama_new_context_with_model(model, ctx_params);
         if (!ctx)
@@ -357,6 +937,9 @@ public:
             return false;
         }
 
+        // 客户端断开时中止正在进行的计算
+        llama_set_abort_callback(ctx, abort_callback, this);
+
         // 记录当前使用的后端
         active_backend = ggml_backend_get_name(llama_get_context_backend(ctx));
         printf("Using backend: %s\n", active_backend.c_str());
@@ -367,6 +950,14 @@ public:
         llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.8f));
         llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
 
+        // 聊天模板只检测(编译)一次，之后每轮增量渲染
+        renderer = llama_chat_renderer_init(llama_model_chat_template(model, nullptr));
+        if (!renderer)
+        {
+            fprintf(stderr, "Unsupported chat template, falling back to chatml\n");
+            renderer = llama_chat_renderer_init(nullptr);
+        }
+
         formatted.resize(llama_n_ctx(ctx));
 
         slot.id = 0;
@@ -378,26 +969,27 @@ public:
     /**
      * @brief 生成对用户输入的响应
      * @param user_input 用户输入本
+     * @param max_tokens 最多生成的token数，<=0表示不限制
      * @return 模型生成的响应文本
      */
-    std::string generate_response(const std::string &user_input)
+    std::string generate_response(const std::string &user_input, int max_tokens = -1)
     {
         // 设置槽位状态为处理中
         slot.set_state(server_slot::SLOT_STATE_PROCESSING);
 
-        // 记录开始时间（使用更高精度的时间计算）
-        int64_t start_time = ggml_time_us();
+        trace_span span_request("generate_response", request_id);
 
         // 将用户输入添加到消息列表
         messages.push_back({"user", strdup(user_input.c_str())});
 
-        // 应用聊天模板
-        int new_len = llama_chat_apply_template(model, nullptr, messages.data(), messages.size(), true,
+        // 应用聊天模板：只渲染上一轮之后新增的消息(以及助手的生成提示)
+        const int64_t t_template_start_us = ggml_time_us();
+        int new_len = llama_chat_renderer_apply(renderer, messages.data(), messages.size(), true,
                                                 formatted.data(), formatted.size());
         if (new_len > (int)formatted.size())
         {
             formatted.resize(new_len);
-            new_len = llama_chat_apply_template(model, nullptr, messages.data(), messages.size(), true,
+            new_len = llama_chat_renderer_apply(renderer, messages.data(), messages.size(), true,
                                                 formatted.data(), formatted.size());
         }
         if (new_len < 0)
@@ -407,29 +999,35 @@ public:
         }
 
         // 获取提示文本
-        std::string prompt(formatted.begin() + prev_len, formatted.begin() + new_len);
+        std::string prompt(formatted.begin(), formatted.begin() + new_len);
+        g_trace.record("chat_template", request_id, t_template_start_us, ggml_time_us(), "bytes", new_len);
 
-        // 记录 prompt 处理时间和 token 数量
-        int64_t prompt_time = ggml_time_us() - start_time;
-        slot.t_prompt_processing = static_cast<double>(prompt_time) / 1000.0;
-        slot.n_prompt_tokens_processed = new_len - prev_len;
+        // 本轮开始前KV缓存中的位置，取消时从这里回滚
+        const llama_pos n_past_start = llama_kv_self_seq_pos_max(ctx, 0) + 1;
 
-        printf("[DEBUG] Prompt processing details:\n");
-        printf("  Start time: %ld us\n", start_time);
-        printf("  End time: %ld us\n", ggml_time_us());
-        printf("  Processing time: %ld us (%.2f ms)\n", prompt_time, slot.t_prompt_processing);
-        printf("  Tokens processed: %d\n", slot.n_prompt_tokens_processed);
+        // 生成回复(prefill和decode的耗时在generate中记录)
+        std::string response = generate(prompt, max_tokens);
+        n_past = llama_kv_self_seq_pos_max(ctx, 0) + 1;
 
-        // 生成回复
-        int64_t generation_start = ggml_time_us();
-        std::string response = generate(prompt);
+        if (cancelled)
+        {
+            // 客户端已断开：释放本轮占用的KV单元并回滚对话，槽位立即可用于下一个请求
+            llama_kv_self_seq_rm(ctx, 0, n_past_start, -1);
+            n_past = n_past_start;
+
+            free(const_cast<char *>(messages.back().content));
+            messages.pop_back();
+            // 消息数少于已渲染的数量时渲染器会从头重新渲染(只更新状态，不输出)
+            llama_chat_renderer_apply(renderer, messages.data(), messages.size(), false, nullptr, 0);
 
-        // 记录生成时间
-        int64_t generation_time = ggml_time_us() - generation_start;
-        slot.t_token_generation = generation_time / 1000.0; // 转换为毫秒
+            g_trace.record("cancelled", request_id, request_t_arrival_us, ggml_time_us(), "decoded", slot.n_decoded);
 
-        printf("[DEBUG] Token generation: %d tokens in %.2f ms\n",
-               slot.n_decoded, slot.t_token_generation);
+            metrics.update_kv_cache_metrics(ctx);
+            metrics.on_request_failed();
+            slot.set_state(server_slot::SLOT_STATE_IDLE);
+
+            return response;
+        }
 
         // 更新指标
         metrics.on_prompt_eval(slot);
@@ -439,7 +1037,8 @@ public:
 
         // 将回复添加到消息列表
         messages.push_back({"assistant", strdup(response.c_str())});
-        prev_len = llama_chat_apply_template(model, nullptr, messages.data(), messages.size(), false, nullptr, 0);
+        // 推进模板状态：回复的文本已经在KV缓存中，下一轮从回复之后开始渲染
+        llama_chat_renderer_apply(renderer, messages.data(), messages.size(), false, nullptr, 0);
 
         // 处理完成，设置槽位状态为空闲
         slot.set_state(server_slot::SLOT_STATE_IDLE);
@@ -449,27 +1048,497 @@ public:
 
     void set_client_socket(int socket) { client_socket = socket; }
 
-private:
+    void set_watch_socket(int socket) { watch_socket = socket; }
+
+    void set_queue(request_queue *q) { queue = q; }
+
+    // 设置当前处理的请求(用于追踪和断开检测)
+    void set_request(uint64_t id, int64_t t_arrival_us, bool read_closed)
+    {
+        request_id = id;
+        request_t_arrival_us = t_arrival_us;
+        request_read_closed = read_closed;
+    }
+
+    int get_n_ctx() const { return llama_n_ctx(ctx); }
+
+    // 之前的对话轮次保留在KV缓存中，新请求只能使用剩余的上下文(可以在接收线程中调用)
+    int get_n_past() const { return n_past; }
+
     /**
-     * @brief 核生成数
-     * @param prompt 输入提示文本
-     * @return 成的文本响应
-     * @note 包含token处理、批处理、采样等核心逻辑
+     * @brief 统计文本的token数(只读取词表，可以在接收线程中调用)
+     * @param text 文本
+     * @return token数
      */
-    std::string generate(const std::string &prompt)
+    int count_tokens(const std::string &text) const
     {
-        std::string response;
-        slot.n_decoded = 0; // 重置解码计数
+        return -llama_tokenize(llama_model_get_vocab(model), text.c_str(), text.size(), NULL, 0, false, false);
+    }
 
-        // 1.分词处理
-        // 第一次调用llama_tokenize，用于获取token数量
-        const int n_prompt_tokens = -llama_tokenize(model, prompt.c_str(), prompt.size(), NULL, 0, true, true);
-        std::vector<llama_token> prompt_tokens(n_prompt_tokens);
+    bool is_cancelled() const { return cancelled; }
 
-        // 第二次调用llama_tokenize，用于获取token
-        if (llama_tokenize(model, prompt.c_str(), prompt.size(), prompt_tokens.data(), prompt_tokens.size(),
-                           llama_get_kv_cache_used_cells(ctx) == 0, true) < 0)
-        {
+    /**
+     * @brief 解码性能测试：固定的prompt预填充之后贪心解码n_tokens个token，输出prefill和decode的tokens/s
+     * @param n_tokens 解码的token数
+     * @return 是否成功
+     * @note 输入与采样都是确定的，用于比较不同内存配置(如-hp大页)下的速度，结束后清空KV缓存
+     */
+    bool benchmark(int n_tokens)
+    {
+        const llama_vocab *vocab = llama_model_get_vocab(model);
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+        const int n_ctx = llama_n_ctx(ctx);
+
+        std::vector<llama_token> tokens(std::min(BENCH_PROMPT_TOKENS, std::min((int)llama_n_batch(ctx), n_ctx / 2)));
+        // 有BOS的模型以BOS开头，没有BOS(LLAMA_TOKEN_NULL)的模型全部使用普通token
+        const llama_token bos = llama_vocab_bos(vocab);
+        const size_t i_first = bos != LLAMA_TOKEN_NULL ? 1 : 0;
+        if (i_first > 0)
+        {
+            tokens[0] = bos;
+        }
+        for (size_t i = i_first; i < tokens.size(); i++)
+        {
+            tokens[i] = (llama_token)((i * 7919) % n_vocab);
+        }
+        n_tokens = std::min(n_tokens, n_ctx - (int)tokens.size());
+
+        llama_kv_self_clear(ctx);
+
+        // prefill
+        const int64_t t_start_us = ggml_time_us();
+        llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
+        if (llama_decode(ctx, batch) != 0)
+        {
+            fprintf(stderr, "benchmark: failed to decode the prompt\n");
+            return false;
+        }
+        const int64_t t_prefill_us = ggml_time_us() - t_start_us;
+
+        // 逐token解码(贪心采样)
+        llama_token token;
+        for (int i = 0; i < n_tokens; i++)
+        {
+            const float *logits = llama_get_logits_ith(ctx, -1);
+            token = 0;
+            for (int j = 1; j < n_vocab; j++)
+            {
+                if (logits[j] > logits[token])
+                {
+                    token = j;
+                }
+            }
+
+            batch = llama_batch_get_one(&token, 1);
+            if (llama_decode(ctx, batch) != 0)
+            {
+                fprintf(stderr, "benchmark: failed to decode token %d\n", i);
+                llama_kv_self_clear(ctx);
+                return false;
+            }
+        }
+        const int64_t t_decode_us = ggml_time_us() - t_start_us - t_prefill_us;
+
+        printf("benchmark: prefill %zu tokens in %.2f ms (%.2f tokens/s), decode %d tokens in %.2f ms (%.2f tokens/s)\n",
+               tokens.size(), t_prefill_us / 1000.0, tokens.size() * 1e6 / t_prefill_us,
+               n_tokens, t_decode_us / 1000.0, n_tokens * 1e6 / std::max<int64_t>(t_decode_us, 1));
+
+        llama_kv_self_clear(ctx);
+        return true;
+    }
+
+    /**
+     * @brief 批量计算文本的池化嵌入向量
+     * @param inputs 输入文本列表
+     * @param embeddings 输出的嵌入向量(L2归一化)，与inputs一一对应
+     * @param n_tokens_total 输出的token总数
+     * @param error 失败时的错误信息
+     * @return 是否成功
+     * @note 按token长度排序后把多个文本打包到同一个多序列batch中，一次decode得到所有序列的池化向量
+     */
+    bool embed(const std::vector<std::string> &inputs, std::vector<std::vector<float>> &embeddings,
+               int &n_tokens_total, std::string &error)
+    {
+        if (!ctx_embd && !initialize_embeddings())
+        {
+            error = "Failed to create embedding context";
+            return false;
+        }
+
+        const llama_vocab *vocab = llama_model_get_vocab(model);
+        const int n_embd = llama_model_n_embd(model);
+        const int n_batch = llama_n_batch(ctx_embd);
+
+        // 1.分词
+        std::vector<std::vector<llama_token>> tokens(inputs.size());
+        n_tokens_total = 0;
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            const std::string &text = inputs[i];
+            int n = -llama_tokenize(vocab, text.c_str(), text.size(), NULL, 0, true, false);
+            tokens[i].resize(n);
+            if (llama_tokenize(vocab, text.c_str(), text.size(), tokens[i].data(), n, true, false) < 0)
+            {
+                error = "Failed to tokenize input " + std::to_string(i);
+                return false;
+            }
+            if (tokens[i].empty())
+            {
+                error = "Input " + std::to_string(i) + " is empty";
+                return false;
+            }
+            if ((int)tokens[i].size() > n_batch)
+            {
+                error = "Input " + std::to_string(i) + " is too long (" + std::to_string(tokens[i].size()) +
+                        " tokens, max " + std::to_string(n_batch) + ")";
+                return false;
+            }
+            n_tokens_total += tokens[i].size();
+        }
+
+        // 2.打包成多序列batch计算池化向量
+        std::vector<std::vector<float>> pooled;
+        if (!decode_pooled(ctx_embd, tokens, n_embd, pooled))
+        {
+            error = "Failed to decode";
+            return false;
+        }
+
+        // 3.L2归一化
+        embeddings.resize(inputs.size());
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            const std::vector<float> &embd = pooled[i];
+
+            double sum = 0.0;
+            for (int e = 0; e < n_embd; e++)
+            {
+                sum += embd[e] * embd[e];
+            }
+            const float norm = sum > 0.0 ? 1.0 / std::sqrt(sum) : 0.0f;
+
+            embeddings[i].resize(n_embd);
+            for (int e = 0; e < n_embd; e++)
+            {
+                embeddings[i][e] = embd[e] * norm;
+            }
+        }
+
+        metrics.on_request();
+
+        return true;
+    }
+
+    /**
+     * @brief 计算查询与每个文档的相关性分数(交叉编码器)
+     * @param query 查询文本
+     * @param documents 文档列表
+     * @param scores 输出的分数，与documents一一对应
+     * @param n_tokens_total 输出的token总数
+     * @param error 失败时的错误信息
+     * @return 是否成功
+     * @note 查询只分词一次，每个 查询+文档 对作为一个序列，多个序列打包到同一个batch中一起decode
+     */
+    bool rerank(const std::string &query, const std::vector<std::string> &documents, std::vector<float> &scores,
+                int &n_tokens_total, std::string &error)
+    {
+        if (!ctx_rank && !initialize_rerank(error))
+        {
+            return false;
+        }
+
+        const llama_vocab *vocab = llama_model_get_vocab(model);
+        const int n_batch = llama_n_batch(ctx_rank);
+
+        auto tokenize = [&](const std::string &text)
+        {
+            int n = -llama_tokenize(vocab, text.c_str(), text.size(), NULL, 0, false, false);
+            std::vector<llama_token> tokens(n);
+            if (llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), n, false, false) < 0)
+            {
+                tokens.clear();
+            }
+            return tokens;
+        };
+
+        // 1.查询只分词一次
+        const std::vector<llama_token> query_tokens = tokenize(query);
+        if (query_tokens.empty())
+        {
+            error = "Query is empty";
+            return false;
+        }
+        // [BOS] 查询 [EOS] [SEP] 文档 [EOS]
+        const int n_special = 4;
+        if ((int)query_tokens.size() + n_special >= n_batch)
+        {
+            error = "Query is too long (" + std::to_string(query_tokens.size()) + " tokens, max " +
+                    std::to_string(n_batch - n_special - 1) + ")";
+            return false;
+        }
+
+        // 2.构建 查询+文档 对，过长的文档截断到一个batch能容纳的长度
+        std::vector<std::vector<llama_token>> pairs(documents.size());
+        n_tokens_total = 0;
+        for (size_t i = 0; i < documents.size(); i++)
+        {
+            std::vector<llama_token> doc_tokens = tokenize(documents[i]);
+            const size_t n_doc_max = n_batch - n_special - query_tokens.size();
+            if (doc_tokens.size() > n_doc_max)
+            {
+                doc_tokens.resize(n_doc_max);
+            }
+
+            std::vector<llama_token> &pair = pairs[i];
+            auto push_special = [&](llama_token token)
+            {
+                // 词表中没有的特殊token直接跳过
+                if (token != LLAMA_TOKEN_NULL)
+                {
+                    pair.push_back(token);
+                }
+            };
+            pair.reserve(query_tokens.size() + doc_tokens.size() + n_special);
+            push_special(llama_vocab_bos(vocab));
+            pair.insert(pair.end(), query_tokens.begin(), query_tokens.end());
+            push_special(llama_vocab_eos(vocab));
+            push_special(llama_vocab_sep(vocab));
+            pair.insert(pair.end(), doc_tokens.begin(), doc_tokens.end());
+            push_special(llama_vocab_eos(vocab));
+
+            n_tokens_total += pair.size();
+        }
+
+        // 3.打包成多序列batch，分类头对每个序列输出一个分数
+        std::vector<std::vector<float>> pooled;
+        if (!decode_pooled(ctx_rank, pairs, 1, pooled))
+        {
+            error = "Failed to decode";
+            return false;
+        }
+
+        scores.resize(documents.size());
+        for (size_t i = 0; i < documents.size(); i++)
+        {
+            scores[i] = pooled[i][0];
+        }
+
+        metrics.on_request();
+
+        return true;
+    }
+
+private:
+    /**
+     * @brief 检查当前请求的客户端是否已断开
+     * @return 是否应取消当前请求
+     * @note 在decode的计算过程中也会被调用，所以做了限频
+     */
+    bool check_cancelled()
+    {
+        if (cancelled)
+        {
+            return true;
+        }
+        if (watch_socket == -1)
+        {
+            return false;
+        }
+
+        const int64_t t_now_us = ggml_time_us();
+        if (t_now_us - t_last_check_us < DISCONNECT_CHECK_US)
+        {
+            return false;
+        }
+        t_last_check_us = t_now_us;
+
+        cancelled = client_disconnected(watch_socket, request_read_closed);
+        return cancelled;
+    }
+
+    /**
+     * @brief llama_decode的中止回调，客户端断开后在当前ubatch的下一个计算节点处中止
+     */
+    static bool abort_callback(void *data)
+    {
+        return static_cast<LLaMAServer *>(data)->check_cancelled();
+    }
+
+    /**
+     * @brief 把多个token序列打包成多序列batch，用尽量少的decode计算每个序列的池化输出
+     * @param pctx 池化上下文(嵌入或重排序)
+     * @param seqs token序列，每个序列的长度不超过n_batch
+     * @param n_out 每个序列的池化输出长度
+     * @param out 输出，与seqs一一对应
+     * @return 是否成功
+     */
+    bool decode_pooled(llama_context *pctx, const std::vector<std::vector<llama_token>> &seqs, int n_out,
+                       std::vector<std::vector<float>> &out)
+    {
+        const int n_batch = llama_n_batch(pctx);
+        const int n_seq_max = llama_n_seq_max(pctx);
+
+        // 按长度降序排序，长度相近的序列进入同一个batch，减少一个batch内长短序列混合带来的浪费
+        std::vector<size_t> order(seqs.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                         { return seqs[a].size() > seqs[b].size(); });
+
+        out.assign(seqs.size(), std::vector<float>());
+
+        llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+        // 贪心打包：不超过n_batch个token、n_seq_max个序列
+        size_t i0 = 0;
+        while (i0 < order.size())
+        {
+            size_t i1 = i0;
+            int n_tokens = 0;
+            while (i1 < order.size() && (int)(i1 - i0) < n_seq_max &&
+                   n_tokens + (int)seqs[order[i1]].size() <= n_batch)
+            {
+                n_tokens += seqs[order[i1]].size();
+                i1++;
+            }
+
+            batch.n_tokens = 0;
+            for (size_t k = i0; k < i1; k++)
+            {
+                const std::vector<llama_token> &seq = seqs[order[k]];
+                for (size_t p = 0; p < seq.size(); p++)
+                {
+                    const int j = batch.n_tokens++;
+                    batch.token[j] = seq[p];
+                    batch.pos[j] = p;
+                    batch.n_seq_id[j] = 1;
+                    batch.seq_id[j][0] = k - i0;
+                    batch.logits[j] = true;
+                }
+            }
+
+            // 每个batch都从空的KV缓存开始
+            llama_kv_self_clear(pctx);
+            trace_span span("pooled_decode", request_id, "tokens", batch.n_tokens);
+            if (llama_decode(pctx, batch))
+            {
+                llama_batch_free(batch);
+                return false;
+            }
+
+            for (size_t k = i0; k < i1; k++)
+            {
+                const float *pooled = llama_get_embeddings_seq(pctx, k - i0);
+                if (!pooled)
+                {
+                    llama_batch_free(batch);
+                    return false;
+                }
+                out[order[k]].assign(pooled, pooled + n_out);
+            }
+
+            i0 = i1;
+        }
+
+        llama_batch_free(batch);
+
+        return true;
+    }
+
+    /**
+     * @brief 创建重排序专用上下文
+     * @param error 失败时的错误信息
+     * @return 是否成功
+     * @note 要求模型带有分类头(池化类型为rank)
+     */
+    bool initialize_rerank(std::string &error)
+    {
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.n_ctx = EMBD_N_BATCH;
+        ctx_params.n_batch = EMBD_N_BATCH;
+        ctx_params.n_ubatch = EMBD_N_BATCH;
+        ctx_params.n_seq_max = EMBD_N_SEQ_MAX;
+        ctx_params.embeddings = true;
+
+        // 池化类型取模型自带的设置，只有重排序模型才是rank
+        ctx_rank = llama_init_from_model(model, ctx_params);
+        if (!ctx_rank)
+        {
+            error = "Failed to create rerank context";
+            return false;
+        }
+        if (llama_pooling_type(ctx_rank) != LLAMA_POOLING_TYPE_RANK)
+        {
+            llama_free(ctx_rank);
+            ctx_rank = nullptr;
+            error = "The model does not support reranking";
+            return false;
+        }
+
+        printf("Rerank context: n_batch = %d, n_seq_max = %d\n",
+               llama_n_batch(ctx_rank), llama_n_seq_max(ctx_rank));
+
+        return true;
+    }
+
+    /**
+     * @brief 创建嵌入专用上下文
+     * @return 是否成功
+     * @note 整个batch作为一个ubatch计算，池化需要序列的全部token在同一个ubatch中
+     */
+    bool initialize_embeddings()
+    {
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.n_ctx = EMBD_N_BATCH;
+        ctx_params.n_batch = EMBD_N_BATCH;
+        ctx_params.n_ubatch = EMBD_N_BATCH;
+        ctx_params.n_seq_max = EMBD_N_SEQ_MAX;
+        ctx_params.embeddings = true;
+
+        ctx_embd = llama_init_from_model(model, ctx_params);
+        if (ctx_embd && llama_pooling_type(ctx_embd) == LLAMA_POOLING_TYPE_NONE)
+        {
+            // 生成模型没有池化层，使用平均池化
+            llama_free(ctx_embd);
+            ctx_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+            ctx_embd = llama_init_from_model(model, ctx_params);
+        }
+
+        if (!ctx_embd)
+        {
+            fprintf(stderr, "Failed to create embedding context\n");
+            return false;
+        }
+
+        printf("Embedding context: n_batch = %d, n_seq_max = %d, pooling = %d\n",
+               llama_n_batch(ctx_embd), llama_n_seq_max(ctx_embd), llama_pooling_type(ctx_embd));
+
+        return true;
+    }
+
+    /**
+     * @brief 核生成数
+     * @param prompt 输入提示文本
+     * @return 成的文本响应
+     * @note 包含token处理、批处理、采样等核心逻辑
+     */
+    std::string generate(const std::string &prompt, int max_tokens)
+    {
+        slot.n_decoded = 0; // 重置解码计数
+        cancelled = false;
+        t_last_check_us = 0;
+
+        const int64_t t_start_us = ggml_time_us();
+        const llama_perf_context_data perf_start = llama_perf_context(ctx);
+
+        // 1.分词处理
+        // 第一次调用llama_tokenize，用于获取token数量
+        const int n_prompt_tokens = -llama_tokenize(model, prompt.c_str(), prompt.size(), NULL, 0, true, true);
+        std::vector<llama_token> prompt_tokens(n_prompt_tokens);
+
+        // 第二次调用llama_tokenize，用于获取token
+        if (llama_tokenize(model, prompt.c_str(), prompt.size(), prompt_tokens.data(), prompt_tokens.size(),
+                           llama_get_kv_cache_used_cells(ctx) == 0, true) < 0)
+        {
             // 设置槽位状态为错误
             slot.set_state(server_slot::SLOT_STATE_ERROR);
             if (client_socket != -1)
@@ -478,40 +1547,70 @@ private:
             }
             return "Error: Failed to tokenize prompt";
         }
+        g_trace.record("tokenize", request_id, t_start_us, ggml_time_us(), "tokens", n_prompt_tokens);
 
-        // 2.准备批处理
-        llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
+        // 2.准备批处理：prompt按n_batch分块，每次llama_decode只处理一个分块，
+        //   单次计算的耗时有上界，分块之间可以及时响应取消
+        const int n_chunk = llama_n_batch(ctx);
+        int n_prefilled = std::min(n_chunk, n_prompt_tokens);
+        llama_batch batch = llama_batch_get_one(prompt_tokens.data(), n_prefilled);
         llama_token new_token_id;
 
+        // detokenize和SSE发送在输出线程中完成，与下一步的decode重叠
+        token_streamer streamer(llama_model_get_vocab(model), client_socket, request_id, request_t_arrival_us);
+        std::string error;
+        bool prefilling = true;
+        int64_t t_prefill_end_us = 0;
+
         // 3.生成回复
         while (true)
         {
             // 3.1 检查上下文空间
             int n_ctx = llama_n_ctx(ctx);
             int n_ctx_used = llama_get_kv_cache_used_cells(ctx); // 获取已使用单元数
-            if (n_ctx_used + batch.n_tokens > n_ctx)
+            if (n_ctx_used + batch.n_tokens + (n_prompt_tokens - n_prefilled) > n_ctx) // 包括还没有处理的prompt分块
             {
-                if (client_socket != -1)
-                {
-                    send_sse_error(client_socket, "Context size exceeded");
-                }
-                return response + "\nContext size exceeded";
+                error = "Context size exceeded";
+                break;
             }
 
             // 3.2 解码处理
-            if (llama_decode(ctx, batch))
+            const int64_t t_decode_start_us = ggml_time_us();
+            const int ret = llama_decode(ctx, batch);
+            g_trace.record(prefilling ? "prefill_chunk" : "decode", request_id, t_decode_start_us, ggml_time_us(),
+                           "tokens", batch.n_tokens);
+            if (ret == 2 || check_cancelled() || streamer.send_failed())
+            {
+                // 计算被中止或客户端已断开，本轮的KV单元由generate_response统一释放
+                cancelled = true;
+                break;
+            }
+            if (ret != 0)
             {
                 // 设置槽位状态为错误
                 slot.set_state(server_slot::SLOT_STATE_ERROR);
-                if (client_socket != -1)
-                {
-                    send_sse_error(client_socket, "Failed to decode");
-                }
-                return response + "\nFailed to decode";
+                error = "Failed to decode";
+                break;
+            }
+
+            // prompt还没有处理完，继续下一个分块(中间分块的输出不需要采样)
+            if (n_prefilled < n_prompt_tokens)
+            {
+                const int n = std::min(n_chunk, n_prompt_tokens - n_prefilled);
+                batch = llama_batch_get_one(prompt_tokens.data() + n_prefilled, n);
+                n_prefilled += n;
+                continue;
+            }
+            if (prefilling)
+            {
+                prefilling = false;
+                t_prefill_end_us = ggml_time_us();
             }
 
             // 3.3 采样下一个token
+            const int64_t t_sample_start_us = ggml_time_us();
             new_token_id = llama_sampler_sample(smpl, ctx, -1);
+            g_trace.record("sample", request_id, t_sample_start_us, ggml_time_us());
 
             // 检查是否结束
             if (llama_token_is_eog(model, new_token_id))
@@ -519,39 +1618,59 @@ private:
                 break;
             }
 
-            // 转换token为文本
-            char buf[256];
-            int n = llama_token_to_piece(model, new_token_id, buf, sizeof(buf), 0, true);
-            if (n < 0)
+            // 交给输出线程，不等待发送完成就开始下一步decode
+            streamer.push(new_token_id);
+
+            // 准备下一个token的批理
+            batch = llama_batch_get_one(&new_token_id, 1);
+
+            slot.n_decoded++;                                   // 增加解码计数
+            metrics.on_decoded(std::vector<server_slot>{slot}); // 更新解码统计
+
+            if (max_tokens > 0 && slot.n_decoded >= max_tokens)
             {
-                if (client_socket != -1)
-                {
-                    send_sse_error(client_socket, "Failed to convert token to text");
-                }
-                return response + "\nFailed to convert token to text";
+                break;
             }
+        }
+
+        // 等待输出线程发送完已采样的token
+        streamer.finish();
+        std::string response = streamer.get_text();
+
+        // prefill(含分词)和decode的实际耗时，以及其中ggml图计算的时间
+        const int64_t t_end_us = ggml_time_us();
+        if (t_prefill_end_us == 0)
+        {
+            t_prefill_end_us = t_end_us;
+        }
+        slot.n_prompt_tokens_processed = n_prefilled;
+        slot.t_prompt_processing = (t_prefill_end_us - t_start_us) / 1000.0;
+        slot.t_token_generation = (t_end_us - t_prefill_end_us) / 1000.0;
 
-            std::string piece(buf, n);
-            response += piece;
+        const llama_perf_context_data perf_end = llama_perf_context(ctx);
+        const double t_compute_ms = (perf_end.t_p_eval_ms - perf_start.t_p_eval_ms) + (perf_end.t_eval_ms - perf_start.t_eval_ms);
+        g_trace.record("generate", request_id, t_start_us, t_end_us, "graph_compute_us", (int64_t)(t_compute_ms * 1000.0));
+
+        if (error.empty() && !streamer.get_error().empty())
+        {
+            error = streamer.get_error();
+        }
 
-            // 如果设置了client_socket，发送SSE消息
+        if (!error.empty())
+        {
             if (client_socket != -1)
             {
-                send_sse_message(client_socket, piece);
+                send_sse_error(client_socket, error);
             }
-
-            // 准备下一个token的批理
-            batch = llama_batch_get_one(&new_token_id, 1);
-
-            slot.n_decoded++;                                   // 增加解码计数
-            metrics.on_decoded(std::vector<server_slot>{slot}); // 更新解码统计
+            return response + "\n" + error;
         }
 
         // 发送完成信号
-        if (client_socket != -1)
+        if (client_socket != -1 && !cancelled && !streamer.send_failed())
         {
             send_sse_done(client_socket);
         }
+        cancelled = cancelled || streamer.send_failed();
 
         return response;
     }
@@ -564,10 +1683,22 @@ public:
         {
             free(const_cast<char *>(msg.content));
         }
+        if (renderer)
+        {
+            llama_chat_renderer_free(renderer);
+        }
         if (smpl)
         {
             llama_sampler_free(smpl);
         }
+        if (ctx_rank)
+        {
+            llama_free(ctx_rank);
+        }
+        if (ctx_embd)
+        {
+            llama_free(ctx_embd);
+        }
         if (ctx)
         {
             llama_free(ctx);
@@ -581,7 +1712,12 @@ public:
     // 添加获取指标的方法
     json get_metrics()
     {
-        return metrics.get_metrics();
+        json result = metrics.get_metrics();
+        if (queue)
+        {
+            result.update(queue->get_metrics());
+        }
+        return result;
     }
 };
 
@@ -611,7 +1747,7 @@ void handle_http_request(int client_socket, const char *request_body, LLaMAServe
             "Access-Control-Allow-Headers: Content-Type, Accept\r\n"
             "Content-Length: 0\r\n"
             "\r\n";
-        send(client_socket, cors_response, strlen(cors_response), 0);
+        send_all(client_socket, cors_response);
         return;
     }
 
@@ -619,8 +1755,7 @@ void handle_http_request(int client_socket, const char *request_body, LLaMAServe
     cJSON *request = cJSON_Parse(request_body);
     if (!request)
     {
-        std::string error_response = format_error_response("Invalid JSON", ERROR_TYPE_INVALID_REQUEST);
-        send(client_socket, error_response.c_str(), error_response.length(), 0);
+        send_all(client_socket, format_error_response("Invalid JSON", ERROR_TYPE_INVALID_REQUEST));
         return;
     }
 
@@ -628,8 +1763,7 @@ void handle_http_request(int client_socket, const char *request_body, LLaMAServe
     cJSON *prompt_item = cJSON_GetObjectItem(request, "prompt");
     if (!cJSON_IsString(prompt_item))
     {
-        std::string error_response = format_error_response("Missing prompt field", ERROR_TYPE_INVALID_REQUEST);
-        send(client_socket, error_response.c_str(), error_response.length(), 0);
+        send_all(client_socket, format_error_response("Missing prompt field", ERROR_TYPE_INVALID_REQUEST));
         cJSON_Delete(request);
         return;
     }
@@ -638,6 +1772,10 @@ void handle_http_request(int client_socket, const char *request_body, LLaMAServe
     cJSON *stream_item = cJSON_GetObjectItem(request, "stream");
     bool use_stream = stream_item && cJSON_IsTrue(stream_item);
 
+    // 最多生成的token数
+    cJSON *max_tokens_item = cJSON_GetObjectItem(request, "max_tokens");
+    int max_tokens = cJSON_IsNumber(max_tokens_item) ? max_tokens_item->valueint : -1;
+
     if (use_stream)
     {
         // 发送SSE头
@@ -645,13 +1783,29 @@ void handle_http_request(int client_socket, const char *request_body, LLaMAServe
 
         // 设置client_socket并生成响应
         llama.set_client_socket(client_socket);
-        llama.generate_response(prompt_item->valuestring);
+        llama.set_watch_socket(client_socket);
+        llama.generate_response(prompt_item->valuestring, max_tokens);
         llama.set_client_socket(-1); // 重置socket
+        llama.set_watch_socket(-1);
+
+        if (llama.is_cancelled())
+        {
+            // 主循环不会关闭流式连接，已断开的连接在这里关闭
+            close(client_socket);
+        }
     }
     else
     {
         // 生成回复
-        std::string response = llama.generate_response(prompt_item->valuestring);
+        llama.set_watch_socket(client_socket);
+        std::string response = llama.generate_response(prompt_item->valuestring, max_tokens);
+        llama.set_watch_socket(-1);
+
+        if (llama.is_cancelled())
+        {
+            cJSON_Delete(request);
+            return;
+        }
 
         // 构建JSON响应
         cJSON *json_response = cJSON_CreateObject();
@@ -662,7 +1816,7 @@ void handle_http_request(int client_socket, const char *request_body, LLaMAServe
         std::string http_response = format_success_response(response_str);
 
         // 发送响应
-        send(client_socket, http_response.c_str(), http_response.length(), 0);
+        send_all(client_socket, http_response);
 
         free(response_str);
         cJSON_Delete(json_response);
@@ -677,8 +1831,9 @@ void handle_http_request(int client_socket, const char *request_body, LLaMAServe
 /**
  * @brief 发送SSE头部信息
  * @param client_socket 客户端socket
+ * @return 是否发送成功(失败说明客户端已断开)
  */
-void send_sse_headers(int client_socket)
+bool send_sse_headers(int client_socket)
 {
     const char *headers =
         "HTTP/1.1 200 OK\r\n"
@@ -687,39 +1842,39 @@ void send_sse_headers(int client_socket)
         "Connection: keep-alive\r\n"
         "Access-Control-Allow-Origin: *\r\n"
         "\r\n";
-    send(client_socket, headers, strlen(headers), 0);
+    return send_all(client_socket, headers);
 }
 
 /**
  * @brief 发送SSE消息
  * @param client_socket 客户端socket
  * @param data 消息内容
+ * @return 是否发送成功(失败说明客户端已断开)
  */
-void send_sse_message(int client_socket, const std::string &data)
+bool send_sse_message(int client_socket, const std::string &data)
 {
-    std::string message = "data: " + data + "\n\n";
-    send(client_socket, message.c_str(), message.length(), 0);
+    return send_all(client_socket, "data: " + data + "\n\n");
 }
 
 /**
  * @brief 发送SSE错误消息
  * @param client_socket 客户端socket
  * @param error 错误信息
+ * @return 是否发送成功(失败说明客户端已断开)
  */
-void send_sse_error(int client_socket, const std::string &error)
+bool send_sse_error(int client_socket, const std::string &error)
 {
-    std::string message = "event: error\ndata: " + error + "\n\n";
-    send(client_socket, message.c_str(), message.length(), 0);
+    return send_all(client_socket, "event: error\ndata: " + error + "\n\n");
 }
 
 /**
  * @brief 发送SSE完成消息
  * @param client_socket 客户端socket
+ * @return 是否发送成功(失败说明客户端已断开)
  */
-void send_sse_done(int client_socket)
+bool send_sse_done(int client_socket)
 {
-    const char *message = "data: [DONE]\n\n";
-    send(client_socket, message, strlen(message), 0);
+    return send_all(client_socket, "data: [DONE]\n\n");
 }
 
 /**
@@ -760,8 +1915,8 @@ void handle_metrics_request(int client_socket, LLaMAServer &llama)
             response_str;
 
         // 发送响应
-        ssize_t sent = send(client_socket, response.c_str(), response.length(), 0);
-        printf("[DEBUG] Sent %zd bytes\n", sent);
+        const bool sent = send_all(client_socket, response);
+        printf("[DEBUG] Sent %zu bytes\n", sent ? response.length() : 0);
     }
     catch (const std::exception &e)
     {
@@ -786,7 +1941,385 @@ void handle_metrics_request(int client_socket, LLaMAServer &llama)
                                                  "\r\n" +
             error_str;
 
-        send(client_socket, response.c_str(), response.length(), 0);
+        send_all(client_socket, response);
+    }
+}
+
+/**
+ * @brief 处理/v1/embeddings请求(OpenAI兼容)
+ * @param client_socket 客户端socket
+ * @param request_body 请求体数据，{"input": "文本" 或 ["文本1", "文本2", ...]}
+ * @param llama LLaMA服务器实例
+ */
+void handle_embeddings_request(int client_socket, const char *request_body, LLaMAServer &llama)
+{
+    cJSON *request = cJSON_Parse(request_body);
+    if (!request)
+    {
+        send_all(client_socket, format_error_response("Invalid JSON", ERROR_TYPE_INVALID_REQUEST));
+        return;
+    }
+
+    // 获取input字段(字符串或字符串数组)
+    std::vector<std::string> inputs;
+    cJSON *input_item = cJSON_GetObjectItem(request, "input");
+    if (cJSON_IsString(input_item))
+    {
+        inputs.push_back(input_item->valuestring);
+    }
+    else if (cJSON_IsArray(input_item))
+    {
+        cJSON *item = nullptr;
+        cJSON_ArrayForEach(item, input_item)
+        {
+            if (!cJSON_IsString(item))
+            {
+                inputs.clear();
+                break;
+            }
+            inputs.push_back(item->valuestring);
+        }
+    }
+    cJSON_Delete(request);
+
+    if (inputs.empty())
+    {
+        send_all(client_socket, format_error_response("Missing or invalid input field", ERROR_TYPE_INVALID_REQUEST));
+        return;
+    }
+
+    std::vector<std::vector<float>> embeddings;
+    int n_tokens = 0;
+    std::string error;
+    if (!llama.embed(inputs, embeddings, n_tokens, error))
+    {
+        send_all(client_socket, format_error_response(error, ERROR_TYPE_INVALID_REQUEST));
+        return;
+    }
+
+    // 构建OpenAI格式的响应
+    json data = json::array();
+    for (size_t i = 0; i < embeddings.size(); i++)
+    {
+        data.push_back({{"object", "embedding"},
+                        {"index", i},
+                        {"embedding", embeddings[i]}});
+    }
+    json response_data = {
+        {"object", "list"},
+        {"data", data},
+        {"usage", {{"prompt_tokens", n_tokens}, {"total_tokens", n_tokens}}}};
+
+    send_all(client_socket, format_success_response(response_data.dump()));
+}
+
+/**
+ * @brief 处理/v1/rerank请求
+ * @param client_socket 客户端socket
+ * @param request_body 请求体数据，{"query": "查询", "documents": ["文档1", ...], "top_n": 10}
+ * @param llama LLaMA服务器实例
+ */
+void handle_rerank_request(int client_socket, const char *request_body, LLaMAServer &llama)
+{
+    cJSON *request = cJSON_Parse(request_body);
+    if (!request)
+    {
+        send_all(client_socket, format_error_response("Invalid JSON", ERROR_TYPE_INVALID_REQUEST));
+        return;
+    }
+
+    cJSON *query_item = cJSON_GetObjectItem(request, "query");
+    if (!cJSON_IsString(query_item))
+    {
+        cJSON_Delete(request);
+        send_all(client_socket, format_error_response("Missing query field", ERROR_TYPE_INVALID_REQUEST));
+        return;
+    }
+    std::string query = query_item->valuestring;
+
+    std::vector<std::string> documents;
+    cJSON *documents_item = cJSON_GetObjectItem(request, "documents");
+    if (cJSON_IsArray(documents_item))
+    {
+        cJSON *item = nullptr;
+        cJSON_ArrayForEach(item, documents_item)
+        {
+            if (!cJSON_IsString(item))
+            {
+                documents.clear();
+                break;
+            }
+            documents.push_back(item->valuestring);
+        }
+    }
+
+    int top_n = documents.size();
+    cJSON *top_n_item = cJSON_GetObjectItem(request, "top_n");
+    if (cJSON_IsNumber(top_n_item) && top_n_item->valueint > 0)
+    {
+        top_n = std::min(top_n, top_n_item->valueint);
+    }
+    cJSON_Delete(request);
+
+    if (documents.empty())
+    {
+        send_all(client_socket, format_error_response("Missing or invalid documents field", ERROR_TYPE_INVALID_REQUEST));
+        return;
+    }
+
+    std::vector<float> scores;
+    int n_tokens = 0;
+    std::string error;
+    if (!llama.rerank(query, documents, scores, n_tokens, error))
+    {
+        send_all(client_socket, format_error_response(error, ERROR_TYPE_INVALID_REQUEST));
+        return;
+    }
+
+    // 按分数降序返回前top_n个文档
+    std::vector<size_t> order(documents.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                     { return scores[a] > scores[b]; });
+
+    json results = json::array();
+    for (int i = 0; i < top_n; i++)
+    {
+        results.push_back({{"index", order[i]},
+                           {"relevance_score", scores[order[i]]}});
+    }
+    json response_data = {
+        {"object", "list"},
+        {"results", results},
+        {"usage", {{"prompt_tokens", n_tokens}, {"total_tokens", n_tokens}}}};
+
+    send_all(client_socket, format_success_response(response_data.dump()));
+}
+
+/**
+ * @brief 按路径分发请求
+ * @param client_socket 客户端socket
+ * @param request 完整的HTTP请求
+ * @param llama LLaMA服务器实例
+ */
+void process_request(int client_socket, const std::string &request, LLaMAServer &llama)
+{
+    const char *buffer = request.c_str();
+    printf("[DEBUG] Received request (%zu bytes):\n%.*s\n", request.length(), BUFFER_SIZE, buffer);
+
+    // 检查是否是 GET /metrics 请求
+    if (strstr(buffer, "GET /metrics") != NULL)
+    {
+        handle_metrics_request(client_socket, llama);
+    }
+    else if (strncmp(buffer, "GET /trace", strlen("GET /trace")) == 0)
+    {
+        // 导出请求追踪时间线(Chrome trace格式)
+        send_all(client_socket, format_success_response(g_trace.to_chrome_trace().dump()));
+    }
+    else
+    {
+        // 查找HTTP请求体
+        const char *body = strstr(buffer, "\r\n\r\n");
+        if (body)
+        {
+            body += 4; // 跳过\r\n\r\n
+            if (strncmp(buffer, "POST /v1/embeddings", strlen("POST /v1/embeddings")) == 0)
+            {
+                handle_embeddings_request(client_socket, body, llama);
+            }
+            else if (strncmp(buffer, "POST /v1/rerank", strlen("POST /v1/rerank")) == 0)
+            {
+                handle_rerank_request(client_socket, body, llama);
+            }
+            else
+            {
+                handle_http_request(client_socket, body, llama);
+            }
+        }
+    }
+
+    // 对于非流式请求，关闭连接
+    if (request.find("\"stream\":true") == std::string::npos)
+    {
+        close(client_socket);
+    }
+}
+
+/**
+ * @brief 确定请求的优先级、截止时间，并预测其KV占用
+ * @param req 请求(request和t_arrival_us已填写)
+ * @param llama LLaMA服务器实例(只用于分词计数)
+ * @param error 请求无效时的错误信息
+ * @return 请求是否有效
+ * @note 请求体中可选 "priority": "interactive"/"batch" 和 "deadline_ms"(相对到达时间)。
+ *       聊天请求默认为交互式，嵌入和重排序请求默认为批处理。
+ */
+bool classify_request(queued_request &req, LLaMAServer &llama, std::string &error)
+{
+    const char *buffer = req.request.c_str();
+    const bool is_embeddings = strncmp(buffer, "POST /v1/embeddings", strlen("POST /v1/embeddings")) == 0;
+    const bool is_rerank = strncmp(buffer, "POST /v1/rerank", strlen("POST /v1/rerank")) == 0;
+
+    req.priority = (is_embeddings || is_rerank) ? PRIORITY_BATCH : PRIORITY_INTERACTIVE;
+    req.t_deadline_us = req.t_arrival_us + (int64_t)DEFAULT_DEADLINE_MS * 1000;
+    req.n_predict_tokens = 0;
+
+    const char *body = strstr(buffer, "\r\n\r\n");
+    cJSON *request = body ? cJSON_Parse(body + 4) : nullptr;
+    if (!request)
+    {
+        // 没有JSON请求体的请求(metrics、OPTIONS等)不占用KV，无效的JSON由处理函数报错
+        return true;
+    }
+
+    cJSON *priority_item = cJSON_GetObjectItem(request, "priority");
+    if (cJSON_IsString(priority_item))
+    {
+        if (strcmp(priority_item->valuestring, "interactive") == 0)
+        {
+            req.priority = PRIORITY_INTERACTIVE;
+        }
+        else if (strcmp(priority_item->valuestring, "batch") == 0)
+        {
+            req.priority = PRIORITY_BATCH;
+        }
+    }
+
+    cJSON *deadline_item = cJSON_GetObjectItem(request, "deadline_ms");
+    if (cJSON_IsNumber(deadline_item) && deadline_item->valuedouble > 0)
+    {
+        req.t_deadline_us = req.t_arrival_us + (int64_t)(deadline_item->valuedouble * 1000);
+    }
+
+    // 预测KV占用：prompt token数 + 生成token数
+    auto count_item = [&](cJSON *item)
+    {
+        int64_t n = 0;
+        if (cJSON_IsString(item))
+        {
+            n += llama.count_tokens(item->valuestring);
+        }
+        else if (cJSON_IsArray(item))
+        {
+            cJSON *child = nullptr;
+            cJSON_ArrayForEach(child, item)
+            {
+                if (cJSON_IsString(child))
+                {
+                    n += llama.count_tokens(child->valuestring);
+                }
+            }
+        }
+        return n;
+    };
+
+    if (is_embeddings)
+    {
+        req.n_predict_tokens = count_item(cJSON_GetObjectItem(request, "input"));
+    }
+    else if (is_rerank)
+    {
+        // 每个文档都和查询拼成一个序列
+        cJSON *documents_item = cJSON_GetObjectItem(request, "documents");
+        const int64_t n_docs = cJSON_IsArray(documents_item) ? cJSON_GetArraySize(documents_item) : 0;
+        req.n_predict_tokens = count_item(documents_item) + n_docs * count_item(cJSON_GetObjectItem(request, "query"));
+    }
+    else
+    {
+        cJSON *max_tokens_item = cJSON_GetObjectItem(request, "max_tokens");
+        const int64_t n_gen = cJSON_IsNumber(max_tokens_item) && max_tokens_item->valueint > 0 ? max_tokens_item->valueint : DEFAULT_PREDICT_TOKENS;
+        req.n_predict_tokens = count_item(cJSON_GetObjectItem(request, "prompt")) + n_gen;
+
+        // 之前的轮次仍在KV缓存中，只计入上下文检查；队列的KV预算只统计新占用的单元
+        const int64_t n_past = llama.get_n_past();
+        if (n_past + req.n_predict_tokens > llama.get_n_ctx())
+        {
+            error = "Request exceeds context size (" + std::to_string(n_past) + " cached + " + std::to_string(req.n_predict_tokens) +
+                    " > " + std::to_string(llama.get_n_ctx()) + " tokens)";
+            cJSON_Delete(request);
+            return false;
+        }
+    }
+
+    cJSON_Delete(request);
+    return true;
+}
+
+/**
+ * @brief 推理线程主循环
+ * @param queue 请求队列
+ * @param llama LLaMA服务器实例(只在推理线程中使用)
+ */
+void inference_loop(request_queue &queue, LLaMAServer &llama)
+{
+    queued_request req;
+    while (true)
+    {
+        queue.pop(req);
+
+        if (ggml_time_us() > req.t_deadline_us)
+        {
+            // 排队时已超过截止时间，不再处理
+            send_all(req.client_socket, format_unavailable_response("Deadline exceeded while queued", 1));
+            close(req.client_socket);
+            queue.on_done(req, 0);
+            continue;
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+        g_trace.record("queue_wait", req.id, req.t_arrival_us, t_start_us, "priority", req.priority);
+
+        llama.set_request(req.id, req.t_arrival_us, req.read_closed);
+        process_request(req.client_socket, req.request, llama);
+        llama.set_request(0, 0, false);
+
+        const int64_t t_end_us = ggml_time_us();
+        g_trace.record("request", req.id, req.t_arrival_us, t_end_us, "predicted_kv", req.n_predict_tokens);
+        queue.on_done(req, std::max<int64_t>(t_end_us - t_start_us, 1));
+    }
+}
+
+/**
+ * @brief 在连接自己的线程中接收请求，分类后做准入控制并入队
+ * @param client_socket 客户端socket
+ * @param id 请求编号
+ * @param queue 请求队列
+ * @param llama LLaMA服务器实例(只用于分词计数和KV占用)
+ * @note 慢速或空闲的客户端只占用自己的线程，不会阻塞accept和其他请求的快速503
+ */
+void admit_connection(int client_socket, uint64_t id, request_queue &queue, LLaMAServer &llama)
+{
+    // 接收完整请求
+    queued_request req;
+    if (!recv_http_request(client_socket, req.request, req.read_closed))
+    {
+        close(client_socket);
+        return;
+    }
+    req.client_socket = client_socket;
+    req.id = id;
+    req.t_arrival_us = ggml_time_us();
+
+    // 分类并预测KV占用
+    std::string error;
+    const bool valid = classify_request(req, llama, error);
+    g_trace.record("admission", req.id, req.t_arrival_us, ggml_time_us(), "predicted_kv", req.n_predict_tokens);
+    if (!valid)
+    {
+        send_all(client_socket, format_error_response(error, ERROR_TYPE_INVALID_REQUEST));
+        close(client_socket);
+        return;
+    }
+
+    // 准入控制：过载时立即返回503，而不是让请求在TCP层超时
+    int retry_after = 1;
+    if (!queue.push(std::move(req), retry_after, error))
+    {
+        // 拒绝次数由队列指标queue_rejected_requests统计
+        g_trace.record("rejected", req.id, req.t_arrival_us, ggml_time_us(), "retry_after_s", retry_after);
+        send_all(client_socket, format_unavailable_response(error, retry_after));
+        close(client_socket);
     }
 }
 
@@ -794,13 +2327,17 @@ int main(int argc, char **argv)
 {
     if (argc < 2)
     {
-        fprintf(stderr, "Usage: %s <model_path> [-c context_size] [-ngl n_gpu_layers]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <model_path> [-c context_size] [-ngl n_gpu_layers] [-pc prefill_chunk] [-ls n_layer_stream] [-hp] [-bench n_tokens]\n", argv[0]);
         return 1;
     }
 
     std::string model_path;
     int ngl = 99;
     int n_ctx = 2048;
+    int n_prefill_chunk = DEFAULT_PREFILL_CHUNK;
+    int n_layer_stream = 0;
+    bool use_hugepages = false;
+    int n_bench = 0; // 大于0时只运行解码性能测试，不启动服务
 
     // 解析命令行参数
     for (int i = 1; i < argc; i++)
@@ -817,6 +2354,27 @@ int main(int argc, char **argv)
         {
             ngl = std::stoi(argv[++i]);
         }
+        else if (strcmp(argv[i], "-pc") == 0 && i + 1 < argc)
+        {
+            n_prefill_chunk = std::stoi(argv[++i]);
+            if (n_prefill_chunk < 1)
+            {
+                fprintf(stderr, "Invalid prefill chunk size %d, it must be at least 1\n", n_prefill_chunk);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-ls") == 0 && i + 1 < argc)
+        {
+            n_layer_stream = std::stoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-hp") == 0)
+        {
+            use_hugepages = true;
+        }
+        else if (strcmp(argv[i], "-bench") == 0 && i + 1 < argc)
+        {
+            n_bench = std::stoi(argv[++i]);
+        }
         else if (model_path.empty())
         {
             model_path = argv[i];
@@ -825,12 +2383,20 @@ int main(int argc, char **argv)
 
     // 初始化LLaMA服务器
     LLaMAServer llama;
-    if (!llama.initialize(model_path, n_ctx, ngl))
+    if (!llama.initialize(model_path, n_ctx, ngl, n_prefill_chunk, n_layer_stream, use_hugepages))
     {
         fprintf(stderr, "Failed to initialize LLaMA server\n");
         return 1;
     }
 
+    if (n_bench > 0)
+    {
+        return llama.benchmark(n_bench) ? 0 : 1;
+    }
+
+    // 客户端断开后写socket不应终止进程，写失败由send_all的返回值处理
+    signal(SIGPIPE, SIG_IGN);
+
     // 创建服务器socket
     int server_fd;
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
@@ -860,8 +2426,8 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    // 监听连接
-    if (listen(server_fd, 3) < 0)
+    // 监听连接(排队由进程内的请求队列负责，内核backlog只需要容纳接收线程来不及accept的连接)
+    if (listen(server_fd, SOMAXCONN) < 0)
     {
         perror("listen failed");
         return 1;
@@ -869,7 +2435,15 @@ int main(int argc, char **argv)
 
     printf("Server is running on port %d...\n", PORT);
 
-    // 主循环
+    // 推理线程：按优先级从队列中取出请求并处理，接收线程只负责接收请求和准入控制
+    request_queue queue((int64_t)llama.get_n_ctx() * QUEUE_KV_CONTEXTS);
+    llama.set_queue(&queue);
+    std::thread worker(inference_loop, std::ref(queue), std::ref(llama));
+    worker.detach();
+
+    // 主循环：只接受连接，请求在每个连接自己的线程中接收
+    uint64_t n_requests = 0;
+    std::atomic<int> n_receiving{0};
     while (1)
     {
         int client_socket;
@@ -887,36 +2461,21 @@ int main(int argc, char **argv)
         int keep_alive = 1;
         setsockopt(client_socket, SOL_SOCKET, SO_KEEPALIVE, &keep_alive, sizeof(keep_alive));
 
-        // 接收请求
-        char buffer[BUFFER_SIZE] = {0};
-        ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-
-        if (bytes_received > 0)
-        {
-            printf("[DEBUG] Received request:\n%s\n", buffer);
-
-            // 检查是否是 GET /metrics 请求
-            if (strstr(buffer, "GET /metrics") != NULL)
-            {
-                handle_metrics_request(client_socket, llama);
-            }
-            else
-            {
-                // 查找HTTP请求体
-                char *body = strstr(buffer, "\r\n\r\n");
-                if (body)
-                {
-                    body += 4; // 跳过\r\n\r\n
-                    handle_http_request(client_socket, body, llama);
-                }
-            }
-        }
-
-        // 对于非流式请求，关闭连接
-        if (strstr(buffer, "\"stream\":true") == NULL)
+        // 正在接收的连接过多时不再创建线程
+        if (n_receiving >= RECV_MAX_CONNECTIONS)
         {
+            send_all(client_socket, format_unavailable_response("Too many connections", 1));
             close(client_socket);
+            continue;
         }
+
+        n_receiving++;
+        std::thread([client_socket, id = ++n_requests, &queue, &llama, &n_receiving]()
+                    {
+                        admit_connection(client_socket, id, queue, llama);
+                        n_receiving--;
+                    })
+            .detach();
     }
 
     close(server_fd);
@@ -64,8 +64,21 @@ GGML_API bool ggml_gallocr_reserve_n(
 // returns false if using multiple buffers and a re-allocation is needed (call ggml_gallocr_reserve_n first to set the node buffers)
 GGML_API bool ggml_gallocr_alloc_graph(ggml_gallocr_t galloc, struct ggml_cgraph * graph);
 
+// the allocator keeps the plans of the last reserved graphs and uses the one that fits the graph and its buffer assignments
+// moved is set if that is not the plan of the previous graph, so the tensors are at different addresses than before
+// returns false if none fits (call ggml_gallocr_reserve_n to add a plan)
+GGML_API bool ggml_gallocr_alloc_graph_n(
+    ggml_gallocr_t galloc,
+    struct ggml_cgraph * graph,
+    const int * node_buffer_ids,
+    const int * leaf_buffer_ids,
+    bool * moved);
+
 GGML_API size_t ggml_gallocr_get_buffer_size(ggml_gallocr_t galloc, int buffer_id);
 
+// lower bound of the buffer size for the graphs reserved so far: the largest peak of the bytes allocated at the same time
+GGML_API size_t ggml_gallocr_get_buffer_min_size(ggml_gallocr_t galloc, int buffer_id);
+
 // Utils
 // Create a buffer and allocate all the tensors in a ggml_context
 GGML_API struct ggml_backend_buffer * ggml_backend_alloc_ctx_tensors_from_buft(struct ggml_context * ctx, ggml_backend_buffer_type_t buft);
@@ -303,6 +303,7 @@ extern "C" {
     GGML_API int                  ggml_backend_sched_get_n_copies(ggml_backend_sched_t sched);
 
     GGML_API size_t               ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backend_t backend);
+    GGML_API size_t               ggml_backend_sched_get_buffer_min_size(ggml_backend_sched_t sched, ggml_backend_t backend);
 
     GGML_API void                 ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend);
     GGML_API ggml_backend_t       ggml_backend_sched_get_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node);
@@ -349,6 +350,13 @@ extern "C" {
     GGML_API ggml_backend_buffer_t      ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_buffer_type(void);
 
+    // CPU buffers backed by 2 MiB huge pages: explicit ones from the hugetlbfs pool (vm.nr_hugepages) if enough are
+    // reserved, transparent ones otherwise - falls back to regular pages where huge pages are not supported
+    GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hugepage_buffer_type(void);
+
+    // bytes of a host buffer that are currently backed by explicit and by transparent huge pages (Linux only)
+    GGML_API void ggml_backend_cpu_buffer_get_huge_size(ggml_backend_buffer_t buffer, size_t * n_explicit, size_t * n_transparent);
+
 #ifdef  __cplusplus
 }
 #endif
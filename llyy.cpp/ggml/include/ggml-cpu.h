@@ -28,12 +28,18 @@ extern "C" {
         GGML_NUMA_STRATEGY_ISOLATE    = 2,
         GGML_NUMA_STRATEGY_NUMACTL    = 3,
         GGML_NUMA_STRATEGY_MIRROR     = 4,
+        GGML_NUMA_STRATEGY_SHARD      = 5,
         GGML_NUMA_STRATEGY_COUNT
     };
 
     GGML_BACKEND_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_BACKEND_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // GGML_NUMA_STRATEGY_SHARD: place the rows of each weight matrix on the node whose threads compute them in mul_mat
+    // the tensors must be allocated in a host buffer; returns the number of bytes placed, the slices the kernel refused
+    // to move are not counted (0 if sharding is not active)
+    GGML_BACKEND_API size_t  ggml_numa_shard_tensors(struct ggml_tensor ** tensors, int n_tensors);
+
     GGML_BACKEND_API struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value);
     GGML_BACKEND_API struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
 
@@ -58,6 +64,22 @@ extern "C" {
     GGML_BACKEND_API void                          ggml_threadpool_pause         (struct ggml_threadpool * threadpool);
     GGML_BACKEND_API void                          ggml_threadpool_resume        (struct ggml_threadpool * threadpool);
 
+    // wait statistics of the worker threads, summed over the workers other than the calling thread
+    // only the adaptive polling mode (ggml_threadpool_params.poll_adaptive) records them, it is not available in
+    // OpenMP builds where the stats are all zero
+    struct ggml_threadpool_stats {
+        int64_t spin_us;         // time spent spinning while waiting for a graph
+        int64_t park_us;         // time spent parked (futex / cond var) while waiting for a graph
+        int64_t wake_latency_us; // time from graph kickoff until a parked worker was running again
+        int64_t n_spin_hits;     // graphs picked up while spinning
+        int64_t n_parks;         // graphs picked up after parking
+        int64_t avg_gap_us;      // moving average of the idle time between graphs (mean over workers)
+        int64_t spin_budget_us;  // current calibrated spin interval (mean over workers)
+    };
+
+    GGML_BACKEND_API void                          ggml_threadpool_get_stats     (struct ggml_threadpool * threadpool, struct ggml_threadpool_stats * stats);
+    GGML_BACKEND_API void                          ggml_threadpool_reset_stats   (struct ggml_threadpool * threadpool);
+
     // ggml_graph_plan() has to be called before ggml_graph_compute()
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
     GGML_BACKEND_API struct ggml_cplan ggml_graph_plan(
@@ -2151,6 +2151,7 @@ extern "C" {
         int                 n_threads;                   // number of threads
         enum ggml_sched_priority prio;                   // thread priority
         uint32_t            poll;                        // polling level (0 - no polling, 100 - aggressive polling)
+        bool                poll_adaptive;               // spin for a calibrated interval (bounded by poll), then park
         bool                strict_cpu;                  // strict cpu placement
         bool                paused;                      // start in paused state
     };
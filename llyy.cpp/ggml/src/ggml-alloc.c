@@ -11,6 +11,7 @@
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MAX_FREE_BLOCKS 256
+#define MAX_PLANS 16
 
 //#define GGML_ALLOCATOR_DEBUG
 
@@ -114,11 +115,26 @@ struct free_block {
     size_t size;
 };
 
+// an allocation and its lifetime in allocator events, for the offline planner
+struct alloc_interval {
+    size_t size;
+    size_t offset;  // final offset
+    size_t planned; // offset found by the planner
+    int    t_alloc;
+    int    t_free;  // -1 while allocated
+};
+
 struct ggml_dyn_tallocr {
     size_t alignment;
     int n_free_blocks;
     struct free_block free_blocks[MAX_FREE_BLOCKS];
     size_t max_size;
+    size_t min_size; // lower bound of the buffer size: the largest peak of the bytes allocated at the same time in a graph
+
+    struct alloc_interval * intervals;
+    int n_intervals;
+    int intervals_cap;
+    int t; // allocator events so far
 
 #ifdef GGML_ALLOCATOR_DEBUG
     struct {
@@ -150,7 +166,7 @@ static void remove_allocated_tensor(struct ggml_dyn_tallocr * alloc, size_t offs
 }
 #endif
 
-static size_t ggml_dyn_tallocr_alloc(struct ggml_dyn_tallocr * alloc, size_t size, const struct ggml_tensor * tensor) {
+static size_t ggml_dyn_tallocr_alloc(struct ggml_dyn_tallocr * alloc, size_t size, int * interval, const struct ggml_tensor * tensor) {
     size = aligned_offset(NULL, size, alloc->alignment);
 
     AT_PRINTF("%s: allocating %s (%zu bytes) - ", __func__, tensor->name, size);
@@ -229,15 +245,31 @@ static size_t ggml_dyn_tallocr_alloc(struct ggml_dyn_tallocr * alloc, size_t siz
 
     alloc->max_size = MAX(alloc->max_size, offset + size);
 
+    if (alloc->n_intervals == alloc->intervals_cap) {
+        alloc->intervals_cap = MAX(2*alloc->intervals_cap, 256);
+        alloc->intervals = realloc(alloc->intervals, alloc->intervals_cap*sizeof(struct alloc_interval));
+        GGML_ASSERT(alloc->intervals != NULL);
+    }
+    *interval = alloc->n_intervals++;
+    alloc->intervals[*interval] = (struct alloc_interval) {
+        /*.size    = */ size,
+        /*.offset  = */ offset,
+        /*.planned = */ 0,
+        /*.t_alloc = */ alloc->t++,
+        /*.t_free  = */ -1,
+    };
+
     return offset;
 
     GGML_UNUSED(tensor);
 }
 
 // this is a very naive implementation, but for our case the number of free blocks should be very small
-static void ggml_dyn_tallocr_free_tensor(struct ggml_dyn_tallocr * alloc, size_t offset, size_t size, const struct ggml_tensor * tensor) {
+static void ggml_dyn_tallocr_free_tensor(struct ggml_dyn_tallocr * alloc, size_t offset, size_t size, int interval, const struct ggml_tensor * tensor) {
     size = aligned_offset(NULL, size, alloc->alignment);
 
+    alloc->intervals[interval].t_free = alloc->t++;
+
     AT_PRINTF("%s: freeing %s at %zu (%zu bytes) - n_free_blocks = %d\n", __func__, tensor->name, offset, size, alloc->n_free_blocks);
 
 #ifdef GGML_ALLOCATOR_DEBUG
@@ -299,6 +331,8 @@ static void ggml_dyn_tallocr_reset(struct ggml_dyn_tallocr * alloc) {
     alloc->free_blocks[0].offset = 0;
     alloc->free_blocks[0].size = SIZE_MAX/2; // restrict maximum size of a measure allocator to half size_t max to avoid overflows
     alloc->max_size = 0;
+    alloc->n_intervals = 0;
+    alloc->t = 0;
 
 #ifdef GGML_ALLOCATOR_DEBUG
     for (int i = 0; i < 1024; i++) {
@@ -315,6 +349,11 @@ static struct ggml_dyn_tallocr * ggml_dyn_tallocr_new(size_t alignment) {
         /*.n_free_blocks = */ 0,
         /*.free_blocks   = */ {{0}},
         /*.max_size      = */ 0,
+        /*.min_size      = */ 0,
+        /*.intervals     = */ NULL,
+        /*.n_intervals   = */ 0,
+        /*.intervals_cap = */ 0,
+        /*.t             = */ 0,
 #ifdef GGML_ALLOCATOR_DEBUG
         /*.allocated_tensors = */ {{0}},
 #endif
@@ -326,6 +365,7 @@ static struct ggml_dyn_tallocr * ggml_dyn_tallocr_new(size_t alignment) {
 }
 
 static void ggml_dyn_tallocr_free(struct ggml_dyn_tallocr * alloc) {
+    free(alloc->intervals);
     free(alloc);
 }
 
@@ -333,6 +373,120 @@ static size_t ggml_dyn_tallocr_max_size(struct ggml_dyn_tallocr * alloc) {
     return alloc->max_size;
 }
 
+struct plan_item {
+    size_t size;
+    int    t_alloc;
+    int    i;
+};
+
+static int plan_item_cmp(const void * a, const void * b) {
+    const struct plan_item * x = (const struct plan_item *) a;
+    const struct plan_item * y = (const struct plan_item *) b;
+    if (x->size != y->size) {
+        return x->size > y->size ? -1 : 1;
+    }
+    return x->t_alloc - y->t_alloc;
+}
+
+// offline planning: once the graph has been allocated, the lifetimes of all the allocations are known - pack them
+// again largest first, each one in the best fitting gap between the allocations that are live at the same time, and
+// keep the result if it needs less memory than the online best-fit allocator, which only sees one allocation at a time
+static void ggml_dyn_tallocr_plan(struct ggml_dyn_tallocr * alloc) {
+    const int n = alloc->n_intervals;
+    struct alloc_interval * iv = alloc->intervals;
+
+    if (n == 0) {
+        return;
+    }
+
+    // the allocations that are never freed (graph outputs) live until the end
+    for (int i = 0; i < n; i++) {
+        if (iv[i].t_free < 0) {
+            iv[i].t_free = alloc->t;
+        }
+    }
+
+    // lower bound: the peak of the live bytes, each event of the allocator is either an allocation or a free
+    size_t min_size = 0;
+    {
+        int * events = malloc(alloc->t*sizeof(int));
+        GGML_ASSERT(events != NULL);
+        for (int i = 0; i < n; i++) {
+            events[iv[i].t_alloc] = i + 1;
+            if (iv[i].t_free < alloc->t) {
+                events[iv[i].t_free] = -(i + 1);
+            }
+        }
+        size_t live = 0;
+        for (int t = 0; t < alloc->t; t++) {
+            if (events[t] > 0) {
+                live += iv[events[t] - 1].size;
+                min_size = MAX(min_size, live);
+            } else {
+                live -= iv[-events[t] - 1].size;
+            }
+        }
+        free(events);
+    }
+
+    struct plan_item * order = malloc(n*sizeof(struct plan_item));
+    int * placed = malloc(n*sizeof(int)); // the planned allocations, sorted by offset
+    GGML_ASSERT(order != NULL && placed != NULL);
+
+    for (int i = 0; i < n; i++) {
+        order[i] = (struct plan_item) { iv[i].size, iv[i].t_alloc, i };
+    }
+    qsort(order, n, sizeof(struct plan_item), plan_item_cmp);
+
+    size_t peak = 0;
+    for (int k = 0; k < n; k++) {
+        struct alloc_interval * cur = &iv[order[k].i];
+
+        size_t end         = 0;
+        size_t best_offset = SIZE_MAX;
+        size_t best_gap    = SIZE_MAX;
+        for (int p = 0; p < k; p++) {
+            const struct alloc_interval * other = &iv[placed[p]];
+            if (other->t_alloc >= cur->t_free || cur->t_alloc >= other->t_free) {
+                // not live at the same time
+                continue;
+            }
+            if (other->planned >= end) {
+                const size_t gap = other->planned - end;
+                if (gap >= cur->size && gap < best_gap) {
+                    best_gap    = gap;
+                    best_offset = end;
+                }
+            }
+            end = MAX(end, other->planned + other->size);
+        }
+        cur->planned = best_offset != SIZE_MAX ? best_offset : end;
+        peak = MAX(peak, cur->planned + cur->size);
+
+        // insert, keeping placed sorted by offset
+        int pos = k;
+        while (pos > 0 && iv[placed[pos - 1]].planned > cur->planned) {
+            placed[pos] = placed[pos - 1];
+            pos--;
+        }
+        placed[pos] = order[k].i;
+    }
+
+    AT_PRINTF("%s: %d allocations, online %zu bytes, planned %zu bytes, lower bound %zu bytes\n", __func__, n, alloc->max_size, peak, min_size);
+
+    alloc->min_size = MAX(alloc->min_size, min_size);
+
+    if (peak < alloc->max_size) {
+        for (int i = 0; i < n; i++) {
+            iv[i].offset = iv[i].planned;
+        }
+        alloc->max_size = peak;
+    }
+
+    free(placed);
+    free(order);
+}
+
 
 /////////////////////////////////////
 
@@ -343,6 +497,7 @@ struct hash_node {
     int n_views;
     int buffer_id;
     size_t offset; // offset within the buffer
+    int interval;  // allocation in the allocator of the buffer
     bool allocated;
 };
 
@@ -361,6 +516,17 @@ struct node_alloc {
     struct tensor_alloc src[GGML_MAX_SRC];
 };
 
+// the allocations of a reserved graph, valid for any graph of the same shape with smaller or equal tensors
+struct gallocr_plan {
+    struct node_alloc * node_allocs; // [n_nodes]
+    int * node_buffer_ids;           // [n_nodes]
+    int n_nodes;
+
+    struct leaf_alloc * leaf_allocs; // [n_leafs]
+    int * leaf_buffer_ids;           // [n_leafs]
+    int n_leafs;
+};
+
 struct ggml_gallocr {
     ggml_backend_buffer_type_t * bufts; // [n_buffers]
     ggml_backend_buffer_t * buffers; // [n_buffers]
@@ -370,13 +536,21 @@ struct ggml_gallocr {
     struct ggml_hash_set hash_set;
     struct hash_node * hash_values; // [hash_set.size]
 
-    struct node_alloc * node_allocs; // [n_nodes]
-    int n_nodes;
-
-    struct leaf_alloc * leaf_allocs; // [n_leafs]
-    int n_leafs;
+    // the plans of the graphs reserved so far, most recently used first - they all fit in the buffers, which only
+    // grow, so that switching between graphs of different shapes (e.g. prompt processing and generation) needs no
+    // new reservation
+    struct gallocr_plan plans[MAX_PLANS];
+    int n_plans;
 };
 
+static void ggml_gallocr_plan_free(struct gallocr_plan * plan) {
+    free(plan->node_allocs);
+    free(plan->node_buffer_ids);
+    free(plan->leaf_allocs);
+    free(plan->leaf_buffer_ids);
+    memset(plan, 0, sizeof(*plan));
+}
+
 ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs) {
     ggml_gallocr_t galloc = (ggml_gallocr_t)calloc(1, sizeof(struct ggml_gallocr));
     GGML_ASSERT(galloc != NULL);
@@ -455,8 +629,9 @@ void ggml_gallocr_free(ggml_gallocr_t galloc) {
     free(galloc->bufts);
     free(galloc->buffers);
     free(galloc->buf_tallocs);
-    free(galloc->node_allocs);
-    free(galloc->leaf_allocs);
+    for (int i = 0; i < galloc->n_plans; i++) {
+        ggml_gallocr_plan_free(&galloc->plans[i]);
+    }
     free(galloc);
 }
 
@@ -515,9 +690,10 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                         struct hash_node * view_src_hn = ggml_gallocr_hash_get(galloc, view_src);
                         if (view_src_hn->n_views == 1 && view_src_hn->n_children == 0 && view_src->data == parent->data) {
                             AT_PRINTF("reusing view parent %s (%s) for %s\n", parent->name, view_src->name, node->name);
-                            assert(view_src_hn->offset == p_hn->offset);
-                            hn->buffer_id = p_hn->buffer_id;
-                            hn->offset = p_hn->offset;
+                            // the view itself was never allocated, take the memory of its source
+                            hn->buffer_id = view_src_hn->buffer_id;
+                            hn->offset = view_src_hn->offset;
+                            hn->interval = view_src_hn->interval;
                             p_hn->allocated = false; // avoid freeing the parent
                             view_src_hn->allocated = false;
                             return;
@@ -526,6 +702,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                         AT_PRINTF("reusing parent %s for %s\n", parent->name, node->name);
                         hn->buffer_id = p_hn->buffer_id;
                         hn->offset = p_hn->offset;
+                        hn->interval = p_hn->interval;
                         p_hn->allocated = false; // avoid freeing the parent
                         return;
                     }
@@ -536,7 +713,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
         struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[buffer_id];
         ggml_backend_buffer_type_t buft = galloc->bufts[buffer_id];
         size_t size = ggml_backend_buft_get_alloc_size(buft, node);
-        size_t offset = ggml_dyn_tallocr_alloc(alloc, size, node);
+        size_t offset = ggml_dyn_tallocr_alloc(alloc, size, &hn->interval, node);
         hn->buffer_id = buffer_id;
         hn->offset = offset;
     }
@@ -555,10 +732,61 @@ static void ggml_gallocr_free_node(ggml_gallocr_t galloc, struct ggml_tensor * n
     struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[buffer_id];
     ggml_backend_buffer_type_t buft = galloc->bufts[buffer_id];
     size_t size = ggml_backend_buft_get_alloc_size(buft, node);
-    ggml_dyn_tallocr_free_tensor(alloc, offset, size, node);
+    ggml_dyn_tallocr_free_tensor(alloc, offset, size, hn->interval, node);
     hn->allocated = false;
 }
 
+// offset of a tensor after planning
+static size_t ggml_gallocr_hash_offset(ggml_gallocr_t galloc, const struct hash_node * hn) {
+    return galloc->buf_tallocs[hn->buffer_id]->intervals[hn->interval].offset;
+}
+
+// move plan k to the front
+static void ggml_gallocr_plan_use(ggml_gallocr_t galloc, int k) {
+    if (k == 0) {
+        return;
+    }
+    struct gallocr_plan plan = galloc->plans[k];
+    memmove(&galloc->plans[1], &galloc->plans[0], k*sizeof(struct gallocr_plan));
+    galloc->plans[0] = plan;
+}
+
+static bool ggml_gallocr_tensor_alloc_fits(ggml_gallocr_t galloc, const struct tensor_alloc * big, const struct tensor_alloc * small) {
+    if (small->size_max == 0) {
+        return true;
+    }
+    return big->size_max >= small->size_max && galloc->bufts[big->buffer_id] == galloc->bufts[small->buffer_id];
+}
+
+// every graph that fits in the plan small also fits in the plan big
+static bool ggml_gallocr_plan_fits(ggml_gallocr_t galloc, const struct gallocr_plan * big, const struct gallocr_plan * small) {
+    if (big->n_nodes != small->n_nodes || big->n_leafs != small->n_leafs) {
+        return false;
+    }
+    for (int i = 0; i < small->n_nodes; i++) {
+        if (galloc->bufts[big->node_buffer_ids[i]] != galloc->bufts[small->node_buffer_ids[i]]) {
+            return false;
+        }
+        if (!ggml_gallocr_tensor_alloc_fits(galloc, &big->node_allocs[i].dst, &small->node_allocs[i].dst)) {
+            return false;
+        }
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (!ggml_gallocr_tensor_alloc_fits(galloc, &big->node_allocs[i].src[j], &small->node_allocs[i].src[j])) {
+                return false;
+            }
+        }
+    }
+    for (int i = 0; i < small->n_leafs; i++) {
+        if (galloc->bufts[big->leaf_buffer_ids[i]] != galloc->bufts[small->leaf_buffer_ids[i]]) {
+            return false;
+        }
+        if (!ggml_gallocr_tensor_alloc_fits(galloc, &big->leaf_allocs[i].leaf, &small->leaf_allocs[i].leaf)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static int get_node_buffer_id(const int * node_buffer_ids, int i) {
     return node_buffer_ids ? node_buffer_ids[i] : 0;
 }
@@ -694,16 +922,41 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
     // allocate in hash table
     ggml_gallocr_alloc_graph_impl(galloc, graph, node_buffer_ids, leaf_buffer_ids);
 
+    // pack the allocations again with their lifetimes known
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        bool planned = false;
+        for (int j = 0; j < i; j++) {
+            if (galloc->buf_tallocs[j] == galloc->buf_tallocs[i]) {
+                planned = true;
+                break;
+            }
+        }
+        if (!planned) {
+            ggml_dyn_tallocr_plan(galloc->buf_tallocs[i]);
+        }
+    }
+
+    // the new plan goes first, the least recently used one is dropped if there is no room
+    if (galloc->n_plans == MAX_PLANS) {
+        ggml_gallocr_plan_free(&galloc->plans[--galloc->n_plans]);
+    }
+    memmove(&galloc->plans[1], &galloc->plans[0], galloc->n_plans*sizeof(struct gallocr_plan));
+    memset(&galloc->plans[0], 0, sizeof(struct gallocr_plan));
+    galloc->n_plans++;
+
+    struct gallocr_plan * plan = &galloc->plans[0];
+
     // set the node_allocs from the hash table
-    if (galloc->n_nodes < graph->n_nodes) {
-        free(galloc->node_allocs);
-        galloc->node_allocs = calloc(graph->n_nodes, sizeof(struct node_alloc));
-        GGML_ASSERT(galloc->node_allocs != NULL);
+    if (graph->n_nodes > 0) {
+        plan->node_allocs = calloc(graph->n_nodes, sizeof(struct node_alloc));
+        plan->node_buffer_ids = calloc(graph->n_nodes, sizeof(int));
+        GGML_ASSERT(plan->node_allocs != NULL && plan->node_buffer_ids != NULL);
     }
-    galloc->n_nodes = graph->n_nodes;
+    plan->n_nodes = graph->n_nodes;
     for (int i = 0; i < graph->n_nodes; i++) {
         struct ggml_tensor * node = graph->nodes[i];
-        struct node_alloc * node_alloc = &galloc->node_allocs[i];
+        struct node_alloc * node_alloc = &plan->node_allocs[i];
+        plan->node_buffer_ids[i] = get_node_buffer_id(node_buffer_ids, i);
         if (node->view_src || node->data) {
             node_alloc->dst.buffer_id = -1;
             node_alloc->dst.offset = SIZE_MAX;
@@ -711,7 +964,7 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
         } else {
             struct hash_node * hn = ggml_gallocr_hash_get(galloc, node);
             node_alloc->dst.buffer_id = hn->buffer_id;
-            node_alloc->dst.offset    = hn->offset;
+            node_alloc->dst.offset    = ggml_gallocr_hash_offset(galloc, hn);
             node_alloc->dst.size_max  = ggml_backend_buft_get_alloc_size(galloc->bufts[hn->buffer_id], node);
         }
         for (int j = 0; j < GGML_MAX_SRC; j++) {
@@ -723,28 +976,44 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
             } else {
                 struct hash_node * hn = ggml_gallocr_hash_get(galloc, src);
                 node_alloc->src[j].buffer_id = hn->buffer_id;
-                node_alloc->src[j].offset   = hn->offset;
+                node_alloc->src[j].offset   = ggml_gallocr_hash_offset(galloc, hn);
                 node_alloc->src[j].size_max = ggml_backend_buft_get_alloc_size(galloc->bufts[hn->buffer_id], src);
             }
         }
     }
-    if (galloc->n_leafs < graph->n_leafs) {
-        free(galloc->leaf_allocs);
-        galloc->leaf_allocs = calloc(graph->n_leafs, sizeof(galloc->leaf_allocs[0]));
-        GGML_ASSERT(galloc->leaf_allocs != NULL);
+    if (graph->n_leafs > 0) {
+        plan->leaf_allocs = calloc(graph->n_leafs, sizeof(plan->leaf_allocs[0]));
+        plan->leaf_buffer_ids = calloc(graph->n_leafs, sizeof(int));
+        GGML_ASSERT(plan->leaf_allocs != NULL && plan->leaf_buffer_ids != NULL);
     }
-    galloc->n_leafs = graph->n_leafs;
+    plan->n_leafs = graph->n_leafs;
     for (int i = 0; i < graph->n_leafs; i++) {
         struct ggml_tensor * leaf = graph->leafs[i];
         struct hash_node * hn = ggml_gallocr_hash_get(galloc, leaf);
+        plan->leaf_buffer_ids[i] = get_node_buffer_id(leaf_buffer_ids, i);
         if (leaf->view_src || leaf->data) {
-            galloc->leaf_allocs[i].leaf.buffer_id = -1;
-            galloc->leaf_allocs[i].leaf.offset = SIZE_MAX;
-            galloc->leaf_allocs[i].leaf.size_max = 0;
+            plan->leaf_allocs[i].leaf.buffer_id = -1;
+            plan->leaf_allocs[i].leaf.offset = SIZE_MAX;
+            plan->leaf_allocs[i].leaf.size_max = 0;
         } else {
-            galloc->leaf_allocs[i].leaf.buffer_id = hn->buffer_id;
-            galloc->leaf_allocs[i].leaf.offset = hn->offset;
-            galloc->leaf_allocs[i].leaf.size_max = ggml_backend_buft_get_alloc_size(galloc->bufts[hn->buffer_id], leaf);
+            plan->leaf_allocs[i].leaf.buffer_id = hn->buffer_id;
+            plan->leaf_allocs[i].leaf.offset = ggml_gallocr_hash_offset(galloc, hn);
+            plan->leaf_allocs[i].leaf.size_max = ggml_backend_buft_get_alloc_size(galloc->bufts[hn->buffer_id], leaf);
+        }
+    }
+
+    // a single plan per shape: drop the plans that the new one can replace, or the new one if an older one can replace it
+    for (int k = galloc->n_plans - 1; k >= 1; k--) {
+        if (ggml_gallocr_plan_fits(galloc, &galloc->plans[0], &galloc->plans[k])) {
+            ggml_gallocr_plan_free(&galloc->plans[k]);
+            memmove(&galloc->plans[k], &galloc->plans[k + 1], (galloc->n_plans - k - 1)*sizeof(struct gallocr_plan));
+            galloc->n_plans--;
+        } else if (ggml_gallocr_plan_fits(galloc, &galloc->plans[k], &galloc->plans[0])) {
+            ggml_gallocr_plan_free(&galloc->plans[0]);
+            memmove(&galloc->plans[0], &galloc->plans[1], (galloc->n_plans - 1)*sizeof(struct gallocr_plan));
+            galloc->n_plans--;
+            ggml_gallocr_plan_use(galloc, k - 1);
+            break;
         }
     }
 
@@ -816,30 +1085,55 @@ static void ggml_gallocr_init_tensor(ggml_gallocr_t galloc, struct ggml_tensor *
 static bool ggml_gallocr_node_needs_realloc(ggml_gallocr_t galloc, struct ggml_tensor * node, struct tensor_alloc * talloc) {
     size_t node_size = 0;
     if (!node->data && !node->view_src) {
-        GGML_ASSERT(talloc->buffer_id >= 0); // prevent segfault when misusing the API
+        if (talloc->buffer_id < 0) {
+            // not allocated by the plan
+            return false;
+        }
         node_size = ggml_backend_buft_get_alloc_size(galloc->bufts[talloc->buffer_id], node);
     }
     return talloc->size_max >= node_size;
 }
 
-static bool ggml_gallocr_needs_realloc(ggml_gallocr_t galloc, struct ggml_cgraph * graph) {
-    if (galloc->n_nodes != graph->n_nodes) {
+static bool ggml_gallocr_plan_needs_realloc(ggml_gallocr_t galloc, const struct gallocr_plan * plan, struct ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids) {
+    if (plan->n_nodes != graph->n_nodes) {
 #ifndef NDEBUG
         GGML_LOG_DEBUG("%s: graph has different number of nodes\n", __func__);
 #endif
         return true;
     }
 
-    if (galloc->n_leafs != graph->n_leafs) {
+    if (plan->n_leafs != graph->n_leafs) {
 #ifndef NDEBUG
         GGML_LOG_DEBUG("%s: graph has different number of leafs\n", __func__);
 #endif
         return true;
     }
 
+    // the tensors must go to the same buffer types as when the plan was reserved
+    if (node_buffer_ids) {
+        for (int i = 0; i < graph->n_nodes; i++) {
+            if (galloc->bufts[node_buffer_ids[i]] != galloc->bufts[plan->node_buffer_ids[i]]) {
+#ifndef NDEBUG
+                GGML_LOG_DEBUG("%s: node %s has a different buffer type\n", __func__, graph->nodes[i]->name);
+#endif
+                return true;
+            }
+        }
+    }
+    if (leaf_buffer_ids) {
+        for (int i = 0; i < graph->n_leafs; i++) {
+            if (galloc->bufts[leaf_buffer_ids[i]] != galloc->bufts[plan->leaf_buffer_ids[i]]) {
+#ifndef NDEBUG
+                GGML_LOG_DEBUG("%s: leaf %s has a different buffer type\n", __func__, graph->leafs[i]->name);
+#endif
+                return true;
+            }
+        }
+    }
+
     for (int i = 0; i < graph->n_nodes; i++) {
         struct ggml_tensor * node = graph->nodes[i];
-        struct node_alloc * node_alloc = &galloc->node_allocs[i];
+        struct node_alloc * node_alloc = &plan->node_allocs[i];
 
         if (!ggml_gallocr_node_needs_realloc(galloc, node, &node_alloc->dst)) {
 #ifndef NDEBUG
@@ -865,13 +1159,32 @@ static bool ggml_gallocr_needs_realloc(ggml_gallocr_t galloc, struct ggml_cgraph
     return false;
 }
 
+// look for a plan that fits the graph and make it the current one
+static bool ggml_gallocr_needs_realloc(ggml_gallocr_t galloc, struct ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids, bool * moved) {
+    for (int k = 0; k < galloc->n_plans; k++) {
+        if (!ggml_gallocr_plan_needs_realloc(galloc, &galloc->plans[k], graph, node_buffer_ids, leaf_buffer_ids)) {
+            ggml_gallocr_plan_use(galloc, k);
+            *moved = k > 0;
+            return false;
+        }
+    }
+
+    *moved = true;
+    return true;
+}
+
 bool ggml_gallocr_alloc_graph(ggml_gallocr_t galloc, struct ggml_cgraph * graph) {
-    if (ggml_gallocr_needs_realloc(galloc, graph)) {
+    bool moved;
+    return ggml_gallocr_alloc_graph_n(galloc, graph, NULL, NULL, &moved);
+}
+
+bool ggml_gallocr_alloc_graph_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids, bool * moved) {
+    if (ggml_gallocr_needs_realloc(galloc, graph, node_buffer_ids, leaf_buffer_ids, moved)) {
         if (galloc->n_buffers == 1) {
 #ifndef NDEBUG
             GGML_LOG_DEBUG("%s: reallocating buffers automatically\n", __func__);
 #endif
-            if (!ggml_gallocr_reserve(galloc, graph)) {
+            if (!ggml_gallocr_reserve_n(galloc, graph, node_buffer_ids, leaf_buffer_ids)) {
                 return false;
             }
         } else {
@@ -889,17 +1202,19 @@ bool ggml_gallocr_alloc_graph(ggml_gallocr_t galloc, struct ggml_cgraph * graph)
         }
     }
 
+    struct gallocr_plan * plan = &galloc->plans[0];
+
     // allocate the graph tensors from the previous assignments
     // leafs
     for (int i = 0; i < graph->n_leafs; i++) {
         struct ggml_tensor * leaf = graph->leafs[i];
-        struct leaf_alloc * leaf_alloc = &galloc->leaf_allocs[i];
+        struct leaf_alloc * leaf_alloc = &plan->leaf_allocs[i];
         ggml_gallocr_init_tensor(galloc, leaf, &leaf_alloc->leaf);
     }
     // nodes
     for (int i = 0; i < graph->n_nodes; i++) {
         struct ggml_tensor * node = graph->nodes[i];
-        struct node_alloc * node_alloc = &galloc->node_allocs[i];
+        struct node_alloc * node_alloc = &plan->node_allocs[i];
         for (int j = 0; j < GGML_MAX_SRC; j++) {
             struct ggml_tensor * src = node->src[j];
             if (src == NULL) {
@@ -931,6 +1246,19 @@ size_t ggml_gallocr_get_buffer_size(ggml_gallocr_t galloc, int buffer_id) {
     return ggml_backend_buffer_get_size(galloc->buffers[buffer_id]);
 }
 
+size_t ggml_gallocr_get_buffer_min_size(ggml_gallocr_t galloc, int buffer_id) {
+    GGML_ASSERT(buffer_id >= 0 && buffer_id < galloc->n_buffers);
+
+    for (int i = 0; i < buffer_id; i++) {
+        if (galloc->buf_tallocs[i] == galloc->buf_tallocs[buffer_id]) {
+            // shared with a previous buffer, counted there
+            return 0;
+        }
+    }
+
+    return galloc->buf_tallocs[buffer_id]->min_size;
+}
+
 // utils
 
 static void free_buffers(ggml_backend_buffer_t ** buffers, const size_t * n_buffers) {
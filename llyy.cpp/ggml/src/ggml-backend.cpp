@@ -28,6 +28,10 @@
 #include <sys/sysctl.h>
 #endif
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 
 // backend buffer type
 
@@ -1317,36 +1321,22 @@ static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct gg
 }
 
 static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
-    bool backend_ids_changed = false;
-    for (int i = 0; i < sched->graph.n_nodes; i++) {
-        if (sched->node_backend_ids[i] != sched->prev_node_backend_ids[i] &&
-            sched->bufts[sched->node_backend_ids[i]] != sched->bufts[sched->prev_node_backend_ids[i]]) {
-            backend_ids_changed = true;
-            break;
-        }
-    }
-    if (!backend_ids_changed) {
-        for (int i = 0; i < sched->graph.n_leafs; i++) {
-            if (sched->leaf_backend_ids[i] != sched->prev_leaf_backend_ids[i] &&
-                sched->bufts[sched->leaf_backend_ids[i]] != sched->bufts[sched->prev_leaf_backend_ids[i]]) {
-                backend_ids_changed = true;
-                break;
-            }
-        }
-    }
-
-    // allocate graph
-    if (backend_ids_changed || !ggml_gallocr_alloc_graph(sched->galloc, &sched->graph)) {
+    // allocate graph, with the plan of a previous graph of the same shape and backend assignments if there is one
+    bool moved = false;
+    if (!ggml_gallocr_alloc_graph_n(sched->galloc, &sched->graph, sched->node_backend_ids, sched->leaf_backend_ids, &moved)) {
         // the re-allocation may cause the split inputs to be moved to a different address
         ggml_backend_sched_synchronize(sched);
 #ifndef NDEBUG
-        GGML_LOG_DEBUG("%s: failed to allocate graph, reserving (backend_ids_changed = %d)\n", __func__, backend_ids_changed);
+        GGML_LOG_DEBUG("%s: failed to allocate graph, reserving\n", __func__);
 #endif
         ggml_gallocr_reserve_n(sched->galloc, &sched->graph, sched->node_backend_ids, sched->leaf_backend_ids);
-        if (!ggml_gallocr_alloc_graph(sched->galloc, &sched->graph)) {
+        if (!ggml_gallocr_alloc_graph_n(sched->galloc, &sched->graph, sched->node_backend_ids, sched->leaf_backend_ids, &moved)) {
             GGML_LOG_ERROR("%s: failed to allocate graph\n", __func__);
             return false;
         }
+    } else if (moved && sched->n_copies > 1) {
+        // the plan of another shape places the split inputs elsewhere, where the previous graph may still be running
+        ggml_backend_sched_synchronize(sched);
     }
 
     return true;
@@ -1625,6 +1615,13 @@ size_t ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backe
     return ggml_gallocr_get_buffer_size(sched->galloc, backend_index);
 }
 
+size_t ggml_backend_sched_get_buffer_min_size(ggml_backend_sched_t sched, ggml_backend_t backend) {
+    int backend_index = ggml_backend_sched_backend_id(sched, backend);
+    GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
+
+    return ggml_gallocr_get_buffer_min_size(sched->galloc, backend_index);
+}
+
 void ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend) {
     int backend_index = ggml_backend_sched_backend_id(sched, backend);
     GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
@@ -2002,3 +1999,134 @@ ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size)
     GGML_ASSERT((uintptr_t)ptr % TENSOR_ALIGNMENT == 0 && "buffer pointer must be aligned");
     return ggml_backend_buffer_init(ggml_backend_cpu_buffer_from_ptr_type(), ggml_backend_cpu_buffer_from_ptr_i, ptr, size);
 }
+
+// CPU backend - huge page buffer type
+
+#define GGML_HUGEPAGE_SIZE (2*1024*1024)
+
+static const char * ggml_backend_cpu_hugepage_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "CPU_HugePages";
+
+    GGML_UNUSED(buft);
+}
+
+#ifdef __linux__
+static void ggml_backend_cpu_hugepage_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    munmap(buffer->context, GGML_PAD(buffer->size, GGML_HUGEPAGE_SIZE));
+}
+
+static const struct ggml_backend_buffer_i ggml_backend_cpu_hugepage_buffer_i = {
+    /* .free_buffer     = */ ggml_backend_cpu_hugepage_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_cpu_buffer_get_base,
+    /* .init_tensor     = */ NULL, // no initialization required
+    /* .memset_tensor   = */ ggml_backend_cpu_buffer_memset_tensor,
+    /* .set_tensor      = */ ggml_backend_cpu_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_cpu_buffer_get_tensor,
+    /* .cpy_tensor      = */ ggml_backend_cpu_buffer_cpy_tensor,
+    /* .clear           = */ ggml_backend_cpu_buffer_clear,
+    /* .reset           = */ NULL,
+};
+
+static void * ggml_hugepage_alloc(size_t size) {
+    // explicit huge pages, only available if the administrator reserved enough of them
+    void * data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED) {
+        return data;
+    }
+
+    // transparent huge pages need a 2 MiB aligned range, over-allocate and trim the ends
+    const size_t map_size = size + GGML_HUGEPAGE_SIZE;
+    uint8_t * map = (uint8_t *) mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    uint8_t * start = (uint8_t *) GGML_PAD((uintptr_t) map, GGML_HUGEPAGE_SIZE);
+    if (start > map) {
+        munmap(map, start - map);
+    }
+    if (map + map_size > start + size) {
+        munmap(start + size, map + map_size - (start + size));
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(start, size, MADV_HUGEPAGE) != 0) {
+        GGML_LOG_DEBUG("%s: madvise(MADV_HUGEPAGE) failed, using regular pages\n", __func__);
+    }
+#endif
+
+    return start;
+}
+#endif
+
+static ggml_backend_buffer_t ggml_backend_cpu_hugepage_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+#ifdef __linux__
+    void * data = ggml_hugepage_alloc(GGML_PAD(size, GGML_HUGEPAGE_SIZE));
+    if (data != NULL) {
+        return ggml_backend_buffer_init(buft, ggml_backend_cpu_hugepage_buffer_i, data, size);
+    }
+#endif
+
+    void * data_fallback = ggml_aligned_malloc(size);
+    if (data_fallback == NULL) {
+        GGML_LOG_ERROR("%s: failed to allocate buffer of size %zu\n", __func__, size);
+        return NULL;
+    }
+
+    return ggml_backend_buffer_init(buft, ggml_backend_cpu_buffer_i, data_fallback, size);
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_hugepage_buffer_type(void) {
+    static struct ggml_backend_buffer_type ggml_backend_cpu_hugepage_buffer_type = {
+        /* .iface   = */ {
+            /* .get_name         = */ ggml_backend_cpu_hugepage_buffer_type_get_name,
+            /* .alloc_buffer     = */ ggml_backend_cpu_hugepage_buffer_type_alloc_buffer,
+            /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+            /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+            /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+            /* .is_host          = */ ggml_backend_cpu_buffer_type_is_host,
+        },
+        /* .device  = */ NULL,
+        /* .context = */ NULL,
+    };
+
+    return &ggml_backend_cpu_hugepage_buffer_type;
+}
+
+void ggml_backend_cpu_buffer_get_huge_size(ggml_backend_buffer_t buffer, size_t * n_explicit, size_t * n_transparent) {
+    *n_explicit    = 0;
+    *n_transparent = 0;
+
+#ifdef __linux__
+    GGML_ASSERT(ggml_backend_buffer_is_host(buffer));
+
+    const uintptr_t first = (uintptr_t) ggml_backend_buffer_get_base(buffer);
+    const uintptr_t last  = first + ggml_backend_buffer_get_size(buffer);
+
+    FILE * f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return;
+    }
+
+    // the mappings that overlap the buffer, the sizes are reported in kB per mapping - which may extend beyond the
+    // buffer, so the counts are capped to the overlap
+    char line[512];
+    size_t overlap = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long start;
+        unsigned long long end;
+        size_t kb;
+        if (sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+            overlap = start < last && end > first ? std::min<uintptr_t>(end, last) - std::max<uintptr_t>(start, first) : 0;
+        } else if (overlap && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            *n_transparent += std::min(kb*1024, overlap);
+        } else if (overlap && (sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1 || sscanf(line, "Shared_Hugetlb: %zu kB", &kb) == 1)) {
+            *n_explicit += std::min(kb*1024, overlap);
+        }
+    }
+
+    fclose(f);
+#else
+    GGML_UNUSED(buffer);
+#endif
+}
@@ -38,6 +38,12 @@
 #include <syscall.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
 #ifdef GGML_USE_OPENMP
 #include <omp.h>
 #endif
@@ -462,6 +468,11 @@ struct ggml_threadpool {
 
     int32_t      prio;        // Scheduling priority
     uint32_t     poll;        // Polling level (0 - no polling)
+    bool         poll_adaptive; // Spin for a calibrated interval, then park (see ggml_graph_compute_wait_adaptive)
+
+    // adaptive polling: workers park on n_wake (futex word), bumped on every kickoff/pause/resume/stop
+    atomic_int GGML_CACHE_ALIGN n_wake;
+    int64_t      t_kickoff;   // time of the last kickoff (us), used to measure the wake-up latency
 
     enum ggml_status ec;
 };
@@ -473,6 +484,15 @@ struct ggml_compute_state {
     bool cpumask[GGML_MAX_N_THREADS];
     int  last_graph;
     bool pending;
+
+    // adaptive polling calibration and stats, only touched by the owning thread
+    int64_t ema_gap_us;      // moving average of the idle time between graphs
+    int64_t ema_wake_us;     // moving average of the wake-up latency after parking
+    int64_t spin_us;
+    int64_t park_us;
+    int64_t wake_latency_us;
+    int64_t n_spin_hits;
+    int64_t n_parks;
 #endif
     struct ggml_threadpool * threadpool;
     int ith;
@@ -671,6 +691,145 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// GGML_NUMA_STRATEGY_SHARD
+//
+// the threads of a graph are bound to the nodes in contiguous blocks (thread ith runs on node ith*n_nodes/nth) and
+// the rows of each weight matrix are split in n_nodes equal slices, so that mul_mat can compute every slice with the
+// threads of the node that holds it in memory
+
+static inline bool ggml_numa_is_shard(void) {
+    return g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_SHARD && g_state.numa.n_nodes > 1;
+}
+
+static inline int ggml_numa_shard_node(int ith, int nth) {
+    return (int) (((int64_t) ith*g_state.numa.n_nodes)/nth);
+}
+
+// rows [*ir_start, *ir_end) of a sharded weight matrix with nr rows belong to node
+static inline void ggml_numa_shard_rows(int64_t nr, int node, int64_t * ir_start, int64_t * ir_end) {
+    *ir_start = (nr*node)/g_state.numa.n_nodes;
+    *ir_end   = (nr*(node + 1))/g_state.numa.n_nodes;
+}
+
+static bool ggml_numa_shard_tensor_ok(const struct ggml_tensor * t) {
+    return t->data != NULL && ggml_is_matrix(t) && ggml_is_contiguous(t) && t->ne[1] >= (int64_t) g_state.numa.n_nodes;
+}
+
+// true if mul_mat with this src0 is split along the NUMA shards instead of the regular chunks
+static bool ggml_numa_shard_mul_mat(const struct ggml_tensor * src0, int nth) {
+    return ggml_numa_is_shard() && nth >= (int) g_state.numa.n_nodes &&
+           src0->buffer != NULL && ggml_backend_buffer_get_usage(src0->buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS &&
+           ggml_numa_shard_tensor_ok(src0);
+}
+
+#if defined(__gnu_linux__)
+struct ggml_numa_shard_work {
+    struct ggml_tensor ** tensors;
+    int                   n_tensors;
+    uint32_t              node;
+    size_t                n_placed;
+};
+
+static void * ggml_numa_shard_thread(void * data) {
+    struct ggml_numa_shard_work * work = (struct ggml_numa_shard_work *) data;
+    struct ggml_numa_node       * node = &g_state.numa.nodes[work->node];
+
+    // run on the node, so that pages that are not resident yet are first-touched locally
+    size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
+    cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
+    CPU_ZERO_S(setsize, cpus);
+    for (size_t i = 0; i < node->n_cpus; ++i) {
+        CPU_SET_S(node->cpus[i], setsize, cpus);
+    }
+    int rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+    }
+    CPU_FREE(cpus);
+
+    const size_t  page_size = (size_t) sysconf(_SC_PAGESIZE);
+    unsigned long nodemask  = 1ul << work->node;
+
+    int n_failed  = 0;
+    int err_first = 0;
+
+    for (int i = 0; i < work->n_tensors; ++i) {
+        const struct ggml_tensor * t = work->tensors[i];
+        if (!ggml_numa_shard_tensor_ok(t)) {
+            continue;
+        }
+
+        int64_t ir_start;
+        int64_t ir_end;
+        ggml_numa_shard_rows(t->ne[1], work->node, &ir_start, &ir_end);
+
+        // the pages that straddle two slices go to the node of the later slice
+        const uintptr_t base  = (uintptr_t) t->data;
+        const uintptr_t last  = base + ggml_nbytes(t);
+        uintptr_t       start = (base + ir_start*t->nb[1]) & ~(uintptr_t)(page_size - 1);
+        uintptr_t       end   = (base + ir_end  *t->nb[1]) & ~(uintptr_t)(page_size - 1);
+        if (ir_end == t->ne[1]) {
+            end = (last + page_size - 1) & ~(uintptr_t)(page_size - 1);
+        }
+        if (end <= start) {
+            continue;
+        }
+
+        // move the pages that are already resident (e.g. read into an anonymous buffer by the loader thread)
+        // this often fails for file-backed or locked pages, which then stay where they are
+        const bool placed = syscall(SYS_mbind, (void *) start, end - start, MPOL_BIND, &nodemask, GGML_NUMA_MAX_NODES + 1, MPOL_MF_MOVE) == 0;
+        if (!placed && n_failed++ == 0) {
+            err_first = errno;
+        }
+
+        // and fault in the rest from this node
+        for (uintptr_t p = MAX(start, base); p < MIN(end, last); p += page_size) {
+            (void) *(volatile const char *) p;
+        }
+
+        if (placed) {
+            work->n_placed += end - start;
+        }
+    }
+
+    if (n_failed > 0) {
+        fprintf(stderr, "warning: mbind() failed for %d tensor slice(s) on NUMA node %u, they were not moved: %s\n",
+                n_failed, work->node, strerror(err_first));
+    }
+
+    return NULL;
+}
+#endif
+
+size_t ggml_numa_shard_tensors(struct ggml_tensor ** tensors, int n_tensors) {
+#if defined(__gnu_linux__)
+    if (!ggml_numa_is_shard() || n_tensors <= 0) {
+        return 0;
+    }
+
+    struct ggml_numa_shard_work works[GGML_NUMA_MAX_NODES];
+    pthread_t                   threads[GGML_NUMA_MAX_NODES];
+
+    for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+        works[n] = (struct ggml_numa_shard_work) { tensors, n_tensors, n, 0 };
+        int rc = pthread_create(&threads[n], NULL, ggml_numa_shard_thread, &works[n]);
+        GGML_ASSERT(rc == 0);
+    }
+
+    size_t n_placed = 0;
+    for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+        pthread_join(threads[n], NULL);
+        n_placed += works[n].n_placed;
+    }
+
+    return n_placed;
+#else
+    GGML_UNUSED(tensors);
+    GGML_UNUSED(n_tensors);
+    return 0;
+#endif
+}
+
 #if defined(__ARM_ARCH)
 
 #if defined(__linux__) && defined(__aarch64__)
@@ -1297,6 +1456,9 @@ static void ggml_compute_forward_mul_mat(
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
 
+    // the rows of sharded weights are computed by the threads of the node that holds them
+    const bool numa_shard = ggml_numa_shard_mul_mat(src0, nth);
+
     // TODO: extract to "extra_op"
 #if GGML_USE_LLAMAFILE
     // broadcast factors
@@ -1305,7 +1467,7 @@ static void ggml_compute_forward_mul_mat(
 
     const bool src1_cont = ggml_is_contiguous(src1);
 
-    if (src1_cont) {
+    if (src1_cont && !numa_shard) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
                 if (!llamafile_sgemm(params,
@@ -1370,7 +1532,7 @@ UseGgmlGemm1:;
     ggml_barrier(params->threadpool);
 
 #if GGML_USE_LLAMAFILE
-    if (src1->type != vec_dot_type) {
+    if (src1->type != vec_dot_type && !numa_shard) {
         const void* wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
@@ -1399,6 +1561,32 @@ UseGgmlGemm2:;
     // This is the size of the rest of the dimensions of the result
     const int64_t nr1 = ne1 * ne2 * ne3;
 
+    if (numa_shard) {
+        const int n_nodes = (int) g_state.numa.n_nodes;
+        const int node    = ggml_numa_shard_node(ith, nth);
+
+        int64_t ir0_node_start;
+        int64_t ir0_node_end;
+        ggml_numa_shard_rows(nr0, node, &ir0_node_start, &ir0_node_end);
+
+        // threads [ith_start, ith_end) run on this node
+        const int ith_start = (node*nth + n_nodes - 1)/n_nodes;
+        const int ith_end   = ((node + 1)*nth + n_nodes - 1)/n_nodes;
+
+        const int64_t nr0_node = ir0_node_end - ir0_node_start;
+        const int64_t ir0_start = ir0_node_start + (nr0_node*(ith - ith_start))/(ith_end - ith_start);
+        const int64_t ir0_end   = ir0_node_start + (nr0_node*(ith - ith_start + 1))/(ith_end - ith_start);
+
+        if (ir0_start < ir0_end) {
+            int64_t num_rows_per_vec_dot = vec_dot_num_rows;
+            if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || (nr1 % 2 != 0)) {
+                num_rows_per_vec_dot = 1;
+            }
+            ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, 0, nr1);
+        }
+        return;
+    }
+
     // Now select a reasonable chunk size.
     int chunk_size = 16;
 
@@ -2075,7 +2263,7 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
 
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__gnu_linux__)
-static void set_numa_thread_affinity(int thread_n) {
+static void set_numa_thread_affinity(int thread_n, int n_threads) {
     if (!ggml_is_numa()) {
         return;
     }
@@ -2093,6 +2281,10 @@ static void set_numa_thread_affinity(int thread_n) {
             // run thread on current_node
             node_num = g_state.numa.current_node;
             break;
+        case GGML_NUMA_STRATEGY_SHARD:
+            // run thread on the node that holds its rows of the weights
+            node_num = ggml_numa_shard_node(thread_n, n_threads);
+            break;
         case GGML_NUMA_STRATEGY_NUMACTL:
             // use the cpuset that numactl gave us
             rv = pthread_setaffinity_np(pthread_self(), setsize, &g_state.numa.cpuset);
@@ -2143,7 +2335,7 @@ static void clear_numa_thread_affinity(void) {
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
-static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
+static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(thread_n); UNUSED(n_threads); }
 static void clear_numa_thread_affinity(void) {}
 #endif
 
@@ -2569,6 +2761,98 @@ static void ggml_thread_cpumask_next(const bool * global_mask, bool * local_mask
     }
 }
 
+#ifndef GGML_USE_OPENMP
+// Adaptive polling policy.
+// Spin for about as long as the recent idle gaps between graphs (decode loops submit graphs
+// back-to-back), but never longer than the poll level allows. When the gaps are long spinning
+// only burns power, so spin just for about the cost of a wake-up (ski-rental) and park.
+#define GGML_POLL_ADAPTIVE_US_PER_LEVEL 20  // poll level -> max spin time (poll = 50 -> 1 ms)
+#define GGML_POLL_ADAPTIVE_WAKE_US_INIT 50  // wake-up latency estimate before the first measurement
+#define GGML_POLL_ADAPTIVE_EMA_SHIFT    3   // moving averages use alpha = 1/8
+
+static int64_t ggml_graph_compute_spin_budget(const struct ggml_compute_state * state) {
+    const int64_t max_us = (int64_t) state->threadpool->poll * GGML_POLL_ADAPTIVE_US_PER_LEVEL;
+
+    int64_t budget = state->ema_wake_us;
+    if (state->ema_gap_us <= max_us) {
+        budget = MAX(budget, 2*state->ema_gap_us);
+    }
+
+    return MIN(budget, max_us);
+}
+
+// Adaptive polling: parked workers sleep on threadpool->n_wake.
+// Every state change a worker may be waiting for (new graph, pause, resume, stop) bumps it
+// under the threadpool mutex, so a worker that sampled n_wake before re-checking its state
+// can never miss the wake-up.
+static void ggml_threadpool_wake_parked(struct ggml_threadpool * threadpool) {
+    atomic_fetch_add_explicit(&threadpool->n_wake, 1, memory_order_seq_cst);
+#if defined(__linux__)
+    if (threadpool->poll_adaptive) {
+        syscall(SYS_futex, &threadpool->n_wake, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+#endif
+}
+
+static void ggml_threadpool_park(struct ggml_threadpool * threadpool, int n_wake) {
+#if defined(__linux__)
+    // returns immediately with EAGAIN if n_wake has moved on already
+    syscall(SYS_futex, &threadpool->n_wake, FUTEX_WAIT_PRIVATE, n_wake, NULL, NULL, 0);
+#else
+    ggml_mutex_lock_shared(&threadpool->mutex);
+    if (atomic_load_explicit(&threadpool->n_wake, memory_order_relaxed) == n_wake) {
+        ggml_cond_wait(&threadpool->cond, &threadpool->mutex);
+    }
+    ggml_mutex_unlock_shared(&threadpool->mutex);
+#endif
+}
+#endif // GGML_USE_OPENMP
+
+void ggml_threadpool_get_stats(struct ggml_threadpool * threadpool, struct ggml_threadpool_stats * stats) {
+    memset(stats, 0, sizeof(*stats));
+
+#ifndef GGML_USE_OPENMP
+    // the counters are owned by the workers, the values are approximate while a graph is running
+    // worker 0 is the calling thread, it does not wait for graphs and has no counters
+    const int n_threads = threadpool->n_threads_max;
+
+    for (int j = 1; j < n_threads; j++) {
+        const struct ggml_compute_state * w = &threadpool->workers[j];
+
+        stats->spin_us         += w->spin_us;
+        stats->park_us         += w->park_us;
+        stats->wake_latency_us += w->wake_latency_us;
+        stats->n_spin_hits     += w->n_spin_hits;
+        stats->n_parks         += w->n_parks;
+        stats->avg_gap_us      += w->ema_gap_us;
+        stats->spin_budget_us  += ggml_graph_compute_spin_budget(w);
+    }
+
+    if (n_threads > 1) {
+        stats->avg_gap_us     /= n_threads - 1;
+        stats->spin_budget_us /= n_threads - 1;
+    }
+#else
+    UNUSED(threadpool);
+#endif
+}
+
+void ggml_threadpool_reset_stats(struct ggml_threadpool * threadpool) {
+#ifndef GGML_USE_OPENMP
+    for (int j = 0; j < threadpool->n_threads_max; j++) {
+        struct ggml_compute_state * w = &threadpool->workers[j];
+
+        w->spin_us         = 0;
+        w->park_us         = 0;
+        w->wake_latency_us = 0;
+        w->n_spin_hits     = 0;
+        w->n_parks         = 0;
+    }
+#else
+    UNUSED(threadpool);
+#endif
+}
+
 void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     if (!threadpool) return;
 
@@ -2583,6 +2867,7 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     threadpool->pause = false;
 
     ggml_cond_broadcast(&threadpool->cond);
+    ggml_threadpool_wake_parked(threadpool);
     ggml_mutex_unlock(&threadpool->mutex);
 
     for (int j = 1; j < n_threads; j++) {
@@ -2606,12 +2891,14 @@ static void ggml_threadpool_pause_locked(struct ggml_threadpool * threadpool) {
     GGML_PRINT_DEBUG("Pausing threadpool\n");
     threadpool->pause = true;
     ggml_cond_broadcast(&threadpool->cond);
+    ggml_threadpool_wake_parked(threadpool);
 }
 
 static void ggml_threadpool_resume_locked(struct ggml_threadpool * threadpool) {
     GGML_PRINT_DEBUG("Resuming threadpool\n");
     threadpool->pause = false;
     ggml_cond_broadcast(&threadpool->cond);
+    ggml_threadpool_wake_parked(threadpool);
 }
 #endif
 
@@ -2834,7 +3121,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     const struct ggml_cgraph * cgraph = tp->cgraph;
     const struct ggml_cplan  * cplan  = tp->cplan;
 
-    set_numa_thread_affinity(state->ith);
+    set_numa_thread_affinity(state->ith, atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed));
 
     struct ggml_compute_params params = {
         /*.ith       =*/ state->ith,
@@ -2921,9 +3208,74 @@ static inline bool ggml_graph_compute_poll_for_work(struct ggml_compute_state *
     return state->pending;
 }
 
+static inline void ggml_graph_compute_ema_update(int64_t * ema, int64_t value) {
+    *ema += (value - *ema) / (1 << GGML_POLL_ADAPTIVE_EMA_SHIFT);
+}
+
+static bool ggml_graph_compute_wait_adaptive(struct ggml_compute_state * state) {
+    struct ggml_threadpool * threadpool = state->threadpool;
+
+    const int64_t t_idle = ggml_time_us();
+
+    // unused threads go straight to sleep
+    const int64_t budget = ggml_graph_compute_thread_active(state) ? ggml_graph_compute_spin_budget(state) : 0;
+
+    int64_t t_now = t_idle;
+    for (uint32_t i = 0; !ggml_graph_compute_thread_ready(state); i++) {
+        // reading the clock is not free, only check the budget every few rounds
+        if ((i & 255) == 0) {
+            t_now = ggml_time_us();
+            if (t_now - t_idle >= budget) {
+                break;
+            }
+        }
+        ggml_thread_cpu_relax();
+    }
+
+    if (state->pending) {
+        t_now = ggml_time_us();
+        state->spin_us += t_now - t_idle;
+        state->n_spin_hits++;
+        ggml_graph_compute_ema_update(&state->ema_gap_us, t_now - t_idle);
+        ggml_graph_compute_thread_sync(state);
+        return true;
+    }
+
+    const int64_t t_park = ggml_time_us();
+    state->spin_us += t_park - t_idle;
+
+    while (true) {
+        const int n_wake = atomic_load_explicit(&threadpool->n_wake, memory_order_seq_cst);
+        if (ggml_graph_compute_thread_ready(state)) {
+            break;
+        }
+        GGML_PRINT_DEBUG("thread #%d waiting for work (parked)\n", state->ith);
+        ggml_threadpool_park(threadpool, n_wake);
+    }
+
+    ggml_graph_compute_thread_sync(state);
+
+    if (state->pending) {
+        t_now = ggml_time_us();
+        const int64_t t_wake = MAX(0, t_now - MAX(threadpool->t_kickoff, t_park));
+
+        state->park_us         += t_now - t_park;
+        state->wake_latency_us += t_wake;
+        state->n_parks++;
+        ggml_graph_compute_ema_update(&state->ema_gap_us,  t_now - t_idle);
+        ggml_graph_compute_ema_update(&state->ema_wake_us, t_wake);
+    }
+
+    return state->pending;
+}
+
 static inline bool ggml_graph_compute_check_for_work(struct ggml_compute_state * state) {
     struct ggml_threadpool * threadpool = state->threadpool;
 
+    if (threadpool->poll_adaptive) {
+        return ggml_graph_compute_wait_adaptive(state);
+    }
+
     if (ggml_graph_compute_poll_for_work(state)) {
         ggml_graph_compute_thread_sync(state);
         return state->pending;
@@ -2990,6 +3342,10 @@ static void ggml_graph_compute_kickoff(struct ggml_threadpool * threadpool, int
     // Update the number of active threads
     atomic_store_explicit(&threadpool->n_threads_cur, n_threads, memory_order_relaxed);
 
+    if (threadpool->poll_adaptive) {
+        threadpool->t_kickoff = ggml_time_us();
+    }
+
     // Indicate the graph is ready to be processed
     // We need the full seq-cst fence here because of the polling threads (used in thread_sync)
     atomic_fetch_add_explicit(&threadpool->n_graph, 1, memory_order_seq_cst);
@@ -3005,6 +3361,7 @@ static void ggml_graph_compute_kickoff(struct ggml_threadpool * threadpool, int
        ggml_threadpool_resume_locked(threadpool);
     } else {
        ggml_cond_broadcast(&threadpool->cond);
+       ggml_threadpool_wake_parked(threadpool);
     }
 
     ggml_mutex_unlock(&threadpool->mutex);
@@ -3033,6 +3390,9 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_threads_max    = tpp->n_threads;
         threadpool->n_threads_cur    = tpp->n_threads;
         threadpool->poll             = tpp->poll;
+        threadpool->poll_adaptive    = tpp->poll_adaptive;
+        threadpool->n_wake           = 0;
+        threadpool->t_kickoff        = 0;
         threadpool->prio             = tpp->prio;
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
@@ -3045,6 +3405,9 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
     for (int j = 0; j < tpp->n_threads; j++) {
         workers[j].threadpool = threadpool;
         workers[j].ith        = j;
+#ifndef GGML_USE_OPENMP
+        workers[j].ema_wake_us = GGML_POLL_ADAPTIVE_WAKE_US_INIT;
+#endif
     }
 
     threadpool->workers = workers;
@@ -3074,6 +3437,10 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
             ggml_thread_apply_affinity(threadpool->workers[0].cpumask);
         }
     }
+#else
+    if (tpp->poll_adaptive) {
+        GGML_LOG_WARN("%s: adaptive polling is not available in OpenMP builds, the OpenMP runtime manages the threads\n", __func__);
+    }
 #endif // GGML_USE_OPENMP
 
     return threadpool;
@@ -3371,11 +3738,13 @@ int ggml_cpu_has_sme(void) {
 }
 
 void ggml_cpu_init(void) {
-    // needed to initialize f16 tables
-    {
+    // needed to initialize f16 tables, once - this is called by every graph computation, which should not allocate
+    static atomic_int f16_tables_ready = 0;
+    if (!atomic_load_explicit(&f16_tables_ready, memory_order_acquire)) {
         struct ggml_init_params params = { 0, NULL, false };
         struct ggml_context * ctx = ggml_init(params);
         ggml_free(ctx);
+        atomic_store_explicit(&f16_tables_ready, 1, memory_order_release);
     }
 
     ggml_critical_section_start();
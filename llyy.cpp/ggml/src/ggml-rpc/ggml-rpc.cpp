@@ -25,6 +25,12 @@
 #  include <netinet/tcp.h>
 #  include <netdb.h>
 #  include <unistd.h>
+#  include <sys/uio.h>
+#  if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#    define GGML_RPC_ZEROCOPY
+#    include <poll.h>
+#    include <linux/errqueue.h>
+#  endif
 #endif
 #include <cstring>
 #include <fstream>
@@ -42,6 +48,12 @@ typedef int sockfd_t;
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+
+    // MSG_ZEROCOPY sends issued / completed, see send_payload()
+    bool     zerocopy = false;
+    uint32_t zc_sent  = 0;
+    uint32_t zc_done  = 0;
+
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -92,12 +104,23 @@ enum rpc_cmd {
     RPC_CMD_GET_DEVICE_MEMORY,
     RPC_CMD_INIT_TENSOR,
     RPC_CMD_GET_ALLOC_SIZE,
+    RPC_CMD_SET_TENSOR_LZ4,
+    RPC_CMD_GRAPH_COMPUTE_LZ4,
     RPC_CMD_COUNT,
 };
 
 // Try RPC_CMD_SET_TENSOR_HASH first when data size is larger than this threshold
 const size_t HASH_THRESHOLD = 10 * 1024 * 1024;
 
+// Send tensor data with MSG_ZEROCOPY when it is larger than this threshold (Linux only)
+const size_t ZEROCOPY_THRESHOLD = 256 * 1024;
+
+// With GGML_RPC_COMPRESS set, try to LZ4-compress activations and graphs larger than this threshold
+const size_t LZ4_THRESHOLD = 4 * 1024;
+
+// The server receives tensor data in chunks of this size
+const size_t RECV_CHUNK_SIZE = 4 * 1024 * 1024;
+
 struct rpc_msg_get_alloc_size_req {
     rpc_tensor tensor;
 };
@@ -200,10 +223,9 @@ struct ggml_backend_rpc_buffer_context {
 
 // RPC helper functions
 
-// Computes FNV-1a hash of the data
-static uint64_t fnv_hash(const uint8_t * data, size_t len) {
+// Computes FNV-1a hash of the data, pass the previous result as hash to continue a hash over several chunks
+static uint64_t fnv_hash(const uint8_t * data, size_t len, uint64_t hash = 0xcbf29ce484222325ULL) {
     const uint64_t fnv_prime = 0x100000001b3ULL;
-    uint64_t hash = 0xcbf29ce484222325ULL;
 
     for (size_t i = 0; i < len; ++i) {
         hash ^= data[i];
@@ -212,6 +234,179 @@ static uint64_t fnv_hash(const uint8_t * data, size_t len) {
     return hash;
 }
 
+// LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md)
+// a plain greedy compressor: the inputs are activations, KQ masks and serialized graphs, where long runs
+// of zeros / -inf and repeated tensor headers are what there is to gain
+
+#define RPC_LZ4_HASH_LOG     12
+#define RPC_LZ4_MIN_MATCH    4
+#define RPC_LZ4_LAST_LITERALS 5  // the last 5 bytes are always literals
+#define RPC_LZ4_MF_LIMIT     12 // the last match must start at least 12 bytes before the end
+#define RPC_LZ4_MAX_OFFSET   65535
+
+static uint32_t rpc_lz4_read32(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static bool rpc_lz4_put_len(uint8_t * dst, size_t cap, size_t & op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= cap) {
+            return false;
+        }
+        dst[op++] = 255;
+    }
+    if (op >= cap) {
+        return false;
+    }
+    dst[op++] = (uint8_t) len;
+    return true;
+}
+
+static bool rpc_lz4_put_sequence(uint8_t * dst, size_t cap, size_t & op, const uint8_t * lit, size_t n_lit, size_t offset, size_t match_len) {
+    if (op >= cap) {
+        return false;
+    }
+    uint8_t & token = dst[op++];
+    token = (uint8_t) ((n_lit >= 15 ? 15 : n_lit) << 4);
+    if (n_lit >= 15 && !rpc_lz4_put_len(dst, cap, op, n_lit - 15)) {
+        return false;
+    }
+    if (op + n_lit > cap) {
+        return false;
+    }
+    memcpy(dst + op, lit, n_lit);
+    op += n_lit;
+
+    if (match_len == 0) {
+        // last sequence: literals only
+        return true;
+    }
+
+    if (op + 2 > cap) {
+        return false;
+    }
+    dst[op++] = (uint8_t) (offset & 0xff);
+    dst[op++] = (uint8_t) (offset >> 8);
+
+    const size_t ml = match_len - RPC_LZ4_MIN_MATCH;
+    token |= (uint8_t) (ml >= 15 ? 15 : ml);
+    if (ml >= 15 && !rpc_lz4_put_len(dst, cap, op, ml - 15)) {
+        return false;
+    }
+    return true;
+}
+
+// returns the compressed size, or 0 if the output does not fit in cap bytes
+static size_t rpc_lz4_compress(const uint8_t * src, size_t n, uint8_t * dst, size_t cap) {
+    std::vector<uint32_t> table(1 << RPC_LZ4_HASH_LOG, 0); // position + 1 of the last occurrence of a hash, 0 = none
+
+    size_t op     = 0;
+    size_t anchor = 0;
+    size_t ip     = 0;
+
+    if (n > RPC_LZ4_MF_LIMIT) {
+        const size_t match_limit = n - RPC_LZ4_MF_LIMIT;
+        const size_t end_limit   = n - RPC_LZ4_LAST_LITERALS;
+
+        while (ip < match_limit) {
+            const uint32_t seq = rpc_lz4_read32(src + ip);
+            const uint32_t h   = (seq * 2654435761u) >> (32 - RPC_LZ4_HASH_LOG);
+            const size_t   ref = table[h];
+            table[h] = (uint32_t) (ip + 1);
+
+            if (ref == 0 || ip - (ref - 1) > RPC_LZ4_MAX_OFFSET || rpc_lz4_read32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+
+            const size_t mp = ref - 1;
+            size_t ml = RPC_LZ4_MIN_MATCH;
+            while (ip + ml < end_limit && src[mp + ml] == src[ip + ml]) {
+                ml++;
+            }
+
+            if (!rpc_lz4_put_sequence(dst, cap, op, src + anchor, ip - anchor, ip - mp, ml)) {
+                return 0;
+            }
+            ip    += ml;
+            anchor = ip;
+        }
+    }
+
+    if (!rpc_lz4_put_sequence(dst, cap, op, src + anchor, n - anchor, 0, 0)) {
+        return 0;
+    }
+    return op;
+}
+
+// returns false if the input is malformed or does not decompress to exactly dst_size bytes
+static bool rpc_lz4_decompress(const uint8_t * src, size_t n, uint8_t * dst, size_t dst_size) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    auto get_len = [&](size_t & len) {
+        uint8_t b;
+        do {
+            if (ip >= n) {
+                return false;
+            }
+            b = src[ip++];
+            len += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < n) {
+        const uint8_t token = src[ip++];
+
+        size_t n_lit = token >> 4;
+        if (n_lit == 15 && !get_len(n_lit)) {
+            return false;
+        }
+        if (n_lit > n - ip || n_lit > dst_size - op) {
+            return false;
+        }
+        memcpy(dst + op, src + ip, n_lit);
+        ip += n_lit;
+        op += n_lit;
+
+        if (ip == n) {
+            break;
+        }
+
+        if (n - ip < 2) {
+            return false;
+        }
+        const size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return false;
+        }
+
+        size_t ml = token & 15;
+        if (ml == 15 && !get_len(ml)) {
+            return false;
+        }
+        ml += RPC_LZ4_MIN_MATCH;
+        if (ml > dst_size - op) {
+            return false;
+        }
+        // the match may overlap the output, copy byte by byte
+        for (size_t i = 0; i < ml; ++i, ++op) {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    return op == dst_size;
+}
+
+static bool rpc_compress_enabled() {
+    static const bool enabled = getenv("GGML_RPC_COMPRESS") != nullptr;
+    return enabled;
+}
+
 static std::shared_ptr<socket_t> make_socket(sockfd_t fd) {
 #ifdef _WIN32
     if (fd == INVALID_SOCKET) {
@@ -260,6 +455,13 @@ static std::shared_ptr<socket_t> socket_connect(const char * host, int port) {
     if (connect(sock_ptr->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         return nullptr;
     }
+#ifdef GGML_RPC_ZEROCOPY
+    {
+        // large tensor uploads are sent from the caller's memory, see send_payload()
+        int flag = 1;
+        sock_ptr->zerocopy = setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &flag, sizeof(flag)) == 0;
+    }
+#endif
     return sock_ptr;
 }
 
@@ -328,6 +530,60 @@ static bool recv_data(sockfd_t sockfd, void * data, size_t size) {
     return true;
 }
 
+#ifdef GGML_RPC_ZEROCOPY
+// the pages of a MSG_ZEROCOPY send belong to the kernel until its completion is read from the error queue
+static bool wait_zerocopy(socket_t * sock) {
+    while (sock->zc_done != sock->zc_sent) {
+        struct pollfd pfd = { sock->fd, 0, 0 }; // POLLERR is always reported
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return false;
+        }
+
+        char control[128];
+        struct msghdr msg = {};
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        for (struct cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            const struct sock_extended_err * serr = (const struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                // completions are reported as ranges of send counters
+                sock->zc_done += serr->ee_data - serr->ee_info + 1;
+            }
+        }
+    }
+    return true;
+}
+#endif
+
+// sends the request data that follows the message header, large tensor data is sent with MSG_ZEROCOPY when possible
+static bool send_payload(socket_t * sock, const void * data, size_t size) {
+#ifdef GGML_RPC_ZEROCOPY
+    if (sock->zerocopy && size >= ZEROCOPY_THRESHOLD) {
+        size_t bytes_sent = 0;
+        while (bytes_sent < size) {
+            ssize_t n = send(sock->fd, (const char *)data + bytes_sent, size - bytes_sent, MSG_ZEROCOPY);
+            if (n < 0) {
+                if (errno == ENOBUFS) {
+                    // out of optmem for pinned pages, copy the rest
+                    return send_data(sock->fd, (const char *)data + bytes_sent, size - bytes_sent);
+                }
+                return false;
+            }
+            sock->zc_sent++;
+            bytes_sent += n;
+        }
+        return true;
+    }
+#endif
+    return send_data(sock->fd, data, size);
+}
+
 static bool send_msg(sockfd_t sockfd, const void * msg, size_t msg_size) {
     if (!send_data(sockfd, &msg_size, sizeof(msg_size))) {
         return false;
@@ -372,17 +628,54 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
 
 // RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
 // RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
-    uint8_t cmd_byte = cmd;
+// request_data is input followed by payload, so that tensor data does not have to be copied into the request
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size,
+                         const void * payload, size_t payload_size, void * output, size_t output_size) {
+    uint8_t  cmd_byte     = cmd;
+    uint64_t request_size = input_size + payload_size;
+#ifndef _WIN32
+    // header and input in a single segment
+    struct iovec iov[3] = {
+        { &cmd_byte,       sizeof(cmd_byte)     },
+        { &request_size,   sizeof(request_size) },
+        { const_cast<void *>(input), input_size },
+    };
+    struct msghdr msg = {};
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = 3;
+    size_t n_left = sizeof(cmd_byte) + sizeof(request_size) + input_size;
+    while (n_left > 0) {
+        ssize_t n = sendmsg(sock->fd, &msg, 0);
+        if (n < 0) {
+            return false;
+        }
+        n_left -= n;
+        // skip what was sent
+        while (n > 0 && msg.msg_iovlen > 0) {
+            const size_t n_iov = std::min<size_t>(n, msg.msg_iov->iov_len);
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n_iov;
+            msg.msg_iov->iov_len -= n_iov;
+            n -= n_iov;
+            if (msg.msg_iov->iov_len == 0) {
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+        }
+    }
+#else
     if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
         return false;
     }
-    if (!send_data(sock->fd, &input_size, sizeof(input_size))) {
+    if (!send_data(sock->fd, &request_size, sizeof(request_size))) {
         return false;
     }
     if (!send_data(sock->fd, input, input_size)) {
         return false;
     }
+#endif
+    if (payload_size > 0 && !send_payload(sock.get(), payload, payload_size)) {
+        return false;
+    }
     // TODO: currently the output_size is always known, do we need support for commands with variable output size?
     // even if we do, we can skip sending output_size from the server for commands with known output size
     uint64_t out_size;
@@ -395,9 +688,19 @@ static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cm
     if (!recv_data(sock->fd, output, output_size)) {
         return false;
     }
+#ifdef GGML_RPC_ZEROCOPY
+    // the server has the whole request, make sure the kernel is done with the caller's pages before returning
+    if (!wait_zerocopy(sock.get())) {
+        return false;
+    }
+#endif
     return true;
 }
 
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    return send_rpc_cmd(sock, cmd, input, input_size, nullptr, 0, output, output_size);
+}
+
 // RPC client-side implementation
 
 static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
@@ -525,13 +828,28 @@ static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggm
             return;
         }
     }
+    if (rpc_compress_enabled() && size >= LZ4_THRESHOLD && ggml_backend_buffer_get_usage(buffer) != GGML_BACKEND_BUFFER_USAGE_WEIGHTS) {
+        // input serialization format: | rpc_tensor | offset (8 bytes) | size (8 bytes) | lz4 block |
+        const size_t header_size = sizeof(rpc_tensor) + 2*sizeof(uint64_t);
+        std::vector<uint8_t> input(header_size + size - size/8);
+        // only worth it if it saves at least 1/8 of the bytes
+        const size_t n_compressed = rpc_lz4_compress((const uint8_t *)data, size, input.data() + header_size, input.size() - header_size);
+        if (n_compressed > 0) {
+            const uint64_t raw_size = size;
+            input.resize(header_size + n_compressed);
+            memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
+            memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
+            memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), &raw_size, sizeof(raw_size));
+            bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR_LZ4, input.data(), input.size(), nullptr, 0);
+            GGML_ASSERT(status);
+            return;
+        }
+    }
     // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes)
-    size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
-    std::vector<uint8_t> input(input_size, 0);
-    memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
-    memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
-    memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input.data(), input.size(), nullptr, 0);
+    uint8_t input[sizeof(rpc_tensor) + sizeof(uint64_t)];
+    memcpy(input, &rpc_tensor, sizeof(rpc_tensor));
+    memcpy(input + sizeof(rpc_tensor), &offset, sizeof(offset));
+    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input, sizeof(input), data, size, nullptr, 0);
     GGML_ASSERT(status);
 }
 
@@ -719,6 +1037,19 @@ static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, g
     serialize_graph(cgraph, input);
     rpc_msg_graph_compute_rsp response;
     auto sock = get_socket(rpc_ctx->endpoint);
+    if (rpc_compress_enabled() && input.size() >= LZ4_THRESHOLD) {
+        // input serialization format: | size (8 bytes) | lz4 block |
+        std::vector<uint8_t> compressed(sizeof(uint64_t) + input.size() - input.size()/8);
+        const size_t n_compressed = rpc_lz4_compress(input.data(), input.size(), compressed.data() + sizeof(uint64_t), compressed.size() - sizeof(uint64_t));
+        if (n_compressed > 0) {
+            const uint64_t raw_size = input.size();
+            memcpy(compressed.data(), &raw_size, sizeof(raw_size));
+            compressed.resize(sizeof(uint64_t) + n_compressed);
+            bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE_LZ4, compressed.data(), compressed.size(), &response, sizeof(response));
+            GGML_ASSERT(status);
+            return (enum ggml_status)response.result;
+        }
+    }
     bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
     GGML_ASSERT(status);
     return (enum ggml_status)response.result;
@@ -824,7 +1155,8 @@ public:
     bool buffer_get_base(const rpc_msg_buffer_get_base_req & request, rpc_msg_buffer_get_base_rsp & response);
     bool free_buffer(const rpc_msg_free_buffer_req & request);
     bool buffer_clear(const rpc_msg_buffer_clear_req & request);
-    bool set_tensor(const std::vector<uint8_t> & input);
+    bool set_tensor(sockfd_t sockfd, uint64_t input_size);
+    bool set_tensor_lz4(const std::vector<uint8_t> & input);
     bool set_tensor_hash(const std::vector<uint8_t> & input, rpc_msg_set_tensor_hash_rsp & response);
     bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
     bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
@@ -971,15 +1303,18 @@ ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rp
 }
 
 
-bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
+bool rpc_server::set_tensor(sockfd_t sockfd, uint64_t input_size) {
     // serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
-    if (input.size() < sizeof(rpc_tensor) + sizeof(uint64_t)) {
+    // the data is received in chunks straight into the tensor, the message is never buffered as a whole
+    rpc_tensor in_tensor;
+    uint64_t offset;
+    if (input_size < sizeof(rpc_tensor) + sizeof(uint64_t)) {
         return false;
     }
-    const rpc_tensor * in_tensor = (const rpc_tensor *)input.data();
-    uint64_t offset;
-    memcpy(&offset, input.data() + sizeof(rpc_tensor), sizeof(offset));
-    const size_t size = input.size() - sizeof(rpc_tensor) - sizeof(offset);
+    if (!recv_data(sockfd, &in_tensor, sizeof(in_tensor)) || !recv_data(sockfd, &offset, sizeof(offset))) {
+        return false;
+    }
+    const size_t size = input_size - sizeof(rpc_tensor) - sizeof(offset);
 
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
@@ -989,7 +1324,7 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
     ggml_context_ptr ctx_ptr { ggml_init(params) };
     GGML_ASSERT(ctx_ptr != nullptr);
     ggml_context * ctx = ctx_ptr.get();
-    ggml_tensor * tensor = deserialize_tensor(ctx, in_tensor);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &in_tensor);
     if (tensor == nullptr) {
         GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
         return false;
@@ -1001,23 +1336,130 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
         const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
         const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
 
-        if (in_tensor->data + offset < p0 || in_tensor->data + offset >= p1 || size > (p1 - in_tensor->data - offset)) {
+        if (in_tensor.data + offset < p0 || in_tensor.data + offset >= p1 || size > (p1 - in_tensor.data - offset)) {
             GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
         }
     }
 
-    const void * data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
+    // large tensors are also saved to cache_dir/hash, written to a temporary file first so that an interrupted
+    // or failed upload never leaves a truncated file under a valid hash
+    std::ofstream ofs;
+    fs::path      cache_tmp;
+    uint64_t      hash = 0xcbf29ce484222325ULL;
+    auto discard_cache = [&]() {
+        ofs.close();
+        std::error_code ec;
+        fs::remove(cache_tmp, ec);
+    };
     if (cache_dir && size > HASH_THRESHOLD) {
-        uint64_t hash = fnv_hash((const uint8_t*)data, size);
+        // the pid keeps the servers that share a cache directory apart
+#ifdef _WIN32
+        const unsigned long pid = GetCurrentProcessId();
+#else
+        const unsigned long pid = (unsigned long) getpid();
+#endif
+        cache_tmp = fs::path(cache_dir) / ("tmp-" + std::to_string(pid) + "-" + std::to_string(in_tensor.data + offset));
+        ofs.open(cache_tmp, std::ios::binary);
+        if (!ofs) {
+            discard_cache();
+        }
+    }
+
+    // host buffers are filled in place, other buffers through a bounded staging buffer
+    const bool is_host = ggml_backend_buffer_is_host(tensor->buffer);
+    std::vector<uint8_t> chunk;
+    for (size_t done = 0; done < size; ) {
+        const size_t n = std::min(RECV_CHUNK_SIZE, size - done);
+        uint8_t * dst = nullptr;
+        if (is_host) {
+            dst = (uint8_t *) tensor->data + offset + done;
+        } else {
+            chunk.resize(n);
+            dst = chunk.data();
+        }
+        if (!recv_data(sockfd, dst, n)) {
+            if (ofs.is_open()) {
+                discard_cache();
+            }
+            return false;
+        }
+        if (!is_host) {
+            ggml_backend_tensor_set(tensor, dst, offset + done, n);
+        }
+        if (ofs.is_open()) {
+            hash = fnv_hash(dst, n, hash);
+            if (!ofs.write((const char *) dst, n)) {
+                GGML_LOG_WARN("[%s] failed to write '%s', the tensor is not cached\n", __func__, cache_tmp.c_str());
+                discard_cache();
+            }
+        }
+        done += n;
+    }
+
+    if (ofs.is_open()) {
+        // close() flushes the buffered data, which can still fail
+        ofs.close();
+        if (ofs.fail()) {
+            GGML_LOG_WARN("[%s] failed to write '%s', the tensor is not cached\n", __func__, cache_tmp.c_str());
+            discard_cache();
+            return true;
+        }
         char hash_str[17];
         snprintf(hash_str, sizeof(hash_str), "%016" PRIx64, hash);
-        // save to cache_dir/hash_str
         fs::path cache_file = fs::path(cache_dir) / hash_str;
-        std::ofstream ofs(cache_file, std::ios::binary);
-        ofs.write((const char *)data, size);
-        printf("[%s] saved to '%s'\n", __func__, cache_file.c_str());
+        std::error_code ec;
+        fs::rename(cache_tmp, cache_file, ec);
+        if (ec) {
+            fs::remove(cache_tmp, ec);
+        } else {
+            printf("[%s] saved to '%s'\n", __func__, cache_file.c_str());
+        }
     }
-    ggml_backend_tensor_set(tensor, data, offset, size);
+    return true;
+}
+
+bool rpc_server::set_tensor_lz4(const std::vector<uint8_t> & input) {
+    // serialization format: | rpc_tensor | offset (8 bytes) | size (8 bytes) | lz4 block |
+    if (input.size() < sizeof(rpc_tensor) + 2*sizeof(uint64_t)) {
+        return false;
+    }
+    const rpc_tensor * in_tensor = (const rpc_tensor *)input.data();
+    uint64_t offset;
+    uint64_t size;
+    memcpy(&offset, input.data() + sizeof(rpc_tensor), sizeof(offset));
+    memcpy(&size,   input.data() + sizeof(rpc_tensor) + sizeof(offset), sizeof(size));
+
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context_ptr ctx_ptr { ggml_init(params) };
+    GGML_ASSERT(ctx_ptr != nullptr);
+    ggml_context * ctx = ctx_ptr.get();
+    ggml_tensor * tensor = deserialize_tensor(ctx, in_tensor);
+    if (tensor == nullptr) {
+        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
+        return false;
+    }
+
+    // sanitize tensor->data
+    {
+        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
+        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+
+        if (in_tensor->data + offset < p0 || in_tensor->data + offset >= p1 || size > (p1 - in_tensor->data - offset)) {
+            GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+        }
+    }
+
+    const size_t header_size = sizeof(rpc_tensor) + 2*sizeof(uint64_t);
+    std::vector<uint8_t> data(size);
+    if (!rpc_lz4_decompress(input.data() + header_size, input.size() - header_size, data.data(), size)) {
+        GGML_LOG_ERROR("[%s] invalid compressed data\n", __func__);
+        return false;
+    }
+    ggml_backend_tensor_set(tensor, data.data(), offset, size);
     return true;
 }
 
@@ -1369,11 +1811,24 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 break;
             }
             case RPC_CMD_SET_TENSOR: {
+                uint64_t input_size;
+                if (!recv_data(sockfd, &input_size, sizeof(input_size))) {
+                    return;
+                }
+                if (!server.set_tensor(sockfd, input_size)) {
+                    return;
+                }
+                if (!send_msg(sockfd, nullptr, 0)) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_SET_TENSOR_LZ4: {
                 std::vector<uint8_t> input;
                 if (!recv_msg(sockfd, input)) {
                     return;
                 }
-                if (!server.set_tensor(input)) {
+                if (!server.set_tensor_lz4(input)) {
                     return;
                 }
                 if (!send_msg(sockfd, nullptr, 0)) {
@@ -1450,6 +1905,37 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 }
                 break;
             }
+            case RPC_CMD_GRAPH_COMPUTE_LZ4: {
+                // serialization format: | size (8 bytes) | lz4 block |
+                std::vector<uint8_t> compressed;
+                if (!recv_msg(sockfd, compressed)) {
+                    return;
+                }
+                uint64_t size;
+                if (compressed.size() < sizeof(size)) {
+                    return;
+                }
+                memcpy(&size, compressed.data(), sizeof(size));
+                std::vector<uint8_t> input;
+                try {
+                    input.resize(size);
+                } catch (const std::bad_alloc & e) {
+                    fprintf(stderr, "Failed to allocate input buffer of size %" PRIu64 "\n", size);
+                    return;
+                }
+                if (!rpc_lz4_decompress(compressed.data() + sizeof(size), compressed.size() - sizeof(size), input.data(), input.size())) {
+                    fprintf(stderr, "Invalid compressed graph\n");
+                    return;
+                }
+                rpc_msg_graph_compute_rsp response;
+                if (!server.graph_compute(input, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_GET_DEVICE_MEMORY: {
                 if (!recv_msg(sockfd, nullptr, 0)) {
                     return;
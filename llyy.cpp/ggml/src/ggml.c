@@ -6467,6 +6467,7 @@ void ggml_threadpool_params_init(struct ggml_threadpool_params * p, int n_thread
     p->n_threads  = n_threads;
     p->prio       = 0;     // default priority (usually means normal or inherited)
     p->poll       = 50;    // hybrid-polling enabled
+    p->poll_adaptive = false; // fixed polling budget
     p->strict_cpu = false; // no strict placement (all threads share same cpumask)
     p->paused     = false; // threads are ready to go
     memset(p->cpumask, 0, GGML_MAX_N_THREADS); // all-zero means use the default affinity (usually inherited)
@@ -6482,6 +6483,7 @@ bool ggml_threadpool_params_match(const struct ggml_threadpool_params * p0, cons
     if (p0->n_threads      != p1->n_threads  )    return false;
     if (p0->prio           != p1->prio       )    return false;
     if (p0->poll           != p1->poll       )    return false;
+    if (p0->poll_adaptive  != p1->poll_adaptive)  return false;
     if (p0->strict_cpu     != p1->strict_cpu )    return false;
     return memcmp(p0->cpumask, p1->cpumask, GGML_MAX_N_THREADS) == 0;
 }
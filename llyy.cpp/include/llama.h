@@ -313,11 +313,24 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // tensor parallelism across processes on the same host (LLaMA-style models, CPU only)
+        // every rank loads 1/tp_size of the attention heads and FFN units and the partial sums are exchanged
+        // through the POSIX shared memory object tp_shm - all ranks must run the same batches in lockstep
+        int32_t      tp_rank;
+        int32_t      tp_size; // 1 = disabled
+        const char * tp_shm;
+
+        // stream the layer weights from the mapped model file instead of keeping them all resident, for models larger
+        // than the memory: the weights of the next n_layer_stream layers are read in ahead of the computation and the
+        // pages of the used ones are released (0 = disabled, requires use_mmap and no use_mlock)
+        int32_t n_layer_stream;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool use_hugepages; // back the CPU weights (copied out of the mapping) and KV caches with 2 MiB huge pages
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -379,6 +392,7 @@ extern "C" {
         void * imatrix;                       // pointer to importance matrix data
         void * kv_overrides;                  // pointer to vector containing overrides
         void * tensor_types;                  // pointer to vector containing tensor types
+        const char * cache_dir;               // directory of the quantized tensor cache, reused across runs (nullptr to disable)
     } llama_model_quantize_params;
 
     typedef struct llama_logit_bias {
@@ -583,6 +597,40 @@ extern "C" {
     // Remove all LoRA adapters from given context
     LLAMA_API void llama_clear_adapter_lora(struct llama_context * ctx);
 
+    // Select the LoRA adapter used by the tokens of a single sequence, in addition to the adapters set on the context
+    // Sequences with different adapters can be decoded in the same batch, a NULL adapter clears the selection
+    // A token that belongs to several sequences uses the adapter of its first sequence
+    // Return -1 if seq_id is invalid
+    LLAMA_API int32_t llama_set_adapter_lora_seq(
+            struct llama_context * ctx,
+            struct llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale);
+
+    // Restrict the logits of the outputs of a sequence to a set of candidate tokens, n_tokens == 0 clears the set
+    // Only the rows of the output projection of the candidates are computed: the row of llama_get_logits_ith() of an
+    // output of the sequence starts with the n_tokens logits of the candidates, in the given order, and the rest of the
+    // row is unspecified (the built-in samplers expect full rows and cannot be used on these outputs)
+    // A token that belongs to several sequences uses the candidates of its first sequence
+    // Return -1 if seq_id or a token is invalid
+    LLAMA_API int32_t llama_set_output_tokens(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                         int32_t   n_tokens);
+
+    // Self-speculative decoding: the next decodes run only the first n_layer layers of the model, followed by the output
+    // norm and the output projection, to draft tokens without a separate draft model (n_layer == 0 runs the full model)
+    // The hidden states of the drafted tokens are kept: a full decode of a batch that starts with the drafted tokens, at
+    // the same positions, resumes them from layer n_layer on the KV cache already filled by the drafts (e.g. a batch
+    // with the last accepted token and the drafts to verify). The drafted positions that are not decoded again by the
+    // next full decode are removed from the KV cache, only their first layers were computed
+    // The drafted tokens must belong to a single sequence
+    // Return -1 if n_layer is invalid or the model architecture does not support early exit
+    LLAMA_API int32_t llama_set_draft_layers(
+            struct llama_context * ctx,
+                         int32_t   n_layer);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
@@ -1135,6 +1183,30 @@ extern "C" {
                                   char * buf,
                                int32_t   length);
 
+    // Chat template compiled once for a whole conversation
+    // Each call renders only the messages appended since the previous call, so the cost of a turn does not grow with
+    // the length of the conversation
+    struct llama_chat_renderer;
+
+    /// @param tmpl A Jinja template (only the builtin templates are detected) or the name of a builtin template, NULL for chatml
+    /// @return NULL if the template is not supported
+    LLAMA_API struct llama_chat_renderer * llama_chat_renderer_init(const char * tmpl);
+
+    LLAMA_API void llama_chat_renderer_free(struct llama_chat_renderer * renderer);
+
+    /// Render the messages chat[n_prev:n_msg], where n_prev is the n_msg of the previous call
+    /// The first n_prev messages must be unchanged since the previous call; if n_msg < n_prev, rendering starts over
+    /// The generation prompt (add_ass) is not part of the rendered state: passing the assistant reply in the next call
+    /// renders the reply after the previous messages, not after the generation prompt
+    /// @return The length of the rendered text. If it is larger than length, call again with the same arguments and a larger buffer
+    LLAMA_API int32_t llama_chat_renderer_apply(
+            struct llama_chat_renderer * renderer,
+       const struct llama_chat_message * chat,
+                                size_t   n_msg,
+                                  bool   add_ass,
+                                  char * buf,
+                               int32_t   length);
+
     // Get list of built-in chat templates
     LLAMA_API int32_t llama_chat_builtin_templates(const char ** output, size_t len);
 
@@ -1409,6 +1481,7 @@ extern "C" {
 
         int32_t n_p_eval;
         int32_t n_eval;
+        int32_t n_reused; // number of graphs reused
     };
 
     struct llama_perf_sampler_data {
@@ -4,6 +4,7 @@
 #include "llama-mmap.h"
 #include "llama-model.h"
 
+#include <algorithm>
 #include <map>
 #include <cassert>
 #include <stdexcept>
@@ -134,15 +135,108 @@ bool llama_adapter_cvec::apply(
 
 // lora
 
-llama_adapter_lora_weight * llama_adapter_lora::get_weight(ggml_tensor * w) {
-    const std::string name(w->name);
+bool llama_adapter_lora_split::same_layout(const llama_adapter_lora_split & other) const {
+    if (groups.size() != other.groups.size() || rows.size() != other.rows.size()) {
+        return false;
+    }
 
-    const auto pos = ab_map.find(name);
-    if (pos != ab_map.end()) {
-        return &pos->second;
+    for (size_t i = 0; i < groups.size(); ++i) {
+        if (groups[i].adapter != other.groups[i].adapter ||
+            groups[i].scale   != other.groups[i].scale   ||
+            ids[i].size()     != other.ids[i].size()) {
+            return false;
+        }
     }
 
-    return nullptr;
+    return true;
+}
+
+void llama_adapter_lora_groups::init(const llama_adapter_loras_seq & loras_seq, const llama_ubatch & ubatch, int32_t n_outputs) {
+    const int64_t n_tokens     = ubatch.n_tokens;
+    const int64_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    // adapter of each token, from the first sequence it belongs to
+    tok_lora.assign(n_tokens, nullptr);
+
+    // worst-case graphs are built from ubatches without sequence ids
+    if (!loras_seq.empty() && ubatch.n_seq_id && ubatch.seq_id) {
+        for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+            if (ubatch.n_seq_id[s] < 1) {
+                continue;
+            }
+
+            const auto it = loras_seq.find(ubatch.seq_id[s][0]);
+            if (it == loras_seq.end() || it->second.adapter == nullptr) {
+                continue;
+            }
+
+            for (int64_t i = 0; i < n_seq_tokens; ++i) {
+                tok_lora[s*n_seq_tokens + i] = &it->second;
+            }
+        }
+    }
+
+    auto split = [&](llama_adapter_lora_split & sp, const std::vector<int32_t> & tokens) {
+        sp.groups.clear();
+        sp.ids.clear();
+        sp.rows.assign(tokens.size(), 0);
+        sp.n_rows = 0;
+
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            const llama_adapter_lora_seq * lora = tok_lora[tokens[i]];
+            if (lora == nullptr) {
+                continue;
+            }
+
+            // groups are numbered in order of first appearance
+            size_t g = 0;
+            for (; g < sp.groups.size(); ++g) {
+                if (sp.groups[g].adapter == lora->adapter && sp.groups[g].scale == lora->scale) {
+                    break;
+                }
+            }
+            if (g == sp.groups.size()) {
+                sp.groups.push_back(*lora);
+                sp.ids.emplace_back();
+            }
+
+            sp.ids[g].push_back(i);
+            sp.n_rows++;
+        }
+
+        // the groups are stacked in order, followed by the zero row
+        std::fill(sp.rows.begin(), sp.rows.end(), sp.n_rows);
+        int32_t off = 0;
+        for (size_t g = 0; g < sp.groups.size(); ++g) {
+            for (size_t k = 0; k < sp.ids[g].size(); ++k) {
+                sp.rows[sp.ids[g][k]] = off + k;
+            }
+            off += sp.ids[g].size();
+        }
+    };
+
+    tok_ids.resize(n_tokens);
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        tok_ids[i] = i;
+    }
+    split(all, tok_ids);
+
+    // the output tokens, in the order used by llm_graph_input_out_ids
+    tok_ids.clear();
+    if (n_outputs == n_tokens) {
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            tok_ids.push_back(i);
+        }
+    } else if (ubatch.output) {
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            if (ubatch.output[i]) {
+                tok_ids.push_back(i);
+            }
+        }
+    } else if (n_outputs == 1) {
+        tok_ids.push_back(n_tokens - 1);
+    }
+    split(out, tok_ids);
 }
 
 static void llama_adapter_lora_init_impl(llama_model & model, const char * path_lora, llama_adapter_lora & adapter) {
@@ -267,6 +361,8 @@ static void llama_adapter_lora_init_impl(llama_model & model, const char * path_
         }
     }
 
+    adapter.weights.assign(model.tensors_by_name.size(), nullptr);
+
     // add tensors
     for (auto & it : ab_map) {
         const std::string & name = it.first;
@@ -321,6 +417,7 @@ static void llama_adapter_lora_init_impl(llama_model & model, const char * path_
         ggml_set_name(tensor_a, w.a->name);
         ggml_set_name(tensor_b, w.b->name);
         adapter.ab_map[name] = llama_adapter_lora_weight(tensor_a, tensor_b);
+        adapter.weights[model.get_tensor_id(model_tensor)] = &adapter.ab_map[name];
     }
 
     // allocate tensors / buffers and zero
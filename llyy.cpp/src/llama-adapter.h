@@ -1,9 +1,11 @@
 #pragma once
 
 #include "llama.h"
+#include "llama-batch.h"
 
 #include "ggml-cpp.h"
 
+#include <map>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -43,6 +45,9 @@ private:
 // llama_adapter_lora
 //
 
+// dense ids of the model weights, adapters keep their weights in flat tables indexed by these ids
+using llama_tensor_ids = std::unordered_map<const ggml_tensor *, int32_t>;
+
 struct llama_adapter_lora_weight {
     ggml_tensor * a = nullptr;
     ggml_tensor * b = nullptr;
@@ -62,6 +67,10 @@ struct llama_adapter_lora {
     // map tensor name to lora_a_b
     std::unordered_map<std::string, llama_adapter_lora_weight> ab_map;
 
+    // entries of ab_map indexed by the id of the model weight they modify (null if not modified)
+    // resolved once when the adapter is loaded, so that the graph build does not look up weights by name
+    std::vector<llama_adapter_lora_weight *> weights;
+
     std::vector<ggml_context_ptr> ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
@@ -70,7 +79,60 @@ struct llama_adapter_lora {
     llama_adapter_lora() = default;
     ~llama_adapter_lora() = default;
 
-    llama_adapter_lora_weight * get_weight(ggml_tensor * w);
+    llama_adapter_lora_weight * get_weight(int32_t id) const {
+        return id >= 0 && (size_t) id < weights.size() ? weights[id] : nullptr;
+    }
 };
 
 using llama_adapter_loras = std::unordered_map<llama_adapter_lora *, float>;
+
+//
+// llama_adapter_loras_seq
+//
+
+// adapter selected by a single sequence
+struct llama_adapter_lora_seq {
+    llama_adapter_lora * adapter = nullptr;
+    float                scale   = 0.0f;
+};
+
+using llama_adapter_loras_seq = std::map<llama_seq_id, llama_adapter_lora_seq>;
+
+// a set of tokens of a ubatch grouped by the adapter of their sequence
+// the low-rank products of each group are computed on its gathered tokens, the outputs of the groups are stacked in
+// group order and brought back to token order with a single get_rows
+struct llama_adapter_lora_split {
+    std::vector<llama_adapter_lora_seq> groups;
+    std::vector<std::vector<int32_t>>   ids;  // [n_groups][n_group_tokens] token indices of each group
+
+    // row of each token in the stacked outputs, tokens of sequences without adapter use the zero row after the last group
+    std::vector<int32_t> rows;
+
+    int32_t n_rows = 0; // number of tokens that belong to a group
+
+    // true if a single group covers all the tokens, the products are then computed without gather/scatter
+    bool is_uniform() const {
+        return groups.size() == 1 && (size_t) n_rows == rows.size();
+    }
+
+    bool same_layout(const llama_adapter_lora_split & other) const;
+};
+
+struct llama_adapter_lora_groups {
+    llama_adapter_lora_split all; // all the tokens of the ubatch
+    llama_adapter_lora_split out; // the output tokens, the last layer only computes these
+
+    // scratch of init(), kept so that the ubatches do not allocate
+    std::vector<const llama_adapter_lora_seq *> tok_lora;
+    std::vector<int32_t>                        tok_ids;
+
+    void init(const llama_adapter_loras_seq & loras_seq, const llama_ubatch & ubatch, int32_t n_outputs);
+
+    bool empty() const {
+        return all.groups.empty();
+    }
+
+    bool same_layout(const llama_adapter_lora_groups & other) const {
+        return all.same_layout(other.all) && out.same_layout(other.out);
+    }
+};
@@ -273,7 +273,7 @@ void llama_sbatch::from_batch(const llama_batch & batch, size_t n_embd, bool sim
             );
 }
 
-llama_batch_allocr::llama_batch_allocr(struct llama_batch in_batch, llama_pos p0) {
+const llama_batch & llama_batch_allocr::init(struct llama_batch in_batch, llama_pos p0) {
     batch = in_batch;
     GGML_ASSERT(batch.n_tokens > 0);
     if (!batch.pos) {
@@ -299,10 +299,11 @@ llama_batch_allocr::llama_batch_allocr(struct llama_batch in_batch, llama_pos p0
         batch.seq_id = seq_id.data();
     }
     if (!batch.logits) {
-        logits.resize(batch.n_tokens);
+        logits.assign(batch.n_tokens, false);
         logits[logits.size() - 1] = true;
         batch.logits = logits.data();
     }
+    return batch;
 }
 
 //
@@ -73,7 +73,7 @@ struct llama_sbatch {
     void from_batch(const llama_batch & batch, size_t n_embd, bool simple_split = false, bool logits_all = false);
 };
 
-// temporary allocate memory for the input batch if needed
+// memory for the fields missing from the input batch, kept by the context and reused by the next batches
 struct llama_batch_allocr {
     struct llama_batch batch;
 
@@ -84,5 +84,5 @@ struct llama_batch_allocr {
     std::vector<int8_t>         logits;
 
     // optionally fulfill the batch returned by llama_batch_get_one
-    llama_batch_allocr(struct llama_batch in_batch, llama_pos p0);
+    const llama_batch & init(struct llama_batch in_batch, llama_pos p0);
 };
@@ -2,6 +2,7 @@
 
 #include "llama.h"
 
+#include <cstring>
 #include <map>
 #include <sstream>
 #include <algorithm>
@@ -187,30 +188,85 @@ int32_t llm_chat_apply_template(
     llm_chat_template tmpl,
     const std::vector<const llama_chat_message *> & chat,
     std::string & dest, bool add_ass) {
-    // Taken from the research: https://github.com/ggerganov/llama.cpp/issues/5527
+    llm_chat_renderer renderer(tmpl);
+
+    return renderer.render(chat, add_ass, dest);
+}
+
+//
+// llm_chat_renderer
+//
+
+void llm_chat_renderer::reset() {
+    n_msg          = 0;
+    is_inside_turn = false;
+    system_prompt.clear();
+}
+
+int32_t llm_chat_renderer::render(
+    const std::vector<const llama_chat_message *> & chat,
+    bool add_ass, std::string & dest) {
+    if (tmpl == LLM_CHAT_TEMPLATE_UNKNOWN) {
+        // template not supported
+        return -1;
+    }
+
+    if (chat.size() < n_msg) {
+        // the conversation was truncated, start over
+        reset();
+    }
+
     std::stringstream ss;
+    if (n_msg == 0) {
+        render_begin(ss);
+    }
+    for (size_t i = n_msg; i < chat.size(); i++) {
+        render_message(ss, chat[i]);
+        n_msg++;
+    }
+    if (add_ass) {
+        render_generation_prompt(ss);
+    }
+
+    dest = ss.str();
+    return dest.size();
+}
+
+void llm_chat_renderer::render_begin(std::stringstream & ss) {
+    reset();
+
+    if (tmpl == LLM_CHAT_TEMPLATE_LLAMA_2
+            || tmpl == LLM_CHAT_TEMPLATE_LLAMA_2_SYS
+            || tmpl == LLM_CHAT_TEMPLATE_LLAMA_2_SYS_BOS
+            || tmpl == LLM_CHAT_TEMPLATE_LLAMA_2_SYS_STRIP) {
+        is_inside_turn = true; // skip BOS at the beginning
+        ss << "[INST] ";
+    } else if (tmpl == LLM_CHAT_TEMPLATE_CHATGML_3) {
+        ss << "[gMASK]" << "sop";
+    } else if (tmpl == LLM_CHAT_TEMPLATE_CHATGML_4) {
+        ss << "[gMASK]" << "<sop>";
+    } else if (tmpl == LLM_CHAT_TEMPLATE_GIGACHAT || tmpl == LLM_CHAT_TEMPLATE_YANDEX) {
+        ss << "<s>";
+    }
+}
+
+void llm_chat_renderer::render_message(std::stringstream & ss, const llama_chat_message * message) {
+    // Taken from the research: https://github.com/ggerganov/llama.cpp/issues/5527
+    std::string role(message->role);
     if (tmpl == LLM_CHAT_TEMPLATE_CHATML) {
         // chatml template
-        for (auto message : chat) {
-            ss << "<|im_start|>" << message->role << "\n" << message->content << "<|im_end|>\n";
-        }
-        if (add_ass) {
-            ss << "<|im_start|>assistant\n";
-        }
+        ss << "<|im_start|>" << role << "\n" << message->content << "<|im_end|>\n";
     } else if (tmpl == LLM_CHAT_TEMPLATE_MISTRAL_V7) {
         // Official mistral 'v7' template
         // See: https://huggingface.co/mistralai/Mistral-Large-Instruct-2411#basic-instruct-template-v7
-        for (auto message : chat) {
-            std::string role(message->role);
-            std::string content(message->content);
-            if (role == "system") {
-                ss << "[SYSTEM_PROMPT] " << content << "[/SYSTEM_PROMPT]";
-            } else if (role == "user") {
-                ss << "[INST] " << content << "[/INST]";
-            }
-            else {
-                ss << " " << content << "</s>";
-            }
+        std::string content(message->content);
+        if (role == "system") {
+            ss << "[SYSTEM_PROMPT] " << content << "[/SYSTEM_PROMPT]";
+        } else if (role == "user") {
+            ss << "[INST] " << content << "[/INST]";
+        }
+        else {
+            ss << " " << content << "</s>";
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_MISTRAL_V1
             || tmpl == LLM_CHAT_TEMPLATE_MISTRAL_V3
@@ -220,22 +276,18 @@ int32_t llm_chat_apply_template(
         std::string leading_space = tmpl == LLM_CHAT_TEMPLATE_MISTRAL_V1 ? " " : "";
         std::string trailing_space = tmpl == LLM_CHAT_TEMPLATE_MISTRAL_V3_TEKKEN ? "" : " ";
         bool trim_assistant_message = tmpl == LLM_CHAT_TEMPLATE_MISTRAL_V3;
-        bool is_inside_turn = false;
-        for (auto message : chat) {
-            if (!is_inside_turn) {
-                ss << leading_space << "[INST]" << trailing_space;
-                is_inside_turn = true;
-            }
-            std::string role(message->role);
-            std::string content(message->content);
-            if (role == "system") {
-                ss << content << "\n\n";
-            } else if (role == "user") {
-                ss << content << leading_space << "[/INST]";
-            } else {
-                ss << trailing_space << (trim_assistant_message ? trim(content) : content) << "</s>";
-                is_inside_turn = false;
-            }
+        if (!is_inside_turn) {
+            ss << leading_space << "[INST]" << trailing_space;
+            is_inside_turn = true;
+        }
+        std::string content(message->content);
+        if (role == "system") {
+            ss << content << "\n\n";
+        } else if (role == "user") {
+            ss << content << leading_space << "[/INST]";
+        } else {
+            ss << trailing_space << (trim_assistant_message ? trim(content) : content) << "</s>";
+            is_inside_turn = false;
         }
     } else if (
             tmpl == LLM_CHAT_TEMPLATE_LLAMA_2
@@ -251,381 +303,236 @@ int32_t llm_chat_apply_template(
         // [variant] trim spaces from the input message
         bool strip_message = tmpl == LLM_CHAT_TEMPLATE_LLAMA_2_SYS_STRIP;
         // construct the prompt
-        bool is_inside_turn = true; // skip BOS at the beginning
-        ss << "[INST] ";
-        for (auto message : chat) {
-            std::string content = strip_message ? trim(message->content) : message->content;
-            std::string role(message->role);
-            if (!is_inside_turn) {
-                is_inside_turn = true;
-                ss << (add_bos_inside_history ? "<s>[INST] " : "[INST] ");
-            }
-            if (role == "system") {
-                if (support_system_message) {
-                    ss << "<<SYS>>\n" << content << "\n<</SYS>>\n\n";
-                } else {
-                    // if the model does not support system message, we still include it in the first message, but without <<SYS>>
-                    ss << content << "\n";
-                }
-            } else if (role == "user") {
-                ss << content << " [/INST]";
+        std::string content = strip_message ? trim(message->content) : message->content;
+        if (!is_inside_turn) {
+            is_inside_turn = true;
+            ss << (add_bos_inside_history ? "<s>[INST] " : "[INST] ");
+        }
+        if (role == "system") {
+            if (support_system_message) {
+                ss << "<<SYS>>\n" << content << "\n<</SYS>>\n\n";
             } else {
-                ss << content << "</s>";
-                is_inside_turn = false;
+                // if the model does not support system message, we still include it in the first message, but without <<SYS>>
+                ss << content << "\n";
             }
+        } else if (role == "user") {
+            ss << content << " [/INST]";
+        } else {
+            ss << content << "</s>";
+            is_inside_turn = false;
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_PHI_3) {
         // Phi 3
-        for (auto message : chat) {
-            std::string role(message->role);
-            ss << "<|" << role << "|>\n" << message->content << "<|end|>\n";
-        }
-        if (add_ass) {
-            ss << "<|assistant|>\n";
-        }
+        ss << "<|" << role << "|>\n" << message->content << "<|end|>\n";
     } else if (tmpl == LLM_CHAT_TEMPLATE_PHI_4) {
         // chatml template
-        for (auto message : chat) {
-            ss << "<|im_start|>" << message->role << "<|im_sep|>" << message->content << "<|im_end|>";
-        }
-        if (add_ass) {
-            ss << "<|im_start|>assistant<|im_sep|>";
-        }
+        ss << "<|im_start|>" << role << "<|im_sep|>" << message->content << "<|im_end|>";
     } else if (tmpl == LLM_CHAT_TEMPLATE_FALCON_3) {
         // Falcon 3
-        for (auto message : chat) {
-            std::string role(message->role);
-            ss << "<|" << role << "|>\n" << message->content << "\n";
-        }
-        if (add_ass) {
-            ss << "<|assistant|>\n";
-        }
+        ss << "<|" << role << "|>\n" << message->content << "\n";
     } else if (tmpl == LLM_CHAT_TEMPLATE_ZEPHYR) {
         // zephyr template
-        for (auto message : chat) {
-            ss << "<|" << message->role << "|>" << "\n" << message->content << "<|endoftext|>\n";
-        }
-        if (add_ass) {
-            ss << "<|assistant|>\n";
-        }
+        ss << "<|" << role << "|>" << "\n" << message->content << "<|endoftext|>\n";
     } else if (tmpl == LLM_CHAT_TEMPLATE_MONARCH) {
         // mlabonne/AlphaMonarch-7B template (the <s> is included inside history)
-        for (auto message : chat) {
-            std::string bos = (message == chat.front()) ? "" : "<s>"; // skip BOS for first message
-            ss << bos << message->role << "\n" << message->content << "</s>\n";
-        }
-        if (add_ass) {
-            ss << "<s>assistant\n";
-        }
+        std::string bos = n_msg == 0 ? "" : "<s>"; // skip BOS for first message
+        ss << bos << role << "\n" << message->content << "</s>\n";
     } else if (tmpl == LLM_CHAT_TEMPLATE_GEMMA) {
         // google/gemma-7b-it
-        std::string system_prompt = "";
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "system") {
-                // there is no system message for gemma, but we will merge it with user prompt, so nothing is broken
-                system_prompt = trim(message->content);
-                continue;
-            }
-            // in gemma, "assistant" is "model"
-            role = role == "assistant" ? "model" : message->role;
-            ss << "<start_of_turn>" << role << "\n";
-            if (!system_prompt.empty() && role != "model") {
-                ss << system_prompt << "\n\n";
-                system_prompt = "";
-            }
-            ss << trim(message->content) << "<end_of_turn>\n";
-        }
-        if (add_ass) {
-            ss << "<start_of_turn>model\n";
-        }
+        if (role == "system") {
+            // there is no system message for gemma, but we will merge it with user prompt, so nothing is broken
+            system_prompt = trim(message->content);
+            return;
+        }
+        // in gemma, "assistant" is "model"
+        role = role == "assistant" ? "model" : message->role;
+        ss << "<start_of_turn>" << role << "\n";
+        if (!system_prompt.empty() && role != "model") {
+            ss << system_prompt << "\n\n";
+            system_prompt = "";
+        }
+        ss << trim(message->content) << "<end_of_turn>\n";
     } else if (tmpl == LLM_CHAT_TEMPLATE_ORION) {
         // OrionStarAI/Orion-14B-Chat
-        std::string system_prompt = "";
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "system") {
-                // there is no system message support, we will merge it with user prompt
-                system_prompt = message->content;
-                continue;
-            } else if (role == "user") {
-                ss << "Human: ";
-                if (!system_prompt.empty()) {
-                    ss << system_prompt << "\n\n";
-                    system_prompt = "";
-                }
-                ss << message->content << "\n\nAssistant: </s>";
-            } else {
-                ss << message->content << "</s>";
+        if (role == "system") {
+            // there is no system message support, we will merge it with user prompt
+            system_prompt = message->content;
+            return;
+        } else if (role == "user") {
+            ss << "Human: ";
+            if (!system_prompt.empty()) {
+                ss << system_prompt << "\n\n";
+                system_prompt = "";
             }
+            ss << message->content << "\n\nAssistant: </s>";
+        } else {
+            ss << message->content << "</s>";
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_OPENCHAT) {
         // openchat/openchat-3.5-0106,
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "system") {
-                ss << message->content << "<|end_of_turn|>";
-            } else {
-                role[0] = toupper(role[0]);
-                ss << "GPT4 Correct " << role << ": " << message->content << "<|end_of_turn|>";
-            }
-        }
-        if (add_ass) {
-            ss << "GPT4 Correct Assistant:";
+        if (role == "system") {
+            ss << message->content << "<|end_of_turn|>";
+        } else {
+            role[0] = toupper(role[0]);
+            ss << "GPT4 Correct " << role << ": " << message->content << "<|end_of_turn|>";
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_VICUNA || tmpl == LLM_CHAT_TEMPLATE_VICUNA_ORCA) {
         // eachadea/vicuna-13b-1.1 (and Orca variant)
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "system") {
-                // Orca-Vicuna variant uses a system prefix
-                if (tmpl == LLM_CHAT_TEMPLATE_VICUNA_ORCA) {
-                    ss << "SYSTEM: " << message->content << "\n";
-                } else {
-                    ss << message->content << "\n\n";
-                }
-            } else if (role == "user") {
-                ss << "USER: " << message->content << "\n";
-            } else if (role == "assistant") {
-                ss << "ASSISTANT: " << message->content << "</s>\n";
+        if (role == "system") {
+            // Orca-Vicuna variant uses a system prefix
+            if (tmpl == LLM_CHAT_TEMPLATE_VICUNA_ORCA) {
+                ss << "SYSTEM: " << message->content << "\n";
+            } else {
+                ss << message->content << "\n\n";
             }
-        }
-        if (add_ass) {
-            ss << "ASSISTANT:";
+        } else if (role == "user") {
+            ss << "USER: " << message->content << "\n";
+        } else if (role == "assistant") {
+            ss << "ASSISTANT: " << message->content << "</s>\n";
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_DEEPSEEK) {
         // deepseek-ai/deepseek-coder-33b-instruct
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "system") {
-                ss << message->content;
-            } else if (role == "user") {
-                ss << "### Instruction:\n" << message->content << "\n";
-            } else if (role == "assistant") {
-                ss << "### Response:\n" << message->content << "\n<|EOT|>\n";
-            }
-        }
-        if (add_ass) {
-            ss << "### Response:\n";
+        if (role == "system") {
+            ss << message->content;
+        } else if (role == "user") {
+            ss << "### Instruction:\n" << message->content << "\n";
+        } else if (role == "assistant") {
+            ss << "### Response:\n" << message->content << "\n<|EOT|>\n";
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_COMMAND_R) {
         // CohereForAI/c4ai-command-r-plus
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "system") {
-                ss << "<|START_OF_TURN_TOKEN|><|SYSTEM_TOKEN|>" << trim(message->content) << "<|END_OF_TURN_TOKEN|>";
-            } else if (role == "user") {
-                ss << "<|START_OF_TURN_TOKEN|><|USER_TOKEN|>" << trim(message->content) << "<|END_OF_TURN_TOKEN|>";
-            } else if (role == "assistant") {
-                ss << "<|START_OF_TURN_TOKEN|><|CHATBOT_TOKEN|>" << trim(message->content) << "<|END_OF_TURN_TOKEN|>";
-            }
-        }
-        if (add_ass) {
-            ss << "<|START_OF_TURN_TOKEN|><|CHATBOT_TOKEN|>";
+        if (role == "system") {
+            ss << "<|START_OF_TURN_TOKEN|><|SYSTEM_TOKEN|>" << trim(message->content) << "<|END_OF_TURN_TOKEN|>";
+        } else if (role == "user") {
+            ss << "<|START_OF_TURN_TOKEN|><|USER_TOKEN|>" << trim(message->content) << "<|END_OF_TURN_TOKEN|>";
+        } else if (role == "assistant") {
+            ss << "<|START_OF_TURN_TOKEN|><|CHATBOT_TOKEN|>" << trim(message->content) << "<|END_OF_TURN_TOKEN|>";
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_LLAMA_3) {
         // Llama 3
-        for (auto message : chat) {
-            std::string role(message->role);
-            ss << "<|start_header_id|>" << role << "<|end_header_id|>\n\n" << trim(message->content) << "<|eot_id|>";
-        }
-        if (add_ass) {
-            ss << "<|start_header_id|>assistant<|end_header_id|>\n\n";
-        }
+        ss << "<|start_header_id|>" << role << "<|end_header_id|>\n\n" << trim(message->content) << "<|eot_id|>";
     } else if (tmpl == LLM_CHAT_TEMPLATE_CHATGML_3) {
         // chatglm3-6b
-        ss << "[gMASK]" << "sop";
-        for (auto message : chat) {
-            std::string role(message->role);
-            ss << "<|" << role << "|>" << "\n " << message->content;
-        }
-        if (add_ass) {
-            ss << "<|assistant|>";
-        }
-    } else if (tmpl == LLM_CHAT_TEMPLATE_CHATGML_4) {
-        ss << "[gMASK]" << "<sop>";
-        for (auto message : chat) {
-            std::string role(message->role);
-            ss << "<|" << role << "|>" << "\n" << message->content;
-        }
-        if (add_ass) {
-            ss << "<|assistant|>";
-        }
-    } else if (tmpl == LLM_CHAT_TEMPLATE_GLMEDGE) {
-        for (auto message : chat) {
-            std::string role(message->role);
-            ss << "<|" << role << "|>" << "\n" << message->content;
-        }
-        if (add_ass) {
-            ss << "<|assistant|>";
-        }
+        ss << "<|" << role << "|>" << "\n " << message->content;
+    } else if (tmpl == LLM_CHAT_TEMPLATE_CHATGML_4 || tmpl == LLM_CHAT_TEMPLATE_GLMEDGE) {
+        ss << "<|" << role << "|>" << "\n" << message->content;
     } else if (tmpl == LLM_CHAT_TEMPLATE_MINICPM) {
         // MiniCPM-3B-OpenHermes-2.5-v2-GGUF
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "user") {
-                ss << LU8("<用户>");
-                ss << trim(message->content);
-                ss << "<AI>";
-            } else {
-                ss << trim(message->content);
-            }
+        if (role == "user") {
+            ss << LU8("<用户>");
+            ss << trim(message->content);
+            ss << "<AI>";
+        } else {
+            ss << trim(message->content);
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_DEEPSEEK_2) {
         // DeepSeek-V2
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "system") {
-                ss << message->content << "\n\n";
-            } else if (role == "user") {
-                ss << "User: " << message->content << "\n\n";
-            } else if (role == "assistant") {
-                ss << "Assistant: " << message->content << LU8("<｜end▁of▁sentence｜>");
-            }
-        }
-        if (add_ass) {
-            ss << "Assistant:";
+        if (role == "system") {
+            ss << message->content << "\n\n";
+        } else if (role == "user") {
+            ss << "User: " << message->content << "\n\n";
+        } else if (role == "assistant") {
+            ss << "Assistant: " << message->content << LU8("<｜end▁of▁sentence｜>");
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_DEEPSEEK_3) {
         // DeepSeek-V3
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "system") {
-                ss << message->content << "\n\n";
-            } else if (role == "user") {
-                ss << LU8("<｜User｜>") << message->content;
-            } else if (role == "assistant") {
-                ss << LU8("<｜Assistant｜>") << message->content << LU8("<｜end▁of▁sentence｜>");
-            }
-        }
-        if (add_ass) {
-            ss << LU8("<｜Assistant｜>");
+        if (role == "system") {
+            ss << message->content << "\n\n";
+        } else if (role == "user") {
+            ss << LU8("<｜User｜>") << message->content;
+        } else if (role == "assistant") {
+            ss << LU8("<｜Assistant｜>") << message->content << LU8("<｜end▁of▁sentence｜>");
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_EXAONE_3) {
         // ref: https://huggingface.co/LGAI-EXAONE/EXAONE-3.0-7.8B-Instruct/discussions/8#66bae61b1893d14ee8ed85bb
         // EXAONE-3.0-7.8B-Instruct
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "system") {
-                ss << "[|system|]" << trim(message->content) << "[|endofturn|]\n";
-            } else if (role == "user") {
-                ss << "[|user|]" << trim(message->content) << "\n";
-            } else if (role == "assistant") {
-                ss << "[|assistant|]" << trim(message->content) << "[|endofturn|]\n";
-            }
-        }
-        if (add_ass) {
-            ss << "[|assistant|]";
+        if (role == "system") {
+            ss << "[|system|]" << trim(message->content) << "[|endofturn|]\n";
+        } else if (role == "user") {
+            ss << "[|user|]" << trim(message->content) << "\n";
+        } else if (role == "assistant") {
+            ss << "[|assistant|]" << trim(message->content) << "[|endofturn|]\n";
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_RWKV_WORLD) {
         // this template requires the model to have "\n\n" as EOT token
-        for (auto message : chat) {
-            std::string role(message->role);
-            if (role == "user") {
-                ss << "User: " << message->content << "\n\nAssistant:";
-            } else {
-                ss << message->content << "\n\n";
-            }
+        if (role == "user") {
+            ss << "User: " << message->content << "\n\nAssistant:";
+        } else {
+            ss << message->content << "\n\n";
         }
     } else if (tmpl == LLM_CHAT_TEMPLATE_GRANITE) {
         // IBM Granite template
-        for (const auto & message : chat) {
-            std::string role(message->role);
-            ss << "<|start_of_role|>" << role << "<|end_of_role|>";
-            if (role == "assistant_tool_call") {
-                ss << "<|tool_call|>";
-            }
-            ss << message->content << "<|end_of_text|>\n";
-        }
-        if (add_ass) {
-            ss << "<|start_of_role|>assistant<|end_of_role|>\n";
+        ss << "<|start_of_role|>" << role << "<|end_of_role|>";
+        if (role == "assistant_tool_call") {
+            ss << "<|tool_call|>";
         }
+        ss << message->content << "<|end_of_text|>\n";
     } else if (tmpl == LLM_CHAT_TEMPLATE_GIGACHAT) {
-        // GigaChat template
-        bool has_system = !chat.empty() && std::string(chat[0]->role) == "system";
-
-        // Handle system message if present
-        if (has_system) {
-            ss << "<s>" << chat[0]->content << "<|message_sep|>";
-        } else {
-            ss << "<s>";
-        }
-
-        // Process remaining messages
-        for (size_t i = has_system ? 1 : 0; i < chat.size(); i++) {
-            std::string role(chat[i]->role);
-            if (role == "user") {
-                ss << "user<|role_sep|>" << chat[i]->content << "<|message_sep|>"
-                << "available functions<|role_sep|>[]<|message_sep|>";
-            } else if (role == "assistant") {
-                ss << "assistant<|role_sep|>" << chat[i]->content << "<|message_sep|>";
-            }
-        }
-
-        // Add generation prompt if needed
-        if (add_ass) {
-            ss << "assistant<|role_sep|>";
-        }
-    }  else if (tmpl == LLM_CHAT_TEMPLATE_MEGREZ) {
+        // GigaChat template, only a leading system message is kept
+        if (n_msg == 0 && role == "system") {
+            ss << message->content << "<|message_sep|>";
+        } else if (role == "user") {
+            ss << "user<|role_sep|>" << message->content << "<|message_sep|>"
+            << "available functions<|role_sep|>[]<|message_sep|>";
+        } else if (role == "assistant") {
+            ss << "assistant<|role_sep|>" << message->content << "<|message_sep|>";
+        }
+    } else if (tmpl == LLM_CHAT_TEMPLATE_MEGREZ) {
         // Megrez template
-        for (auto message : chat) {
-            std::string role(message->role);
-            ss << "<|role_start|>" << role << "<|role_end|>" << message->content << "<|turn_end|>";
-        }
-
-        if (add_ass) {
-            ss << "<|role_start|>assistant<|role_end|>";
-        }
+        ss << "<|role_start|>" << role << "<|role_end|>" << message->content << "<|turn_end|>";
     } else if (tmpl == LLM_CHAT_TEMPLATE_YANDEX) {
         // Yandex template ("\n\n" is defined as EOT token)
-
-        ss << "<s>";
-
-        for (size_t i = 0; i < chat.size(); i++) {
-            std::string role(chat[i]->role);
-            if (role == "user") {
-                ss << " Пользователь: " << chat[i]->content << "\n\n";
-            } else if (role == "assistant") {
-                ss << " Ассистент: " << chat[i]->content << "\n\n";
-            }
+        if (role == "user") {
+            ss << " Пользователь: " << message->content << "\n\n";
+        } else if (role == "assistant") {
+            ss << " Ассистент: " << message->content << "\n\n";
         }
-
-        // Add generation prompt if needed
-        if (add_ass) {
-            ss << " Ассистент:[SEP]";
-        }
-    }  else if (tmpl == LLM_CHAT_TEMPLATE_BAILING) {
+    } else if (tmpl == LLM_CHAT_TEMPLATE_BAILING) {
         // Bailing (Ling) template
-        for (auto message : chat) {
-            std::string role(message->role);
-
-            if (role == "user") {
-                role = "HUMAN";
-            } else {
-                std::transform(role.begin(), role.end(), role.begin(), ::toupper);
-            }
-
-            ss << "<role>" << role << "</role>" << message->content;
+        if (role == "user") {
+            role = "HUMAN";
+        } else {
+            std::transform(role.begin(), role.end(), role.begin(), ::toupper);
         }
 
-        if (add_ass) {
-            ss << "<role>ASSISTANT</role>";
-        }
+        ss << "<role>" << role << "</role>" << message->content;
     } else if (tmpl == LLM_CHAT_TEMPLATE_LLAMA4) {
         // Llama 4
-        for (auto message : chat) {
-            std::string role(message->role);
-            ss << "<|header_start|>" << role << "<|header_end|>\n\n" << trim(message->content) << "<|eot|>";
-        }
-        if (add_ass) {
-            ss << "<|header_start|>assistant<|header_end|>\n\n";
-        }
-    }  else {
-        // template not supported
-        return -1;
+        ss << "<|header_start|>" << role << "<|header_end|>\n\n" << trim(message->content) << "<|eot|>";
+    }
+}
+
+void llm_chat_renderer::render_generation_prompt(std::stringstream & ss) const {
+    switch (tmpl) {
+        case LLM_CHAT_TEMPLATE_CHATML:      ss << "<|im_start|>assistant\n"; break;
+        case LLM_CHAT_TEMPLATE_PHI_3:       ss << "<|assistant|>\n"; break;
+        case LLM_CHAT_TEMPLATE_PHI_4:       ss << "<|im_start|>assistant<|im_sep|>"; break;
+        case LLM_CHAT_TEMPLATE_FALCON_3:    ss << "<|assistant|>\n"; break;
+        case LLM_CHAT_TEMPLATE_ZEPHYR:      ss << "<|assistant|>\n"; break;
+        case LLM_CHAT_TEMPLATE_MONARCH:     ss << "<s>assistant\n"; break;
+        case LLM_CHAT_TEMPLATE_GEMMA:       ss << "<start_of_turn>model\n"; break;
+        case LLM_CHAT_TEMPLATE_OPENCHAT:    ss << "GPT4 Correct Assistant:"; break;
+        case LLM_CHAT_TEMPLATE_VICUNA:
+        case LLM_CHAT_TEMPLATE_VICUNA_ORCA: ss << "ASSISTANT:"; break;
+        case LLM_CHAT_TEMPLATE_DEEPSEEK:    ss << "### Response:\n"; break;
+        case LLM_CHAT_TEMPLATE_COMMAND_R:   ss << "<|START_OF_TURN_TOKEN|><|CHATBOT_TOKEN|>"; break;
+        case LLM_CHAT_TEMPLATE_LLAMA_3:     ss << "<|start_header_id|>assistant<|end_header_id|>\n\n"; break;
+        case LLM_CHAT_TEMPLATE_CHATGML_3:
+        case LLM_CHAT_TEMPLATE_CHATGML_4:
+        case LLM_CHAT_TEMPLATE_GLMEDGE:     ss << "<|assistant|>"; break;
+        case LLM_CHAT_TEMPLATE_DEEPSEEK_2:  ss << "Assistant:"; break;
+        case LLM_CHAT_TEMPLATE_DEEPSEEK_3:  ss << LU8("<｜Assistant｜>"); break;
+        case LLM_CHAT_TEMPLATE_EXAONE_3:    ss << "[|assistant|]"; break;
+        case LLM_CHAT_TEMPLATE_GRANITE:     ss << "<|start_of_role|>assistant<|end_of_role|>\n"; break;
+        case LLM_CHAT_TEMPLATE_GIGACHAT:    ss << "assistant<|role_sep|>"; break;
+        case LLM_CHAT_TEMPLATE_MEGREZ:      ss << "<|role_start|>assistant<|role_end|>"; break;
+        case LLM_CHAT_TEMPLATE_YANDEX:      ss << " Ассистент:[SEP]"; break;
+        case LLM_CHAT_TEMPLATE_BAILING:     ss << "<role>ASSISTANT</role>"; break;
+        case LLM_CHAT_TEMPLATE_LLAMA4:      ss << "<|header_start|>assistant<|header_end|>\n\n"; break;
+        default:
+            // the template has no generation prompt (the last user turn already ends with it)
+            break;
     }
-    dest = ss.str();
-    return dest.size();
 }
 
 // public interface
@@ -638,3 +545,60 @@ int32_t llama_chat_builtin_templates(const char ** output, size_t len) {
     }
     return (int32_t) LLM_CHAT_TEMPLATES.size();
 }
+
+struct llama_chat_renderer {
+    llm_chat_renderer renderer;
+
+    // the result of the last call, returned again when the call is repeated with a larger buffer
+    std::string last;
+    size_t      last_n_msg   = 0;
+    bool        last_add_ass = false;
+    bool        has_last     = false;
+};
+
+llama_chat_renderer * llama_chat_renderer_init(const char * tmpl) {
+    const llm_chat_template detected_tmpl = llm_chat_detect_template(tmpl == nullptr ? "chatml" : tmpl);
+    if (detected_tmpl == LLM_CHAT_TEMPLATE_UNKNOWN) {
+        return nullptr;
+    }
+
+    return new llama_chat_renderer { llm_chat_renderer(detected_tmpl), {}, 0, false, false };
+}
+
+void llama_chat_renderer_free(llama_chat_renderer * renderer) {
+    delete renderer;
+}
+
+int32_t llama_chat_renderer_apply(
+        llama_chat_renderer * renderer,
+   const llama_chat_message * chat,
+                     size_t   n_msg,
+                       bool   add_ass,
+                       char * buf,
+                    int32_t   length) {
+    const bool repeated = renderer->has_last && renderer->last_n_msg == n_msg && renderer->last_add_ass == add_ass &&
+                          renderer->renderer.n_msg == n_msg;
+
+    if (!repeated) {
+        std::vector<const llama_chat_message *> chat_vec(n_msg);
+        for (size_t i = 0; i < n_msg; i++) {
+            chat_vec[i] = &chat[i];
+        }
+
+        const int32_t res = renderer->renderer.render(chat_vec, add_ass, renderer->last);
+        if (res < 0) {
+            renderer->has_last = false;
+            return res;
+        }
+
+        renderer->last_n_msg   = n_msg;
+        renderer->last_add_ass = add_ass;
+        renderer->has_last     = true;
+    }
+
+    if (buf && length > 0) {
+        strncpy(buf, renderer->last.c_str(), length);
+    }
+
+    return renderer->last.size();
+}
@@ -1,8 +1,9 @@
 #pragma once
 
+#include <cstdint>
+#include <sstream>
 #include <string>
 #include <vector>
-#include <cstdint>
 
 enum llm_chat_template {
     LLM_CHAT_TEMPLATE_CHATML,
@@ -54,3 +55,31 @@ int32_t llm_chat_apply_template(
     llm_chat_template tmpl,
     const std::vector<const llama_chat_message *> & chat,
     std::string & dest, bool add_ass);
+
+// a builtin template together with the state carried from one message to the next
+// the text of a message only depends on the messages before it, so a conversation that grows by appending messages
+// is rendered incrementally: each call renders only the messages added since the previous one
+struct llm_chat_renderer {
+    explicit llm_chat_renderer(llm_chat_template tmpl) : tmpl(tmpl) {}
+
+    // render chat[n_msg:], followed by the generation prompt if add_ass
+    // chat[:n_msg] must be the messages rendered by the previous calls, a shorter chat starts over
+    // returns the size of dest, or -1 if the template is not supported
+    int32_t render(
+        const std::vector<const llama_chat_message *> & chat,
+        bool add_ass, std::string & dest);
+
+    void reset();
+
+    const llm_chat_template tmpl;
+
+    size_t n_msg = 0; // number of messages rendered so far
+
+private:
+    void render_begin(std::stringstream & ss);
+    void render_message(std::stringstream & ss, const llama_chat_message * message);
+    void render_generation_prompt(std::stringstream & ss) const;
+
+    bool        is_inside_turn = false;
+    std::string system_prompt; // system prompt waiting to be merged into the next user turn
+};
@@ -5,6 +5,8 @@
 #include "llama-mmap.h"
 #include "llama-model.h"
 #include "llama-kv-cache.h"
+#include "llama-stream.h"
+#include "llama-tp.h"
 
 #include <cassert>
 #include <cstring>
@@ -12,6 +14,18 @@
 #include <cinttypes>
 #include <cmath>
 
+// the ubatch sizes the compute graphs are reserved for at startup: 1, 8, 32, 128, ... up to n_ubatch
+static uint32_t llama_ubatch_bucket_prev(uint32_t n_tokens) {
+    if (n_tokens <= 8) {
+        return 1;
+    }
+    uint32_t n = 8;
+    while (4*n < n_tokens) {
+        n *= 4;
+    }
+    return n;
+}
+
 //
 // llama_context
 //
@@ -283,6 +297,11 @@ llama_context::llama_context(
         if (pipeline_parallel) {
             LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(sched.get()));
         }
+
+        // TODO: the input copies of pipeline parallel splits rotate between graph evaluations, keep it simple for now
+        graph_reuse = !pipeline_parallel && getenv("LLAMA_GRAPH_REUSE_DISABLE") == nullptr;
+
+        LLAMA_LOG_DEBUG("%s: graph reuse = %d\n", __func__, graph_reuse);
     }
 
     // reserve worst-case graph
@@ -290,8 +309,6 @@ llama_context::llama_context(
         const uint32_t n_seqs = 1; // TODO: worst-case number of sequences
         const uint32_t n_tokens = std::min(cparams.n_ctx, cparams.n_ubatch);
 
-        llama_token token = model.vocab.token_bos(); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
-
         // restore later
         // TODO: something cleaner
         const auto n_outputs_save = n_outputs;
@@ -304,64 +321,33 @@ llama_context::llama_context(
         int n_splits_tg = -1;
         int n_nodes_tg  = -1;
 
-        // simulate full KV cache
+        // simulate full KV cache, the plans of the graphs also fit the graphs of the smaller KV sizes
         kv_self->n = kv_self->size;
 
         cross.v_embd.clear();
 
-        // reserve pp graph first so that buffers are only allocated once
-        {
-            llama_ubatch ubatch_pp = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
-
-            // max number of outputs
-            n_outputs = ubatch_pp.n_tokens;
-
-            LLAMA_LOG_DEBUG("%s: reserving graph for n_tokens = %d, n_seqs = %d\n", __func__, ubatch_pp.n_tokens, ubatch_pp.n_seqs);
+        // reserve one graph per ubatch size bucket, largest first so that buffers are only allocated once - the
+        // allocator keeps a plan per graph shape, so that switching between prompt processing and generation does
+        // not reserve again on the way of the requests
+        for (uint32_t n_bucket = n_tokens; ; ) {
+            LLAMA_LOG_DEBUG("%s: reserving graph for n_tokens = %d, n_seqs = %d\n", __func__, n_bucket, n_seqs);
 
-            auto * gf = graph_init();
-            graph_build(ctx_compute.get(), gf, ubatch_pp, LLM_GRAPH_TYPE_DEFAULT);
-
-            if (!ggml_backend_sched_reserve(sched.get(), gf)) {
-                throw std::runtime_error("failed to allocate compute pp buffers");
+            auto * gf = graph_reserve(n_bucket, n_seqs, n_bucket);
+            if (!gf) {
+                throw std::runtime_error(format("failed to allocate compute buffers for n_tokens = %d", n_bucket));
             }
 
-            n_splits_pp = ggml_backend_sched_get_n_splits(sched.get());
-            n_nodes_pp  = ggml_graph_n_nodes(gf);
-        }
-
-        // reserve with tg graph to get the number of splits and nodes
-        {
-            llama_ubatch ubatch_tg = { true, 1, 1, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
-
-            n_outputs = ubatch_tg.n_tokens;
-
-            LLAMA_LOG_DEBUG("%s: reserving graph for n_tokens = %d, n_seqs = %d\n", __func__, ubatch_tg.n_tokens, ubatch_tg.n_seqs);
-
-            auto * gf = graph_init();
-            graph_build(ctx_compute.get(), gf, ubatch_tg, LLM_GRAPH_TYPE_DEFAULT);
-
-            if (!ggml_backend_sched_reserve(sched.get(), gf)) {
-                throw std::runtime_error("failed to allocate compute tg buffers");
+            if (n_bucket == n_tokens) {
+                n_splits_pp = ggml_backend_sched_get_n_splits(sched.get());
+                n_nodes_pp  = ggml_graph_n_nodes(gf);
             }
-
-            n_splits_tg = ggml_backend_sched_get_n_splits(sched.get());
-            n_nodes_tg  = ggml_graph_n_nodes(gf);
-        }
-
-        // reserve again with pp graph to avoid ggml-alloc reallocations during inference
-        {
-            llama_ubatch ubatch_pp = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
-
-            n_outputs = ubatch_pp.n_tokens;
-
-            LLAMA_LOG_DEBUG("%s: reserving graph for n_tokens = %d, n_seqs = %d\n", __func__, ubatch_pp.n_tokens, ubatch_pp.n_seqs);
-
-            auto * gf = graph_init();
-            graph_build(ctx_compute.get(), gf, ubatch_pp, LLM_GRAPH_TYPE_DEFAULT);
-
-            if (!ggml_backend_sched_reserve(sched.get(), gf)) {
-                throw std::runtime_error("failed to allocate compute pp buffers");
+            if (n_bucket == 1) {
+                n_splits_tg = ggml_backend_sched_get_n_splits(sched.get());
+                n_nodes_tg  = ggml_graph_n_nodes(gf);
+                break;
             }
+
+            n_bucket = llama_ubatch_bucket_prev(n_bucket);
         }
 
         n_outputs = n_outputs_save;
@@ -369,11 +355,13 @@ llama_context::llama_context(
         for (size_t i = 0; i < backend_ptrs.size(); ++i) {
             ggml_backend_t             backend = backend_ptrs[i];
             ggml_backend_buffer_type_t buft    = backend_buft[i];
-            size_t size = ggml_backend_sched_get_buffer_size(sched.get(), backend);
+            size_t size     = ggml_backend_sched_get_buffer_size(sched.get(), backend);
+            size_t min_size = ggml_backend_sched_get_buffer_min_size(sched.get(), backend);
             if (size > 1) {
-                LLAMA_LOG_INFO("%s: %10s compute buffer size = %8.2f MiB\n", __func__,
+                LLAMA_LOG_INFO("%s: %10s compute buffer size = %8.2f MiB (lower bound %8.2f MiB)\n", __func__,
                         ggml_backend_buft_name(buft),
-                        size / 1024.0 / 1024.0);
+                        size / 1024.0 / 1024.0,
+                        min_size / 1024.0 / 1024.0);
             }
         }
 
@@ -741,7 +729,7 @@ llm_graph_result_ptr llama_context::build_kv_self_defrag(
 void llama_context::kv_self_update() {
     auto & kv = kv_self;
 
-    bool need_reserve = false;
+    // the K-shift and defrag graphs get plans of their own in the allocator, the one of the decoder graph is kept
 
     if (kv->has_shift) {
         if (!kv->get_can_shift()) {
@@ -763,8 +751,6 @@ void llama_context::kv_self_update() {
             res->set_inputs(nullptr);
 
             graph_compute(gf, false);
-
-            need_reserve = true;
         }
 
         {
@@ -792,36 +778,10 @@ void llama_context::kv_self_update() {
             res->set_inputs(nullptr);
 
             graph_compute(gf, false);
-
-            need_reserve = true;
         }
 
         kv->do_defrag = false;
     }
-
-    // reserve a worst case graph if needed
-    if (need_reserve) {
-        LLAMA_LOG_DEBUG("%s: reserving a worst case graph\n", __func__);
-
-        // build worst-case graph
-        uint32_t n_seqs = 1; // TODO: worst-case number of sequences
-        uint32_t n_tokens = std::min(cparams.n_ctx, cparams.n_ubatch);
-
-        // simulate full KV cache
-        kv_self->n = kv_self->size;
-
-        llama_token token = model.vocab.token_bos(); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
-        llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
-
-        auto * gf = graph_init();
-        graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DEFAULT);
-
-        // initialize scheduler with the worst-case graph
-        ggml_backend_sched_reset(sched.get());
-        if (!ggml_backend_sched_reserve(sched.get(), gf)) {
-            LLAMA_LOG_ERROR("%s: failed to allocate compute buffers\n", __func__);
-        }
-    }
 }
 
 enum llama_pooling_type llama_context::pooling_type() const {
@@ -969,18 +929,24 @@ void llama_context::set_embeddings(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.embeddings = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_causal_attn(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.causal_attn = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_warmup(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.warmup = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_adapter_lora(
@@ -989,6 +955,8 @@ void llama_context::set_adapter_lora(
     LLAMA_LOG_DEBUG("%s: adapter = %p, scale = %f\n", __func__, (void *) adapter, scale);
 
     loras[adapter] = scale;
+
+    graph_reuse_reset();
 }
 
 bool llama_context::rm_adapter_lora(
@@ -998,6 +966,7 @@ bool llama_context::rm_adapter_lora(
     auto pos = loras.find(adapter);
     if (pos != loras.end()) {
         loras.erase(pos);
+        graph_reuse_reset();
         return true;
     }
 
@@ -1008,6 +977,105 @@ void llama_context::clear_adapter_lora() {
     LLAMA_LOG_DEBUG("%s: call\n", __func__);
 
     loras.clear();
+
+    graph_reuse_reset();
+}
+
+void llama_context::set_adapter_lora_seq(
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d, adapter = %p, scale = %f\n", __func__, seq_id, (void *) adapter, scale);
+
+    if (adapter) {
+        loras_seq[seq_id] = { adapter, scale };
+    } else {
+        loras_seq.erase(seq_id);
+    }
+
+    graph_reuse_reset();
+}
+
+bool llama_context::set_output_tokens(
+            llama_seq_id seq_id,
+            const llama_token * tokens,
+            int32_t n_tokens) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d, n_tokens = %d\n", __func__, seq_id, n_tokens);
+
+    if (n_tokens <= 0) {
+        output_tokens.erase(seq_id);
+        return true;
+    }
+
+    // a set as large as the vocab would not be told apart from the full logits
+    if ((uint32_t) n_tokens >= model.vocab.n_tokens()) {
+        LLAMA_LOG_ERROR("%s: %d candidate tokens, the vocab has %u\n", __func__, n_tokens, model.vocab.n_tokens());
+        return false;
+    }
+
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || (uint32_t) tokens[i] >= model.vocab.n_tokens()) {
+            LLAMA_LOG_ERROR("%s: invalid token[%d] = %d\n", __func__, i, tokens[i]);
+            return false;
+        }
+    }
+
+    // the graph reuse key covers the number of candidates, the tokens themselves are graph inputs
+    output_tokens[seq_id].assign(tokens, tokens + n_tokens);
+
+    return true;
+}
+
+bool llama_context::set_draft_layers(int32_t n_layer) {
+    LLAMA_LOG_DEBUG("%s: n_layer = %d\n", __func__, n_layer);
+
+    if (n_layer < 0 || n_layer >= (int32_t) model.hparams.n_layer) {
+        LLAMA_LOG_ERROR("%s: invalid number of draft layers %d, the model has %u\n", __func__, n_layer, model.hparams.n_layer);
+        return false;
+    }
+
+    // the architectures built by llm_build_llama
+    switch (model.arch) {
+        case LLM_ARCH_LLAMA:
+        case LLM_ARCH_LLAMA4:
+        case LLM_ARCH_MINICPM:
+        case LLM_ARCH_GRANITE:
+        case LLM_ARCH_GRANITE_MOE:
+            break;
+        default:
+            if (n_layer > 0) {
+                LLAMA_LOG_ERROR("%s: self-speculative decoding is not supported for %s\n", __func__, llm_arch_name(model.arch));
+                return false;
+            }
+    }
+
+    n_layer_draft = n_layer;
+
+    return true;
+}
+
+uint32_t llama_context::draft_resume(const llama_batch & batch) {
+    uint32_t n = 0;
+
+    // a run that does not cover all the drafts leaves cells without their last layers before it
+    if (drafts.pos_min == drafts.pos0 && batch.token) {
+        const auto & cells = kv_self->cells;
+
+        for (; n < drafts.tokens.size() && n < (uint32_t) batch.n_tokens; ++n) {
+            const uint32_t c = drafts.cells[n];
+
+            // the cells may have been moved or modified by the KV cache API since the draft
+            if (batch.n_seq_id[n] != 1 || batch.seq_id[n][0] != drafts.seq_id ||
+                batch.pos[n] != drafts.pos0 + (llama_pos) n || batch.token[n] != drafts.tokens[n] ||
+                c != drafts.cells[0] + n || cells[c].pos != batch.pos[n] || !cells[c].has_seq_id(drafts.seq_id)) {
+                break;
+            }
+        }
+    }
+
+    kv_self->seq_rm(drafts.seq_id, n > 0 ? drafts.pos0 + (llama_pos) n : drafts.pos_min, -1);
+
+    return n;
 }
 
 bool llama_context::apply_adapter_cvec(
@@ -1018,6 +1086,8 @@ bool llama_context::apply_adapter_cvec(
                 int32_t   il_end) {
     LLAMA_LOG_DEBUG("%s: il_start = %d, il_end = %d\n", __func__, il_start, il_end);
 
+    graph_reuse_reset();
+
     return cvec.apply(model, data, len, n_embd, il_start, il_end);
 }
 
@@ -1027,11 +1097,9 @@ int llama_context::encode(llama_batch & inp_batch) {
         return -1;
     }
 
-    // temporary allocate memory for the input batch if needed
+    // fill in the fields missing from the input batch, with memory reused across the calls
     // TODO: this is incorrect for multiple sequences because pos_max() is the maximum across all sequences
-    llama_batch_allocr batch_allocr(inp_batch, inp_batch.pos ? -1 : kv_self->pos_max() + 1);
-
-    const llama_batch & batch = batch_allocr.batch;
+    const llama_batch & batch = batch_allocr.init(inp_batch, inp_batch.pos ? -1 : kv_self->pos_max() + 1);
     const int32_t n_tokens = batch.n_tokens;
 
     const auto & hparams = model.hparams;
@@ -1077,7 +1145,7 @@ int llama_context::encode(llama_batch & inp_batch) {
     //batch_manager->prepare(ubatch);
 
     ggml_backend_sched_reset(sched.get());
-    ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+    sched_set_eval_cb();
 
     const auto causal_attn_org = cparams.causal_attn;
 
@@ -1087,7 +1155,7 @@ int llama_context::encode(llama_batch & inp_batch) {
     cparams.causal_attn = false;
 
     auto * gf = graph_init();
-    auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_ENCODER);
+    auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_ENCODER, 0, model.hparams.n_layer);
 
     ggml_backend_sched_alloc_graph(sched.get(), gf);
 
@@ -1192,11 +1260,16 @@ int llama_context::decode(llama_batch & inp_batch) {
         return -1;
     }
 
-    // temporary allocate memory for the input batch if needed
-    // TODO: this is incorrect for multiple sequences because pos_max() is the maximum across all sequences
-    llama_batch_allocr batch_allocr(inp_batch, inp_batch.pos ? -1 : kv_self->pos_max() + 1);
+    // the pending drafts are removed by the full decode (see draft_resume), the missing positions continue from the
+    // first of them rather than after them
+    llama_pos pos0 = -1;
+    if (!inp_batch.pos) {
+        pos0 = n_layer_draft == 0 && drafts.pos_min >= 0 ? drafts.pos_min : kv_self->pos_max() + 1;
+    }
 
-    const llama_batch & batch = batch_allocr.batch;
+    // fill in the fields missing from the input batch, with memory reused across the calls
+    // TODO: this is incorrect for multiple sequences because pos_max() is the maximum across all sequences
+    const llama_batch & batch = batch_allocr.init(inp_batch, pos0);
 
     const auto & vocab   = model.vocab;
     const auto & hparams = model.hparams;
@@ -1219,6 +1292,18 @@ int llama_context::decode(llama_batch & inp_batch) {
         }
     }
 
+    // the drafts are kept for a single sequence
+    if (n_layer_draft > 0) {
+        const llama_seq_id seq_id = drafts.seq_id >= 0 ? drafts.seq_id : batch.seq_id[0][0];
+
+        for (int64_t i = 0; i < n_tokens_all; ++i) {
+            if (!batch.token || batch.n_seq_id[i] != 1 || batch.seq_id[i][0] != seq_id) {
+                LLAMA_LOG_ERROR("%s: the drafted tokens must be tokens of sequence %d only\n", __func__, seq_id);
+                return -1;
+            }
+        }
+    }
+
     GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -1262,14 +1347,30 @@ int llama_context::decode(llama_batch & inp_batch) {
     // handle any pending defrags/shifts
     kv_self_update();
 
+    // the full decode of drafted tokens starts from the exit layer of the drafts
+    const uint32_t n_resume = n_layer_draft == 0 && drafts.pos_min >= 0 ? draft_resume(batch) : 0;
+
     int64_t n_outputs_prev = 0;
+    int64_t n_logits_max   = 0;
 
     while (sbatch.n_tokens > 0) {
         llama_ubatch ubatch = llama_ubatch();
 
         const auto & n_ubatch = cparams.n_ubatch;
 
-        if (kv_self->recurrent) {
+        // index in the batch of the first token of the ubatch
+        const uint32_t i_first = n_tokens_all - sbatch.n_tokens;
+
+        const bool resume = i_first < n_resume;
+
+        if (resume) {
+            // the resumed tokens are a prefix of the batch and get ubatches of their own
+            ubatch = sbatch.split_simple(std::min<uint32_t>(n_ubatch, n_resume - i_first));
+
+            // their hidden states replace the token embeddings
+            ubatch.token = nullptr;
+            ubatch.embd  = drafts.hidden.data() + i_first*n_embd;
+        } else if (kv_self->recurrent) {
             if (embd_pooled) {
                 // Pooled embeddings cannot be split across ubatches (yet)
                 ubatch = sbatch.split_seq(cparams.n_ubatch);
@@ -1301,7 +1402,10 @@ int llama_context::decode(llama_batch & inp_batch) {
 
         // find KV slot
         {
-            if (!kv_self->find_slot(ubatch)) {
+            if (resume) {
+                // the tokens are in the KV cells of their drafts, the first layers of the cells are reused as-is
+                kv_self->head = drafts.cells[i_first];
+            } else if (!kv_self->find_slot(ubatch)) {
                 LLAMA_LOG_WARN("%s: failed to find KV cache slot for ubatch of size %d\n", __func__, ubatch.n_tokens);
 
                 return 1;
@@ -1318,15 +1422,57 @@ int llama_context::decode(llama_batch & inp_batch) {
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self->n, kv_self->used, kv_self->head);
 
-        ggml_backend_sched_reset(sched.get());
-        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+        graph_reuse_key key;
+        key.n_tokens     = ubatch.n_tokens;
+        key.n_seq_tokens = ubatch.n_seq_tokens;
+        key.n_seqs       = ubatch.n_seqs;
+        key.equal_seqs   = ubatch.equal_seqs;
+        key.has_embd     = ubatch.embd != nullptr;
+        key.n_outputs    = n_outputs;
+        key.n_kv         = kv_self->n;
+        key.il_start     = resume ? drafts.n_layer : 0;
+        key.il_end       = n_layer_draft > 0 ? n_layer_draft : (int32_t) hparams.n_layer;
+
+        lora_groups.init(loras_seq, ubatch, n_outputs);
+
+        // the per-sequence adapters of the outputs are applied to the full output weight
+        output_select.init(output_tokens, ubatch, n_outputs, lora_groups.out.groups.empty());
+
+        key.n_sel_rows = output_select.rows.size();
+        key.n_sel_cols = output_select.n_cols;
+
+        ggml_cgraph * gf = nullptr;
+
+        if (gf_reuse && key == gf_reuse_key && lora_groups.same_layout(gf_reuse_key.lora_groups)) {
+            // same topology as the previous ubatch - skip the graph build and the allocation
+            gf = gf_reuse;
+            gf_reuse_res->set_kv_head(kv_self->head);
+            n_reused++;
+        } else {
+            ggml_backend_sched_reset(sched.get());
+            sched_set_eval_cb();
 
-        auto * gf = graph_init();
-        auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
+            gf = graph_init();
+            auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER, key.il_start, key.il_end);
 
-        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+            // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+
+            if (!ggml_backend_sched_alloc_graph(sched.get(), gf)) {
+                LLAMA_LOG_ERROR("%s: failed to allocate the compute graph\n", __func__);
+                return -2;
+            }
 
-        ggml_backend_sched_alloc_graph(sched.get(), gf);
+            gf_reuse_res = std::move(res);
+
+            // recurrent models address their state through the KV head in ways that are not patched by set_kv_head()
+            if (graph_reuse && !kv_self->recurrent) {
+                gf_reuse     = gf;
+                gf_reuse_key = key;
+                gf_reuse_key.lora_groups = lora_groups;
+            }
+        }
+
+        auto & res = gf_reuse_res;
 
         res->set_inputs(&ubatch);
 
@@ -1348,6 +1494,40 @@ int llama_context::decode(llama_batch & inp_batch) {
         //    ggml_graph_dump_dot(gf, NULL, "llama.dot");
         //}
 
+        // keep the hidden states of the drafted tokens at the exit layer
+        if (n_layer_draft > 0) {
+            bool consecutive = true;
+            for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+                consecutive = consecutive && ubatch.pos[i] == ubatch.pos[0] + (llama_pos) i;
+
+                drafts.pos_min = drafts.pos_min < 0 ? ubatch.pos[i] : std::min(drafts.pos_min, ubatch.pos[i]);
+            }
+
+            drafts.seq_id = ubatch.seq_id[0][0];
+
+            if (drafts.n_layer != n_layer_draft || ubatch.pos[0] != drafts.pos0 + (llama_pos) drafts.tokens.size()) {
+                // not a continuation of the kept run - the KV cells of the earlier drafts are still removed from pos_min
+                drafts.clear_run();
+                drafts.n_layer = n_layer_draft;
+                drafts.pos0    = ubatch.pos[0];
+            }
+
+            if (consecutive) {
+                const size_t n_prev = drafts.tokens.size();
+
+                drafts.tokens.insert(drafts.tokens.end(), ubatch.token, ubatch.token + ubatch.n_tokens);
+                for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+                    drafts.cells.push_back(kv_self->head + i);
+                }
+
+                drafts.hidden.resize((n_prev + ubatch.n_tokens)*n_embd);
+                ggml_backend_tensor_get(res->get_hidden(), drafts.hidden.data() + n_prev*n_embd, 0, ubatch.n_tokens*n_embd*sizeof(float));
+            } else {
+                drafts.clear_run();
+                drafts.pos0 = -1;
+            }
+        }
+
         auto * t_logits = cparams.embeddings ? nullptr         : res->get_logits();
         auto * t_embd   = cparams.embeddings ? res->get_embd() : nullptr;
 
@@ -1363,11 +1543,29 @@ int llama_context::decode(llama_batch & inp_batch) {
 
             float * logits_out = logits + n_outputs_prev*n_vocab;
 
+            // the logits of the candidate tokens only, the rows of the outputs start with them
+            const int64_t n_logits = t_logits->ne[0];
+
             if (n_outputs) {
                 GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
                 GGML_ASSERT((n_outputs_prev + n_outputs)*n_vocab <= (int64_t) logits_size);
-                ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
+                if (n_logits == n_vocab) {
+                    ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
+                } else {
+                    GGML_ASSERT(n_logits == output_select.n_cols);
+                    for (int32_t i = 0; i < n_outputs; ++i) {
+                        ggml_backend_tensor_get_async(backend_res, t_logits, logits_out + i*n_vocab, i*n_logits*sizeof(float), n_logits*sizeof(float));
+                    }
+                }
+            }
+
+            // the graph computed the full vocab, the candidates are picked from it
+            if (n_logits == n_vocab && output_select.has_sets) {
+                ggml_backend_sched_synchronize(sched.get());
+                output_select.compact(logits_out, n_vocab);
             }
+
+            n_logits_max = std::max(n_logits_max, n_logits);
         }
 
         // extract embeddings
@@ -1431,6 +1629,11 @@ int llama_context::decode(llama_batch & inp_batch) {
     // finalize the batch processing
     kv_guard.commit();
 
+    // the KV cells of the drafts are complete now
+    if (n_layer_draft == 0) {
+        drafts.clear();
+    }
+
     // set output mappings
     {
         bool sorted_output = true;
@@ -1453,6 +1656,10 @@ int llama_context::decode(llama_batch & inp_batch) {
     // set to total number of outputs in the batch, for use in llama_get_logits_ith
     n_outputs = n_outputs_all;
 
+    if (n_logits_max > 0) {
+        n_logits_row = n_logits_max;
+    }
+
     // wait for the computation to finish (automatically done when obtaining the model output)
     //synchronize();
 
@@ -1472,7 +1679,10 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(sched.get());
+    // when the graph is kept for reuse, the scheduler state has to stay as it is
+    if (!gf_reuse) {
+        ggml_backend_sched_reset(sched.get());
+    }
 
     return 0;
 }
@@ -1504,6 +1714,8 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
     logits_size = has_logits ? n_vocab*n_outputs_max : 0;
     embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
 
+    n_logits_row = n_vocab;
+
     if (output_ids.empty()) {
         // init, never resized afterwards
         output_ids.resize(n_batch);
@@ -1575,7 +1787,8 @@ void llama_context::output_reorder() {
             if (j_min == i) { continue; }
             std::swap(out_ids[i], out_ids[j_min]);
             if (logits_size > 0) {
-                for (uint32_t k = 0; k < n_vocab; k++) {
+                // only the start of the rows is used with candidate tokens
+                for (int64_t k = 0; k < n_logits_row; k++) {
                     std::swap(logits[i*n_vocab + k], logits[j_min*n_vocab + k]);
                 }
             }
@@ -1602,6 +1815,9 @@ int32_t llama_context::graph_max_nodes() const {
 }
 
 ggml_cgraph * llama_context::graph_init() {
+    // the meta data of the kept graph lives in ctx_compute
+    graph_reuse_reset();
+
     ggml_init_params params = {
         /*.mem_size   =*/ buf_compute_meta.size(),
         /*.mem_buffer =*/ buf_compute_meta.data(),
@@ -1613,11 +1829,33 @@ ggml_cgraph * llama_context::graph_init() {
     return ggml_new_graph_custom(ctx_compute.get(), graph_max_nodes(), false);
 }
 
+ggml_cgraph * llama_context::graph_reserve(uint32_t n_tokens, uint32_t n_seqs, uint32_t n_outputs) {
+    llama_token token = model.vocab.token_bos(); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
+
+    llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
+
+    this->n_outputs = n_outputs;
+
+    auto * gf = graph_init();
+    graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DEFAULT, 0, model.hparams.n_layer);
+
+    if (!ggml_backend_sched_reserve(sched.get(), gf)) {
+        return nullptr;
+    }
+
+    return gf;
+}
+
 llm_graph_result_ptr llama_context::graph_build(
             ggml_context * ctx,
              ggml_cgraph * gf,
       const llama_ubatch & ubatch,
-            llm_graph_type gtype) {
+            llm_graph_type gtype,
+                   int32_t il_start,
+                   int32_t il_end) {
+    lora_groups.init(loras_seq, ubatch, n_outputs);
+    output_select.init(output_tokens, ubatch, n_outputs, lora_groups.out.groups.empty());
+
     return model.build_graph(
             {
                 /*.ctx         =*/ ctx,
@@ -1631,7 +1869,13 @@ llm_graph_result_ptr llama_context::graph_build(
                 /*.loras       =*/ &loras,
                 /*.memory      =*/ kv_self.get(),
                 /*.cross       =*/ &cross,
+                /*.lora_groups =*/ loras_seq.empty() ? nullptr : &lora_groups,
+                /*.out_select  =*/ output_select.empty() ? nullptr : &output_select,
+                /*.tensor_ids  =*/ &model.tensor_ids,
+                /*.tp          =*/ model.tp.get(),
                 /*.n_outputs   =*/ n_outputs,
+                /*.il_start    =*/ il_start,
+                /*.il_end      =*/ il_end,
                 /*.cb          =*/ graph_get_cb(),
             }, gf, gtype);
 }
@@ -1658,11 +1902,25 @@ ggml_status llama_context::graph_compute(
         LLAMA_LOG_ERROR("%s: ggml_backend_sched_graph_compute_async failed with error %d\n", __func__, status);
     }
 
+    // an all-reduce that timed out leaves the rest of the graph computed on partial sums
+    if (status == GGML_STATUS_SUCCESS && model.tp) {
+        ggml_backend_sched_synchronize(sched.get());
+        if (model.tp->is_broken()) {
+            LLAMA_LOG_ERROR("%s: the tensor parallel group is broken\n", __func__);
+            status = GGML_STATUS_FAILED;
+        }
+    }
+
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(sched));
 
     return status;
 }
 
+void llama_context::graph_reuse_reset() {
+    gf_reuse = nullptr;
+    gf_reuse_res.reset();
+}
+
 llm_graph_cb llama_context::graph_get_cb() const {
     return [&](const llama_ubatch & ubatch, ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
@@ -1696,6 +1954,54 @@ llm_graph_cb llama_context::graph_get_cb() const {
     };
 }
 
+void llama_context::sched_set_eval_cb() {
+    if (model.stream) {
+        ggml_backend_sched_set_eval_callback(sched.get(), graph_eval_cb, this);
+    } else {
+        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+    }
+}
+
+// layer of a graph node from the name given by graph_get_cb ("name-il"), -1 for the nodes outside the layers
+static int llama_node_layer(const ggml_tensor * t) {
+    const char * sep = strrchr(t->name, '-');
+    if (sep == nullptr || sep[1] == '\0') {
+        return -1;
+    }
+    int il = 0;
+    for (const char * p = sep + 1; *p; ++p) {
+        if (*p < '0' || *p > '9') {
+            return -1;
+        }
+        il = 10*il + (*p - '0');
+    }
+    return il;
+}
+
+bool llama_context::graph_eval_cb(ggml_tensor * t, bool ask, void * user_data) {
+    auto * lctx = (llama_context *) user_data;
+    const auto & cparams = lctx->cparams;
+
+    if (ask) {
+        // the scheduler computes the graph up to the nodes that are asked for, the first node of each layer
+        // is a point where the previous layer is done with its weights
+        const int il = llama_node_layer(t);
+
+        lctx->stream_node = il >= 0 && il < (int) lctx->model.hparams.n_layer && il != lctx->stream_il ? t : nullptr;
+        lctx->user_asked  = cparams.cb_eval && cparams.cb_eval(t, true, cparams.cb_eval_user_data);
+
+        return lctx->stream_node || lctx->user_asked;
+    }
+
+    if (t == lctx->stream_node) {
+        lctx->stream_il   = llama_node_layer(t);
+        lctx->stream_node = nullptr;
+        lctx->model.stream->begin_layer(lctx->stream_il);
+    }
+
+    return lctx->user_asked ? cparams.cb_eval(t, false, cparams.cb_eval_user_data) : true;
+}
+
 //
 // state save/load
 //
@@ -2206,6 +2512,7 @@ llama_perf_context_data llama_context::perf_get_data() const {
     data.t_eval_ms   = 1e-3 * t_eval_us;
     data.n_p_eval    = std::max(1, n_p_eval);
     data.n_eval      = std::max(1, n_eval);
+    data.n_reused    = std::max(0, n_reused);
 
     return data;
 }
@@ -2214,6 +2521,7 @@ void llama_context::perf_reset() {
     t_start_us  = ggml_time_us();
     t_eval_us   = n_eval = 0;
     t_p_eval_us = n_p_eval = 0;
+    n_reused    = 0;
 }
 
 //
@@ -2437,6 +2745,38 @@ void llama_clear_adapter_lora(llama_context * ctx) {
     ctx->clear_adapter_lora();
 }
 
+int32_t llama_set_adapter_lora_seq(
+            llama_context * ctx,
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale) {
+    if (seq_id < 0) {
+        return -1;
+    }
+
+    ctx->set_adapter_lora_seq(seq_id, adapter, scale);
+
+    return 0;
+}
+
+int32_t llama_set_output_tokens(
+            llama_context * ctx,
+            llama_seq_id seq_id,
+            const llama_token * tokens,
+            int32_t n_tokens) {
+    if (seq_id < 0) {
+        return -1;
+    }
+
+    return ctx->set_output_tokens(seq_id, tokens, n_tokens) ? 0 : -1;
+}
+
+int32_t llama_set_draft_layers(
+            llama_context * ctx,
+            int32_t n_layer) {
+    return ctx->set_draft_layers(n_layer) ? 0 : -1;
+}
+
 int32_t llama_apply_adapter_cvec(
         llama_context * ctx,
                  const float * data,
@@ -2833,6 +3173,7 @@ void llama_perf_context_print(const llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
+    LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
 }
 
 void llama_perf_context_reset(llama_context * ctx) {
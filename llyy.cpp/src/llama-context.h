@@ -75,6 +75,21 @@ struct llama_context {
 
     void clear_adapter_lora();
 
+    // select the adapter of a single sequence, on top of the context-wide adapters (null adapter clears)
+    void set_adapter_lora_seq(
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale);
+
+    // restrict the logits of the outputs of a sequence to a set of candidate tokens (empty set clears)
+    bool set_output_tokens(
+            llama_seq_id seq_id,
+            const llama_token * tokens,
+            int32_t n_tokens);
+
+    // run the next decodes with the first n_layer layers only (0 runs the full model), see llama_set_draft_layers
+    bool set_draft_layers(int32_t n_layer);
+
     bool apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -150,11 +165,17 @@ private:
     // zero-out inputs and create the ctx_compute for the compute graph
     ggml_cgraph * graph_init();
 
+    // build the graph of a ubatch of the given shape and reserve the compute buffers for it, nullptr on failure
+    ggml_cgraph * graph_reserve(uint32_t n_tokens, uint32_t n_seqs, uint32_t n_outputs);
+
+    // computes the layers [il_start, il_end) of the model
     llm_graph_result_ptr graph_build(
             ggml_context * ctx,
              ggml_cgraph * gf,
       const llama_ubatch & ubatch,
-          llm_graph_type   gtype);
+          llm_graph_type   gtype,
+                 int32_t   il_start,
+                 int32_t   il_end);
 
     // returns the result of ggml_backend_sched_graph_compute_async execution
     ggml_status graph_compute(
@@ -163,6 +184,18 @@ private:
 
     llm_graph_cb graph_get_cb() const;
 
+    // install the eval callback of the scheduler: the user one, or the one of the layer streaming that forwards to it
+    void sched_set_eval_cb();
+
+    static bool graph_eval_cb(ggml_tensor * t, bool ask, void * user_data);
+
+    // drop the graph kept for reuse - must be called whenever the graph or the scheduler state changes
+    void graph_reuse_reset();
+
+    // number of leading tokens of the batch that resume from the hidden states of their drafts
+    // the KV cells of the other drafted tokens are removed, only their first layers were computed
+    uint32_t draft_resume(const llama_batch & batch);
+
     // used by kv_self_update()
     ggml_tensor * build_rope_shift(
         ggml_context * ctx0,
@@ -197,10 +230,48 @@ private:
     llama_cparams       cparams;
     llama_adapter_cvec  cvec;
     llama_adapter_loras loras;
-    llama_sbatch        sbatch;
+    llama_sbatch        sbatch;       // batch splitting, its buffers are reused by the next batches
+    llama_batch_allocr  batch_allocr; // the fields missing from the input batch
+
+    llama_adapter_loras_seq   loras_seq;   // per-sequence adapters
+    llama_adapter_lora_groups lora_groups; // tokens of the current ubatch grouped by adapter
+
+    llama_output_tokens_seq output_tokens; // per-sequence candidate tokens of the logits
+    llama_output_select     output_select; // candidate tokens of the outputs of the current ubatch
 
     llama_cross cross; // TODO: tmp for handling cross-attention - need something better probably
 
+    // self-speculative decoding: the drafts run the first n_layer_draft layers of the model, their hidden states at the
+    // exit layer are kept so that the full decode of the same tokens resumes from there, on the KV cells of the drafts
+    int32_t n_layer_draft = 0;
+
+    struct draft_tokens {
+        llama_seq_id seq_id  = -1;
+        llama_pos    pos_min = -1; // first position drafted since the last full decode, -1 if none
+
+        // the last run of consecutive drafted tokens, from pos0
+        int32_t   n_layer = 0; // exit layer of the run
+        llama_pos pos0    = 0;
+
+        std::vector<llama_token> tokens;
+        std::vector<uint32_t>    cells;  // KV cell of each token
+        std::vector<float>       hidden; // [n_tokens][n_embd] hidden states at the exit layer
+
+        void clear_run() {
+            tokens.clear();
+            cells.clear();
+            hidden.clear();
+        }
+
+        void clear() {
+            seq_id  = -1;
+            pos_min = -1;
+            clear_run();
+        }
+    };
+
+    draft_tokens drafts;
+
     std::unique_ptr<llama_kv_cache_unified> kv_self;
 
     // TODO: remove
@@ -210,6 +281,9 @@ private:
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // logits written at the start of each row by the last decode, less than n_vocab if all its outputs had candidates
+    int64_t n_logits_row = 0;
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -231,12 +305,57 @@ private:
 
     ggml_context_ptr ctx_compute;
 
+    // graph reuse: the last decoder graph stays allocated in the scheduler and is recomputed as-is
+    // by the next ubatch with the same shape, after patching its inputs and KV store offsets
+    struct graph_reuse_key {
+        uint32_t n_tokens     = 0;
+        uint32_t n_seq_tokens = 0;
+        uint32_t n_seqs       = 0;
+        bool     equal_seqs   = false;
+        bool     has_embd     = false;
+        int32_t  n_outputs    = 0;
+        uint32_t n_kv         = 0; // KV size bucket (kv_self->n is padded to get_padding())
+        size_t   n_sel_rows   = 0; // candidate tokens of the outputs (output_select)
+        int32_t  n_sel_cols   = 0;
+        int32_t  il_start     = 0; // layers computed, a subset for self-speculative decoding
+        int32_t  il_end       = 0;
+
+        // per-sequence adapter groups of the ubatch, compared separately with the groups of the context so that
+        // building the key of each ubatch does not copy them
+        llama_adapter_lora_groups lora_groups;
+
+        bool operator==(const graph_reuse_key & other) const {
+            return n_tokens     == other.n_tokens     &&
+                   n_seq_tokens == other.n_seq_tokens &&
+                   n_seqs       == other.n_seqs       &&
+                   equal_seqs   == other.equal_seqs   &&
+                   has_embd     == other.has_embd     &&
+                   n_outputs    == other.n_outputs    &&
+                   n_kv         == other.n_kv         &&
+                   n_sel_rows   == other.n_sel_rows   &&
+                   n_sel_cols   == other.n_sel_cols   &&
+                   il_start     == other.il_start     &&
+                   il_end       == other.il_end;
+        }
+    };
+
+    bool graph_reuse = true;
+
+    graph_reuse_key      gf_reuse_key;
+    ggml_cgraph *        gf_reuse     = nullptr;
+    llm_graph_result_ptr gf_reuse_res;
+
     ggml_threadpool_t threadpool       = nullptr;
     ggml_threadpool_t threadpool_batch = nullptr;
 
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
+    // layer streaming: the last layer the computation started, and the nodes the eval callback asked for
+    int32_t       stream_il   = -1;
+    ggml_tensor * stream_node = nullptr;
+    bool          user_asked  = false;
+
     std::vector<std::pair<ggml_backend_t, ggml_backend_set_n_threads_t>> set_n_threads_fns;
 
     // buffer types used for the compute buffer of each backend
@@ -262,4 +381,5 @@ private:
 
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
+    mutable int32_t n_reused = 0; // number of ubatches that reused the previous graph
 };
@@ -4,7 +4,9 @@
 #include "llama-batch.h"
 #include "llama-cparams.h"
 #include "llama-kv-cache.h"
+#include "llama-tp.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
@@ -546,6 +548,181 @@ void llm_graph_input_attn_cross::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+void llm_graph_input_lora_seq::set_input(const llama_ubatch * ubatch) {
+    GGML_UNUSED(ubatch);
+
+    auto set_split = [this](const split_tensors & st, const llama_adapter_lora_split & sp) {
+        for (size_t g = 0; g < st.ids.size(); ++g) {
+            if (st.ids[g] && st.ids[g]->buffer) {
+                GGML_ASSERT((size_t) ggml_nelements(st.ids[g]) == sp.ids[g].size());
+                ggml_backend_tensor_set(st.ids[g], sp.ids[g].data(), 0, ggml_nbytes(st.ids[g]));
+            }
+        }
+        for (const auto & [has, rows] : st.rows) {
+            if (!rows->buffer) {
+                continue;
+            }
+            GGML_ASSERT((size_t) ggml_nelements(rows) == sp.rows.size());
+
+            // only the groups whose adapter has the weight are stacked, the other tokens use the zero row after them
+            int32_t n_rows = 0;
+            for (size_t g = 0; g < sp.groups.size(); ++g) {
+                n_rows += has[g] ? (int32_t) sp.ids[g].size() : 0;
+            }
+            rows_tmp.assign(sp.rows.size(), n_rows);
+            int32_t row = 0;
+            for (size_t g = 0; g < sp.groups.size(); ++g) {
+                if (!has[g]) {
+                    continue;
+                }
+                for (int32_t i : sp.ids[g]) {
+                    rows_tmp[i] = row++;
+                }
+            }
+            ggml_backend_tensor_set(rows, rows_tmp.data(), 0, ggml_nbytes(rows));
+        }
+    };
+
+    set_split(all, groups->all);
+    set_split(out, groups->out);
+}
+
+//
+// llama_output_select
+//
+
+void llama_output_select::init(const llama_output_tokens_seq & tokens_seq, const llama_ubatch & ubatch, int32_t n_outputs, bool enable) {
+    const int64_t n_tokens     = ubatch.n_tokens;
+    const int64_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    sets.clear();
+    rows.clear();
+    ids.clear();
+    n_cols   = 0;
+    has_sets = false;
+
+    // worst-case graphs are built from ubatches without sequence ids
+    if (tokens_seq.empty() || !ubatch.n_seq_id || !ubatch.seq_id || n_seq_tokens == 0) {
+        return;
+    }
+
+    // candidate set of a token, from the first sequence it belongs to
+    auto set_of = [&](int64_t i) -> const std::vector<llama_token> * {
+        const int64_t s = i/n_seq_tokens;
+        if (ubatch.n_seq_id[s] < 1) {
+            return nullptr;
+        }
+
+        const auto it = tokens_seq.find(ubatch.seq_id[s][0]);
+
+        return it == tokens_seq.end() ? nullptr : &it->second;
+    };
+
+    // the output tokens, in the order used by llm_graph_input_out_ids
+    if (n_outputs == n_tokens) {
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            sets.push_back(set_of(i));
+        }
+    } else if (ubatch.output) {
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            if (ubatch.output[i]) {
+                sets.push_back(set_of(i));
+            }
+        }
+    } else if (n_outputs == 1) {
+        sets.push_back(set_of(n_tokens - 1));
+    }
+
+    bool all = !sets.empty();
+    for (const auto * set : sets) {
+        has_sets = has_sets || set != nullptr;
+        all      = all      && set != nullptr;
+    }
+
+    // outputs without candidates need the full vocab, the candidates of the others are then picked on the host
+    if (!enable || !all) {
+        return;
+    }
+
+    // the sets of a ubatch are few, a linear search is enough
+    auto first_row = [&](const std::vector<llama_token> * set) -> int32_t {
+        for (const auto & off : offs) {
+            if (off.first == set) {
+                return off.second;
+            }
+        }
+        return -1;
+    };
+
+    offs.clear();
+    for (const auto * set : sets) {
+        if (first_row(set) < 0) {
+            offs.emplace_back(set, (int32_t) rows.size());
+            rows.insert(rows.end(), set->begin(), set->end());
+            n_cols = std::max(n_cols, (int32_t) set->size());
+        }
+    }
+
+    // the outputs with a smaller set repeat its last candidate up to n_cols
+    const int32_t n_rows = rows.size();
+
+    ids.resize(sets.size()*n_cols);
+    for (size_t o = 0; o < sets.size(); ++o) {
+        const int32_t row = first_row(sets[o]);
+        const int32_t n   = sets[o]->size();
+
+        for (int32_t j = 0; j < n_cols; ++j) {
+            ids[o*n_cols + j] = o*n_rows + row + std::min(j, n - 1);
+        }
+    }
+}
+
+void llama_output_select::compact(float * logits, int64_t n_vocab) {
+    for (size_t o = 0; o < sets.size(); ++o) {
+        if (sets[o] == nullptr) {
+            continue;
+        }
+
+        float * row = logits + o*n_vocab;
+
+        tmp.resize(sets[o]->size());
+        for (size_t j = 0; j < tmp.size(); ++j) {
+            tmp[j] = row[(*sets[o])[j]];
+        }
+        std::copy(tmp.begin(), tmp.end(), row);
+    }
+}
+
+void llm_graph_input_out_select::set_input(const llama_ubatch * ubatch) {
+    GGML_UNUSED(ubatch);
+
+    if (rows && rows->buffer) {
+        GGML_ASSERT((size_t) ggml_nelements(rows) == select->rows.size());
+        ggml_backend_tensor_set(rows, select->rows.data(), 0, ggml_nbytes(rows));
+    }
+
+    if (ids && ids->buffer) {
+        GGML_ASSERT((size_t) ggml_nelements(ids) == select->ids.size());
+        ggml_backend_tensor_set(ids, select->ids.data(), 0, ggml_nbytes(ids));
+    }
+}
+
+//
+// llm_graph_result
+//
+
+void llm_graph_result::set_kv_head(uint32_t head) {
+    for (auto & st : kv_stores) {
+        GGML_ASSERT(st.view->view_src != nullptr);
+
+        st.view->view_offs = st.stride*head;
+
+        if (st.view->view_src->data) {
+            st.view->data = (char *) st.view->view_src->data + st.view->view_offs;
+        }
+    }
+}
+
 //
 // llm_graph_context
 //
@@ -579,6 +756,8 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     n_tokens         (ubatch.n_tokens),
     n_outputs        (params.n_outputs),
     n_ctx_orig       (cparams.n_ctx_orig_yarn),
+    il_start         (params.il_start),
+    il_end           (params.il_end),
     pooling_type     (cparams.pooling_type),
     rope_type        (hparams.rope_type),
     ctx0             (params.ctx),
@@ -588,10 +767,21 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     loras            (params.loras),
     memory           (params.memory),
     cross            (params.cross),
+    tensor_ids       (params.tensor_ids),
+    tp               (params.tp),
     cb_func          (params.cb),
     res              (std::make_unique<llm_graph_result>()) {
+    if (params.lora_groups && !params.lora_groups->empty()) {
+        inp_lora_seq = static_cast<llm_graph_input_lora_seq *>(
+                res->add_input(std::make_unique<llm_graph_input_lora_seq>(params.lora_groups)));
     }
 
+    if (params.out_select && !params.out_select->empty()) {
+        inp_out_select = static_cast<llm_graph_input_out_select *>(
+                res->add_input(std::make_unique<llm_graph_input_out_select>(params.out_select)));
+    }
+}
+
 int64_t llm_graph_context::n_pos_per_token() const {
     return arch == LLM_ARCH_QWEN2VL ? 4 : 1;
 }
@@ -608,13 +798,28 @@ ggml_tensor * llm_graph_context::build_cvec(
     return cvec->apply_to(ctx0, cur, il);
 }
 
+int32_t llm_graph_context::tensor_id(const ggml_tensor * w) const {
+    const auto it = tensor_ids->find(w);
+    if (it == tensor_ids->end()) {
+        return -1;
+    }
+
+    return it->second;
+}
+
 ggml_tensor * llm_graph_context::build_lora_mm(
           ggml_tensor * w,
           ggml_tensor * cur) const {
     ggml_tensor * res = ggml_mul_mat(ctx0, w, cur);
 
+    if (loras->empty() && !inp_lora_seq) {
+        return res;
+    }
+
+    const int32_t id = tensor_id(w);
+
     for (const auto & lora : *loras) {
-        llama_adapter_lora_weight * lw = lora.first->get_weight(w);
+        llama_adapter_lora_weight * lw = lora.first->get_weight(id);
         if (lw == nullptr) {
             continue;
         }
@@ -631,16 +836,162 @@ ggml_tensor * llm_graph_context::build_lora_mm(
         res = ggml_add(ctx0, res, ab_cur);
     }
 
+    if (inp_lora_seq) {
+        res = build_lora_seq(id, cur, res);
+    }
+
     return res;
 }
 
+ggml_tensor * llm_graph_context::build_lora_seq(
+              int32_t   id,
+          ggml_tensor * cur,
+          ggml_tensor * res) const {
+    const auto & groups = *inp_lora_seq->groups;
+
+    // the last layer only computes the output tokens
+    const bool is_out = cur->ne[1] != n_tokens;
+
+    const llama_adapter_lora_split & sp = is_out ? groups.out : groups.all;
+    llm_graph_input_lora_seq::split_tensors & st = is_out ? inp_lora_seq->out : inp_lora_seq->all;
+
+    GGML_ASSERT(ggml_nrows(cur) == cur->ne[1] && (size_t) cur->ne[1] == sp.rows.size());
+
+    std::vector<llama_adapter_lora_weight *> lws(sp.groups.size());
+    bool any = false;
+    for (size_t g = 0; g < sp.groups.size(); ++g) {
+        lws[g] = sp.groups[g].adapter->get_weight(id);
+        any = any || lws[g] != nullptr;
+    }
+    if (!any) {
+        return res;
+    }
+
+    auto lora_ab = [&](size_t g, ggml_tensor * x) {
+        llama_adapter_lora_weight * lw = lws[g];
+
+        ggml_tensor * ab_cur = ggml_mul_mat(ctx0, lw->b, ggml_mul_mat(ctx0, lw->a, x));
+
+        return ggml_scale(ctx0, ab_cur, lw->get_scale(sp.groups[g].adapter->alpha, sp.groups[g].scale));
+    };
+
+    if (sp.is_uniform()) {
+        return ggml_add(ctx0, res, lora_ab(0, cur));
+    }
+
+    if (st.ids.empty()) {
+        st.ids.resize(sp.groups.size(), nullptr);
+        for (size_t g = 0; g < sp.groups.size(); ++g) {
+            st.ids[g] = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, sp.ids[g].size());
+            ggml_set_input(st.ids[g]);
+        }
+    }
+
+    std::vector<bool> has(sp.groups.size());
+    int32_t n_rows = 0;
+    for (size_t g = 0; g < sp.groups.size(); ++g) {
+        has[g] = lws[g] != nullptr;
+        n_rows += has[g] ? (int32_t) sp.ids[g].size() : 0;
+    }
+
+    ggml_tensor * rows = nullptr;
+    for (const auto & [has_rows, t] : st.rows) {
+        if (has_rows == has) {
+            rows = t;
+            break;
+        }
+    }
+    if (rows == nullptr) {
+        rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, sp.rows.size());
+        ggml_set_input(rows);
+        st.rows.emplace_back(has, rows);
+    }
+
+    // segmented gather-matmul: the products of each group whose adapter has the weight are computed on its own
+    // tokens only and stacked in group order, followed by a zero row for the other tokens
+    ggml_tensor * stacked = nullptr;
+    int32_t       row     = 0;
+    for (size_t g = 0; g < sp.groups.size(); ++g) {
+        if (!has[g]) {
+            continue;
+        }
+
+        ggml_tensor * ab_cur = lora_ab(g, ggml_get_rows(ctx0, cur, st.ids[g]));
+
+        if (stacked == nullptr) {
+            stacked = ggml_pad(ctx0, ab_cur, 0, n_rows + 1 - ab_cur->ne[1], 0, 0);
+        } else {
+            stacked = ggml_set_2d_inplace(ctx0, stacked, ab_cur, stacked->nb[1], row*stacked->nb[1]);
+        }
+        row += ab_cur->ne[1];
+    }
+
+    return ggml_add(ctx0, res, ggml_get_rows(ctx0, stacked, rows));
+}
+
+ggml_tensor * llm_graph_context::build_output(
+          ggml_tensor * w,
+          ggml_tensor * cur) const {
+    // the models that do not skip the unused outputs project all the tokens
+    if (!inp_out_select || cur->ne[1] != n_outputs) {
+        return build_lora_mm(w, cur);
+    }
+
+    const auto & select = *inp_out_select->select;
+
+    inp_out_select->rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, select.rows.size());
+    ggml_set_input(inp_out_select->rows);
+
+    ggml_tensor * rows = inp_out_select->rows;
+
+    // only the rows of the candidate tokens are multiplied, for large vocabs this is most of the work of a decode
+    ggml_tensor * res = ggml_mul_mat(ctx0, ggml_get_rows(ctx0, w, rows), cur);
+
+    const int32_t id = tensor_id(w);
+
+    for (const auto & lora : *loras) {
+        llama_adapter_lora_weight * lw = lora.first->get_weight(id);
+        if (lw == nullptr) {
+            continue;
+        }
+
+        // the rows of b are the tokens of the output
+        ggml_tensor * ab_cur = ggml_mul_mat(
+                ctx0, ggml_get_rows(ctx0, lw->b, rows),
+                ggml_mul_mat(ctx0, lw->a, cur)
+                );
+
+        ab_cur = ggml_scale(ctx0, ab_cur, lw->get_scale(lora.first->alpha, lora.second));
+        res = ggml_add(ctx0, res, ab_cur);
+    }
+
+    if (select.is_uniform()) {
+        return res;
+    }
+
+    inp_out_select->ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, select.ids.size());
+    ggml_set_input(inp_out_select->ids);
+
+    // pick the logits of the set of each output from the products with the stacked sets
+    res = ggml_reshape_2d(ctx0, res, 1, ggml_nelements(res));
+    res = ggml_get_rows(ctx0, res, inp_out_select->ids);
+
+    return ggml_reshape_2d(ctx0, res, select.n_cols, n_outputs);
+}
+
 ggml_tensor * llm_graph_context::build_lora_mm_id(
           ggml_tensor * w,   // ggml_tensor * as
           ggml_tensor * cur, // ggml_tensor * b
           ggml_tensor * ids) const {
     ggml_tensor * res = ggml_mul_mat_id(ctx0, w, cur, ids);
+    if (loras->empty()) {
+        return res;
+    }
+
+    const int32_t id = tensor_id(w);
+
     for (const auto & lora : *loras) {
-        llama_adapter_lora_weight * lw = lora.first->get_weight(w);
+        llama_adapter_lora_weight * lw = lora.first->get_weight(id);
         if (lw == nullptr) {
             continue;
         }
@@ -662,6 +1013,25 @@ ggml_tensor * llm_graph_context::build_lora_mm_id(
     return res;
 }
 
+static void llama_tp_all_reduce_op(ggml_tensor * dst, const ggml_tensor * a, int ith, int nth, void * userdata) {
+    GGML_ASSERT(ith == 0 && nth == 1);
+    GGML_ASSERT(dst->data == a->data);
+
+    ((llama_tp *) userdata)->all_reduce((float *) dst->data, ggml_nelements(dst));
+}
+
+ggml_tensor * llm_graph_context::build_tp_all_reduce(
+         ggml_tensor * cur) const {
+    if (!tp) {
+        return cur;
+    }
+
+    GGML_ASSERT(cur->type == GGML_TYPE_F32 && ggml_is_contiguous(cur));
+
+    // the transport is not thread-safe, a single thread of each rank does the exchange
+    return ggml_map_custom1_inplace(ctx0, cur, llama_tp_all_reduce_op, 1, tp);
+}
+
 ggml_tensor * llm_graph_context::build_norm(
          ggml_tensor * cur,
          ggml_tensor * mw,
@@ -803,6 +1173,7 @@ ggml_tensor * llm_graph_context::build_ffn(
 
     if (down) {
         cur = build_lora_mm(down, cur);
+        cur = build_tp_all_reduce(cur);
     }
 
     if (down_b) {
@@ -978,8 +1349,10 @@ ggml_tensor * llm_graph_context::build_inp_embd(ggml_tensor * tok_embd) const {
         cur = ggml_get_rows(ctx0, tok_embd, inp->tokens);
 
         // apply lora for embedding tokens if needed
+        const int32_t id = loras->empty() ? -1 : tensor_id(tok_embd);
+
         for (const auto & lora : *loras) {
-            llama_adapter_lora_weight * lw = lora.first->get_weight(tok_embd);
+            llama_adapter_lora_weight * lw = lora.first->get_weight(id);
             if (lw == nullptr) {
                 continue;
             }
@@ -1013,6 +1386,24 @@ ggml_tensor * llm_graph_context::build_inp_embd(ggml_tensor * tok_embd) const {
     return cur;
 }
 
+// hidden states of the tokens at the input of layer il_start, kept by the draft that computed the layers before it
+ggml_tensor * llm_graph_context::build_inp_hidden() const {
+    GGML_ASSERT(ubatch.embd && !ubatch.token);
+
+    auto inp = std::make_unique<llm_graph_input_embd>();
+
+    inp->embd = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, hparams.n_embd, ubatch.n_tokens);
+    ggml_set_input(inp->embd);
+
+    ggml_tensor * cur = inp->embd;
+
+    cb(cur, "inp_hidden", -1);
+
+    res->add_input(std::move(inp));
+
+    return cur;
+}
+
 ggml_tensor * llm_graph_context::build_inp_pos() const {
     auto inp = std::make_unique<llm_graph_input_pos>(n_pos_per_token());
 
@@ -1414,29 +1805,42 @@ ggml_tensor * llm_graph_context::build_attn(
 
         GGML_ASSERT(kv_self->size == n_ctx);
 
-        ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*kv_head);
+        const size_t k_stride = ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa);
+
+        ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], n_tokens*n_embd_k_gqa, k_stride*kv_head);
         //cb(k_cache_view, "k_cache_view", il);
 
         // note: storing RoPE-ed version of K in the KV cache
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_cur, k_cache_view));
+        ggml_tensor * k_store = ggml_cpy(ctx0, k_cur, k_cache_view);
+        ggml_build_forward_expand(gf, k_store);
+
+        // the cpy result is a view of the cache as well
+        res->add_kv_store(k_cache_view, k_stride);
+        res->add_kv_store(k_store,      k_stride);
 
         v_cur = ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
 
         ggml_tensor * v_cache_view = nullptr;
 
+        // note: the V cache is transposed when not using flash attention
+        const size_t v_stride = !v_trans ? ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa) : ggml_element_size(kv_self->v_l[il]);
+
         if (!v_trans) {
-            v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], n_tokens*n_embd_v_gqa, ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa)*kv_head);
+            v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], n_tokens*n_embd_v_gqa, v_stride*kv_head);
         } else {
-            // note: the V cache is transposed when not using flash attention
             v_cache_view = ggml_view_2d(ctx0, kv_self->v_l[il], n_tokens, n_embd_v_gqa,
                     (  n_ctx)*ggml_element_size(kv_self->v_l[il]),
-                    (kv_head)*ggml_element_size(kv_self->v_l[il]));
+                    (kv_head)*v_stride);
 
             v_cur = ggml_transpose(ctx0, v_cur);
         }
         //cb(v_cache_view, "v_cache_view", il);
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_cur, v_cache_view));
+        ggml_tensor * v_store = ggml_cpy(ctx0, v_cur, v_cache_view);
+        ggml_build_forward_expand(gf, v_store);
+
+        res->add_kv_store(v_cache_view, v_stride);
+        res->add_kv_store(v_store,      v_stride);
     }
 
     const bool is_swa = hparams.is_swa(il);
@@ -1478,6 +1882,7 @@ ggml_tensor * llm_graph_context::build_attn(
 
     if (wo) {
         cur = build_lora_mm(wo, cur);
+        cur = build_tp_all_reduce(cur);
     }
 
     if (wo_b) {
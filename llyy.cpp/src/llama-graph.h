@@ -6,6 +6,7 @@
 
 #include <cstdint>
 #include <vector>
+#include <map>
 #include <memory>
 #include <set>
 #include <functional>
@@ -16,6 +17,7 @@ struct ggml_tensor;
 
 struct llama_ubatch;
 struct llama_cparams;
+struct llama_tp;
 
 class llama_memory_i;
 class llama_kv_cache_unified;
@@ -285,6 +287,83 @@ public:
     const llama_cross * cross = nullptr;
 };
 
+// per-sequence LoRA adapters
+// the tensors are created on first use by build_lora_mm, a split that no LoRA matmul needs has no tensors
+class llm_graph_input_lora_seq : public llm_graph_input_i {
+public:
+    llm_graph_input_lora_seq(const llama_adapter_lora_groups * groups) : groups(groups) {}
+    virtual ~llm_graph_input_lora_seq() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    struct split_tensors {
+        std::vector<ggml_tensor *> ids; // I32 [n_group_tokens] per group
+
+        // I32 [n_tokens] row of each token in the stacked products, one per set of groups whose adapter has the weight
+        std::vector<std::pair<std::vector<bool>, ggml_tensor *>> rows;
+    };
+
+    split_tensors all; // inputs of groups->all
+    split_tensors out; // inputs of groups->out
+
+    std::vector<int32_t> rows_tmp;
+
+    // owned by the llama_context, re-initialized for every ubatch before the inputs are set
+    const llama_adapter_lora_groups * groups;
+};
+
+// candidate tokens selected by single sequences, the logits of their outputs are computed for these tokens only
+using llama_output_tokens_seq = std::map<llama_seq_id, std::vector<llama_token>>;
+
+// the candidate tokens of the outputs of a ubatch
+// the rows of the output weight of the candidate sets are gathered and stacked in order of first appearance, the
+// logits of each output are then picked from the products with the rows of its own set
+struct llama_output_select {
+    std::vector<const std::vector<llama_token> *> sets; // [n_outputs] candidate set of each output, null if none
+
+    std::vector<llama_token> rows; // [n_rows] the candidate sets used by the outputs, stacked
+    std::vector<int32_t>     ids;  // [n_outputs][n_cols] index of the logits of each output in [n_outputs][n_rows]
+
+    int32_t n_cols = 0; // logits per output (the largest set), 0 if the full vocab has to be computed
+
+    bool has_sets = false; // true if some output has a candidate set
+
+    // the selection is done only if every output has a candidate set and enable is true
+    void init(const llama_output_tokens_seq & tokens_seq, const llama_ubatch & ubatch, int32_t n_outputs, bool enable);
+
+    // move the logits of the candidates to the front of the rows of full-vocab logits [n_outputs][n_vocab]
+    void compact(float * logits, int64_t n_vocab);
+
+    bool empty() const {
+        return n_cols == 0;
+    }
+
+    // true if all the outputs use the same set, the products with its rows are then the logits as-is
+    bool is_uniform() const {
+        return rows.size() == (size_t) n_cols;
+    }
+
+private:
+    // scratch of init() and compact(), kept so that the ubatches do not allocate
+    std::vector<std::pair<const std::vector<llama_token> *, int32_t>> offs; // distinct sets and their first row
+    std::vector<float> tmp;
+};
+
+// candidate tokens of the outputs, the tensors are created by build_output
+class llm_graph_input_out_select : public llm_graph_input_i {
+public:
+    llm_graph_input_out_select(const llama_output_select * select) : select(select) {}
+    virtual ~llm_graph_input_out_select() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    ggml_tensor * rows = nullptr; // I32 [n_rows]
+    ggml_tensor * ids  = nullptr; // I32 [n_cols*n_outputs], null if the selection is uniform
+
+    // owned by the llama_context, re-initialized for every ubatch before the inputs are set
+    const llama_output_select * select;
+};
+
 //
 // llm_graph_result
 //
@@ -302,8 +381,12 @@ public:
     virtual ggml_tensor * get_logits()      = 0;
     virtual ggml_tensor * get_embd()        = 0;
     virtual ggml_tensor * get_embd_pooled() = 0;
+    virtual ggml_tensor * get_hidden()      = 0;
 
     virtual void set_inputs(const llama_ubatch * ubatch) = 0;
+
+    // move the KV cache stores of the graph to a new KV head (used when the graph is reused)
+    virtual void set_kv_head(uint32_t head) = 0;
 };
 
 using llm_graph_result_ptr = std::unique_ptr<llm_graph_result_i>;
@@ -316,6 +399,7 @@ public:
     ggml_tensor * get_logits()      override { return t_logits; }
     ggml_tensor * get_embd()        override { return t_embd; }
     ggml_tensor * get_embd_pooled() override { return t_embd_pooled; }
+    ggml_tensor * get_hidden()      override { return t_hidden; }
 
     void set_inputs(const llama_ubatch * ubatch) override {
         for (auto & input : inputs) {
@@ -323,17 +407,33 @@ public:
         }
     }
 
+    void set_kv_head(uint32_t head) override;
+
     llm_graph_input_i * add_input(llm_graph_input_ptr input) {
         inputs.emplace_back(std::move(input));
         return inputs.back().get();
     }
 
+    // views of the KV cache that receive the K/V of the current ubatch
+    // their offset is the only part of the graph that depends on the KV head
+    struct kv_store {
+        ggml_tensor * view;
+        size_t        stride; // bytes per KV cell
+    };
+
+    void add_kv_store(ggml_tensor * view, size_t stride) {
+        kv_stores.push_back({view, stride});
+    }
+
     // important graph nodes
     ggml_tensor * t_logits      = nullptr;
     ggml_tensor * t_embd        = nullptr;
     ggml_tensor * t_embd_pooled = nullptr;
+    ggml_tensor * t_hidden      = nullptr; // F32 [n_embd, n_tokens] output of the last layer of a partial graph
 
     std::vector<llm_graph_input_ptr> inputs;
+
+    std::vector<kv_store> kv_stores;
 };
 
 //
@@ -360,8 +460,18 @@ struct llm_graph_params {
     const llama_memory_i      * memory;
     const llama_cross         * cross;
 
+    const llama_adapter_lora_groups * lora_groups; // per-sequence adapters of the ubatch, null if unused
+    const llama_output_select       * out_select;  // candidate tokens of the outputs, null if unused
+    const llama_tensor_ids          * tensor_ids;  // ids of the model weights, used to index the adapter tables
+
+    llama_tp * tp;
+
     int32_t n_outputs;
 
+    // the layers [il_start, il_end) are computed, a subset of them for self-speculative decoding
+    int32_t il_start;
+    int32_t il_end;
+
     const llm_graph_cb & cb;
 };
 
@@ -399,6 +509,9 @@ struct llm_graph_context {
     const int32_t n_outputs;
     const int32_t n_ctx_orig; // yarn
 
+    const int32_t il_start; // first layer computed, > 0 when resuming from the hidden states of a draft
+    const int32_t il_end;   // last layer computed + 1, < n_layer when drafting
+
     const enum llama_pooling_type pooling_type;
     const enum llama_rope_type    rope_type;
 
@@ -413,6 +526,13 @@ struct llm_graph_context {
     const llama_memory_i      * memory;
     const llama_cross         * cross;
 
+    llm_graph_input_lora_seq   * inp_lora_seq   = nullptr; // per-sequence adapters, null if unused
+    llm_graph_input_out_select * inp_out_select = nullptr; // candidate tokens of the outputs, null if unused
+
+    const llama_tensor_ids * tensor_ids;
+
+    llama_tp * tp; // tensor parallel transport, null if disabled
+
     const llm_graph_cb & cb_func;
 
     std::unique_ptr<llm_graph_result> res;
@@ -431,17 +551,35 @@ struct llm_graph_context {
              ggml_tensor * cur,
                      int   il) const;
 
+    // id of a model weight in the adapter tables, -1 if the tensor is not a model weight
+    int32_t tensor_id(const ggml_tensor * w) const;
+
     // do mat_mul, while optionally apply lora
     ggml_tensor * build_lora_mm(
               ggml_tensor * w,
               ggml_tensor * cur) const;
 
+    // add the products of the per-sequence adapters to the result of a mat_mul
+    ggml_tensor * build_lora_seq(
+                  int32_t   id,
+              ggml_tensor * cur,
+              ggml_tensor * res) const;
+
+    // the output projection (lm_head), computed only for the candidate tokens of the outputs if they have any
+    ggml_tensor * build_output(
+              ggml_tensor * w,
+              ggml_tensor * cur) const;
+
     // do mat_mul_id, while optionally apply lora
     ggml_tensor * build_lora_mm_id(
               ggml_tensor * w,   // ggml_tensor * as
               ggml_tensor * cur, // ggml_tensor * b
               ggml_tensor * ids) const;
 
+    // sum the partial results of a row-split projection over the tensor parallel ranks (no-op without tensor parallelism)
+    ggml_tensor * build_tp_all_reduce(
+             ggml_tensor * cur) const;
+
     ggml_tensor * build_norm(
              ggml_tensor * cur,
              ggml_tensor * mw,
@@ -486,6 +624,7 @@ struct llm_graph_context {
     //
 
     ggml_tensor * build_inp_embd(ggml_tensor * tok_embd) const;
+    ggml_tensor * build_inp_hidden() const;
     ggml_tensor * build_inp_pos() const;
     ggml_tensor * build_inp_attn_scale() const;
     ggml_tensor * build_inp_out_ids() const;
@@ -86,6 +86,10 @@ bool llama_kv_cache_unified::init(
             buft = ggml_backend_cpu_buffer_type();
         }
 
+        if (model.params.use_hugepages && buft == ggml_backend_cpu_buffer_type()) {
+            buft = ggml_backend_cpu_hugepage_buffer_type();
+        }
+
         LLAMA_LOG_DEBUG("%s: layer %3d: n_embd_k_gqa = %d, n_embd_v_gqa = %d, dev = %s\n", __func__,
                 i, n_embd_k_gqa, n_embd_v_gqa, dev_name);
 
@@ -115,6 +119,14 @@ bool llama_kv_cache_unified::init(
         }
         ggml_backend_buffer_clear(buf, 0);
         LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
+        if (buft == ggml_backend_cpu_hugepage_buffer_type()) {
+            // the clear above faulted all the pages in
+            size_t n_explicit;
+            size_t n_transparent;
+            ggml_backend_cpu_buffer_get_huge_size(buf, &n_explicit, &n_transparent);
+            LLAMA_LOG_INFO("%s: huge pages back %.2f MiB of the KV buffer (explicit %.2f MiB, transparent %.2f MiB)\n", __func__,
+                    (n_explicit + n_transparent)/1024.0/1024.0, n_explicit/1024.0/1024.0, n_transparent/1024.0/1024.0);
+        }
         bufs.emplace_back(buf);
     }
 
@@ -6,8 +6,8 @@
 
 #include "ggml-cpp.h"
 
+#include <algorithm>
 #include <functional>
-#include <set>
 #include <vector>
 
 struct llama_cparams;
@@ -43,13 +43,77 @@ private:
     llama_kv_cache * kv;
 };
 
+// the sequences of a cell, a sorted set - a cell rarely belongs to more than a few sequences, these are kept inline
+// so that storing the tokens of a ubatch does not allocate
+struct llama_kv_seq_ids {
+    static constexpr uint32_t n_inline = 4;
+
+    const llama_seq_id * begin() const { return n > n_inline ? more.data() : ids; }
+    const llama_seq_id * end()   const { return begin() + n; }
+
+    size_t size()  const { return n; }
+    bool   empty() const { return n == 0; }
+
+    const llama_seq_id * find(llama_seq_id id) const {
+        const llama_seq_id * it = std::lower_bound(begin(), end(), id);
+        return it != end() && *it == id ? it : end();
+    }
+
+    void insert(llama_seq_id id) {
+        if (find(id) != end()) {
+            return;
+        }
+        if (n == n_inline) {
+            more.assign(ids, ids + n);
+        }
+        if (n >= n_inline) {
+            more.insert(std::upper_bound(more.begin(), more.end(), id), id);
+        } else {
+            llama_seq_id * it = std::upper_bound(ids, ids + n, id);
+            std::copy_backward(it, ids + n, ids + n + 1);
+            *it = id;
+        }
+        n++;
+    }
+
+    void erase(llama_seq_id id) {
+        if (find(id) == end()) {
+            return;
+        }
+        if (n > n_inline) {
+            more.erase(std::lower_bound(more.begin(), more.end(), id));
+            if (n - 1 == n_inline) {
+                std::copy(more.begin(), more.end(), ids);
+            }
+        } else {
+            llama_seq_id * it = std::lower_bound(ids, ids + n, id);
+            std::copy(it + 1, ids + n, it);
+        }
+        n--;
+    }
+
+    void clear() {
+        n = 0;
+    }
+
+    bool operator==(const llama_kv_seq_ids & other) const {
+        return std::equal(begin(), end(), other.begin(), other.end());
+    }
+
+private:
+    uint32_t     n = 0;
+    llama_seq_id ids[n_inline];
+
+    std::vector<llama_seq_id> more; // all the ids once there are more than n_inline
+};
+
 struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta =  0;
     int32_t   src   = -1; // used by recurrent state models to copy states
     int32_t   tail  = -1;
 
-    std::set<llama_seq_id> seq_id;
+    llama_kv_seq_ids seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
         return seq_id.find(id) != seq_id.end();
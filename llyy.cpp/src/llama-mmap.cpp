@@ -132,6 +132,26 @@ struct llama_file::impl {
         return val;
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) ((uint64_t) (offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &ov);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     void write_raw(const void * ptr, size_t len) const {
         size_t bytes_written = 0;
         while (bytes_written < len) {
@@ -215,6 +235,24 @@ struct llama_file::impl {
         return ret;
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        const int fd = fileno(fp);
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            bytes_read += (size_t) ret;
+        }
+    }
+
     void write_raw(const void * ptr, size_t len) const {
         if (len == 0) {
             return;
@@ -261,6 +299,7 @@ int llama_file::file_id() const {
 
 void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
 void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, len); }
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
 
 uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
@@ -354,6 +393,32 @@ struct llama_mmap::impl {
         mapped_fragments = std::move(new_mapped_fragments);
     }
 
+    void prefetch(size_t first, size_t last) const {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        first &= ~(page_size - 1);
+        if (last <= first) {
+            return;
+        }
+        // asynchronous readahead, errors only lose the hint
+        posix_madvise((char *) addr + first, last - first, POSIX_MADV_WILLNEED);
+    }
+
+    void evict(size_t first, size_t last) const {
+        // only the pages entirely in the range, the ones at the edges may hold other weights
+        align_range(&first, &last, sysconf(_SC_PAGESIZE));
+        if (last <= first) {
+            return;
+        }
+#ifdef MADV_PAGEOUT
+        // reclaim the clean pages now rather than when the memory runs out
+        madvise((char *) addr + first, last - first, MADV_PAGEOUT);
+#endif
+#ifdef MADV_DONTNEED
+        // the mapping is read-only, the pages are read from the file again on the next access
+        madvise((char *) addr + first, last - first, MADV_DONTNEED);
+#endif
+    }
+
     ~impl() {
         for (const auto & frag : mapped_fragments) {
             if (munmap((char *) addr + frag.first, frag.second - frag.first)) {
@@ -411,6 +476,16 @@ struct llama_mmap::impl {
         GGML_UNUSED(last);
     }
 
+    void prefetch(size_t first, size_t last) const {
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
+
+    void evict(size_t first, size_t last) const {
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
+
     ~impl() {
         if (!UnmapViewOfFile(addr)) {
             LLAMA_LOG_WARN("warning: UnmapViewOfFile failed: %s\n",
@@ -432,6 +507,16 @@ struct llama_mmap::impl {
 
         throw std::runtime_error("mmap not supported");
     }
+
+    void prefetch(size_t first, size_t last) const {
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
+
+    void evict(size_t first, size_t last) const {
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
 #endif
 
     void * addr;
@@ -445,6 +530,8 @@ size_t llama_mmap::size() const { return pimpl->size; }
 void * llama_mmap::addr() const { return pimpl->addr; }
 
 void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
+void llama_mmap::prefetch(size_t first, size_t last) const { pimpl->prefetch(first, last); }
+void llama_mmap::evict(size_t first, size_t last) const { pimpl->evict(first, last); }
 
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
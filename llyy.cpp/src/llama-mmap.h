@@ -26,6 +26,9 @@ struct llama_file {
     void read_raw(void * ptr, size_t len) const;
     uint32_t read_u32() const;
 
+    // read at an absolute offset without moving the file position, safe to call from several threads
+    void read_raw_at(void * ptr, size_t len, size_t offset) const;
+
     void write_raw(const void * ptr, size_t len) const;
     void write_u32(uint32_t val) const;
 
@@ -44,6 +47,10 @@ struct llama_mmap {
 
     void unmap_fragment(size_t first, size_t last);
 
+    // paging hints for the range [first, last) of the file: read it in ahead of use, or release its pages
+    void prefetch(size_t first, size_t last) const;
+    void evict   (size_t first, size_t last) const;
+
     static const bool SUPPORTED;
 
 private:
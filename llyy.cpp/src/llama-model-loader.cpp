@@ -2,15 +2,37 @@
 
 #include "ggml.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cinttypes>
+#include <climits>
+#include <condition_variable>
 #include <cstring>
-#include <future>
+#include <exception>
+#include <mutex>
+#include <thread>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
 static const size_t GiB = 1024*MiB;
 
+// the tensor data is loaded by a pool of reader threads in chunks of this size
+#define LLAMA_LOAD_CHUNK_SIZE (16*MiB)
+
+// several reads in flight keep an NVMe drive busy even with few cores, the threads mostly wait for I/O
+#define LLAMA_LOAD_MIN_THREADS 4
+#define LLAMA_LOAD_MAX_THREADS 8
+
+// load order of a tensor: the inputs, then the layers in order, then the outputs
+static int llama_tensor_load_order(const char * name) {
+    int il = 0;
+    if (sscanf(name, "blk.%d.", &il) == 1) {
+        return il;
+    }
+    return strncmp(name, "output", 6) == 0 ? INT_MAX : -1;
+}
+
 const char * llama_file_version_name(llama_fver version) {
     switch (version) {
         case GGUF_FILE_VERSION_V1: return "GGUF V1 (support until nov 2023)";
@@ -770,7 +792,31 @@ struct ggml_tensor * llama_model_loader::create_tensor(struct ggml_context * ctx
 
     bool duplicated = flags & TENSOR_DUPLICATED;
 
-    struct ggml_tensor * tensor = ggml_dup_tensor(ctx, cur);
+    struct ggml_tensor * tensor = nullptr;
+
+    if (tp_size > 1 && (flags & (TENSOR_TP_SPLIT_0 | TENSOR_TP_SPLIT_1))) {
+        const int dim = (flags & TENSOR_TP_SPLIT_0) ? 0 : 1;
+
+        if (cur->ne[dim] % tp_size != 0) {
+            throw std::runtime_error(format("%s: tensor '%s' dimension %d (%" PRId64 ") is not divisible by the tensor parallel size %d",
+                        __func__, name.c_str(), dim, cur->ne[dim], tp_size));
+        }
+
+        int64_t ne_slice[GGML_MAX_DIMS];
+        std::copy(cur->ne, cur->ne + GGML_MAX_DIMS, ne_slice);
+        ne_slice[dim] /= tp_size;
+
+        // the slices of a row must start at a block boundary
+        if (dim == 0 && ne_slice[0] % ggml_blck_size(cur->type) != 0) {
+            throw std::runtime_error(format("%s: tensor '%s' rows of type %s cannot be split in %d parts",
+                        __func__, name.c_str(), ggml_type_name(cur->type), tp_size));
+        }
+
+        tensor = ggml_new_tensor(ctx, cur->type, ggml_n_dims(cur), ne_slice);
+        tp_split_dim[name] = dim;
+    } else {
+        tensor = ggml_dup_tensor(ctx, cur);
+    }
     ggml_set_name(tensor, ggml_get_name(cur));
 
     if (duplicated) {
@@ -818,6 +864,8 @@ void llama_model_loader::done_getting_tensors() const {
 }
 
 void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps) {
+    mmaps_prefetch = prefetch;
+
     if (use_mmap) {
         mappings.reserve(files.size());
         mmaps_used.reserve(files.size());
@@ -890,7 +938,6 @@ bool llama_model_loader::load_all_data(
     GGML_ASSERT(size_data != 0 && "call init_mappings() first");
 
     std::vector<no_init<uint8_t>> read_buf;
-    std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
 
     // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
     // NVMe raid configurations might require more / larger buffers.
@@ -981,13 +1028,164 @@ bool llama_model_loader::load_all_data(
             ggml_backend_name(upload_backend));
     }
 
+    // load the layers in order, so that the first ones are resident first
+    std::vector<ggml_tensor *> tensors;
     for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
-        const auto * weight = get_weight(ggml_get_name(cur));
+        tensors.push_back(cur);
+    }
+    std::stable_sort(tensors.begin(), tensors.end(), [](const ggml_tensor * a, const ggml_tensor * b) {
+        return llama_tensor_load_order(ggml_get_name(a)) < llama_tensor_load_order(ggml_get_name(b));
+    });
+
+    // the tensors that end up in host memory - read from the files, or faulted in from the mappings - are loaded by
+    // a pool of reader threads in that order, and each one is validated by the thread that completes it, overlapping
+    // with the reads of the next ones; this thread waits for them in the same order, reports the progress and does
+    // the device uploads and the tensor parallel slices
+    struct load_state {
+        const llama_tensor_weight * weight = nullptr;
+
+        std::atomic<int> n_pending{0}; // chunks not read yet
+
+        bool pooled = false;
+        bool done   = false;
+        bool valid  = true;
+    };
+
+    struct load_chunk {
+        size_t i; // index in tensors
+        size_t offs;
+        size_t size;
+    };
+
+    std::vector<load_state> states(tensors.size());
+    std::vector<load_chunk> chunks;
+
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        ggml_tensor * cur = tensors[i];
+        auto & st = states[i];
+
+        st.weight = get_weight(ggml_get_name(cur));
+        if (st.weight == nullptr || tp_split_dim.count(ggml_get_name(cur))) {
+            continue;
+        }
+        if (!use_mmap && !ggml_backend_buffer_is_host(cur->buffer)) {
+            continue;
+        }
+        if (use_mmap && !mmaps_prefetch && !check_tensors) {
+            // the pages are read in on demand
+            continue;
+        }
+
+        const size_t n_size = ggml_nbytes(cur);
+        int n_chunks = 0;
+        size_t offs = 0;
+        do {
+            chunks.push_back({ i, offs, std::min<size_t>(LLAMA_LOAD_CHUNK_SIZE, n_size - offs) });
+            offs += LLAMA_LOAD_CHUNK_SIZE;
+            n_chunks++;
+        } while (offs < n_size);
+
+        st.pooled    = true;
+        st.n_pending = n_chunks;
+    }
+
+    std::mutex              load_mutex;
+    std::condition_variable load_cv;
+    std::exception_ptr      load_error;
+    std::atomic<size_t>     load_next{0};
+    std::atomic<bool>       load_stop{false};
+
+    auto load_worker = [&]() {
+        while (!load_stop.load(std::memory_order_relaxed)) {
+            const size_t ic = load_next.fetch_add(1);
+            if (ic >= chunks.size()) {
+                return;
+            }
+
+            const auto & chunk = chunks[ic];
+            ggml_tensor * cur = tensors[chunk.i];
+            auto & st = states[chunk.i];
+
+            try {
+                uint8_t * data;
+                if (use_mmap) {
+                    data = (uint8_t *) mappings.at(st.weight->idx)->addr() + st.weight->offs;
+
+                    // fault the pages in, a no-op for the parts that were prefetched
+                    const size_t page_size = 4096;
+                    uint8_t sum = 0;
+                    for (size_t j = 0; j < chunk.size; j += page_size) {
+                        sum += ((const volatile uint8_t *) data)[chunk.offs + j];
+                    }
+                    GGML_UNUSED(sum);
+                } else {
+                    data = (uint8_t *) cur->data;
+                    files.at(st.weight->idx)->read_raw_at(data + chunk.offs, chunk.size, st.weight->offs + chunk.offs);
+                }
+
+                if (st.n_pending.fetch_sub(1) == 1) {
+                    const bool valid = !check_tensors || ggml_validate_row_data(cur->type, data, ggml_nbytes(cur));
+
+                    std::lock_guard<std::mutex> lock(load_mutex);
+                    st.valid = valid;
+                    st.done  = true;
+                    load_cv.notify_all();
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(load_mutex);
+                if (!load_error) {
+                    load_error = std::current_exception();
+                }
+                load_stop = true;
+                load_cv.notify_all();
+                return;
+            }
+        }
+    };
+
+    // stops and joins the readers on every way out of this function
+    struct load_threads {
+        std::atomic<bool> & stop;
+        std::vector<std::thread> threads;
+
+        ~load_threads() {
+            stop = true;
+            for (auto & t : threads) {
+                t.join();
+            }
+        }
+    } readers { load_stop, {} };
+
+    const int64_t t_load_start_us = ggml_time_us();
+    size_t size_pooled = 0;
+
+    if (!chunks.empty()) {
+        const int n_threads = std::min<int>(chunks.size(),
+                std::max<int>(LLAMA_LOAD_MIN_THREADS, std::min<int>(LLAMA_LOAD_MAX_THREADS, std::thread::hardware_concurrency())));
+        for (int i = 0; i < n_threads; ++i) {
+            readers.threads.emplace_back(load_worker);
+        }
+    }
+
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        ggml_tensor * cur = tensors[i];
+        const auto & st = states[i];
+
+        const auto * weight = st.weight;
         if (weight == nullptr) {
             // this can happen with split experts models
             continue;
         }
 
+        if (st.pooled) {
+            std::unique_lock<std::mutex> lock(load_mutex);
+            load_cv.wait(lock, [&]() { return st.done || load_error; });
+            if (load_error) {
+                std::rethrow_exception(load_error);
+            }
+            size_pooled += ggml_nbytes(cur);
+        }
+
         if (progress_callback) {
             if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
                 return false;
@@ -996,6 +1194,44 @@ bool llama_model_loader::load_all_data(
 
         size_t n_size = ggml_nbytes(cur);
 
+        const auto tp_split = tp_split_dim.find(ggml_get_name(cur));
+        if (tp_split != tp_split_dim.end()) {
+            // tensor parallel slice: read the part of the file tensor that belongs to this rank
+            GGML_ASSERT(!use_mmap);
+
+            const ggml_tensor * full = weight->tensor;
+            const auto & file = files.at(weight->idx);
+
+            if (tp_split->second == 1) {
+                // a contiguous range of rows
+                read_buf.resize(n_size);
+                file->seek(weight->offs + tp_rank*n_size, SEEK_SET);
+                file->read_raw(read_buf.data(), n_size);
+            } else {
+                // a range of columns of every row
+                const size_t row_full  = full->nb[1];
+                const size_t row_slice = ggml_row_size(cur->type, cur->ne[0]);
+                const int64_t nrows    = ggml_nrows(full);
+
+                std::vector<no_init<uint8_t>> full_buf(ggml_nbytes(full));
+                file->seek(weight->offs, SEEK_SET);
+                file->read_raw(full_buf.data(), full_buf.size());
+
+                read_buf.resize(n_size);
+                for (int64_t i = 0; i < nrows; ++i) {
+                    memcpy(read_buf.data() + i*row_slice, full_buf.data() + i*row_full + tp_rank*row_slice, row_slice);
+                }
+            }
+
+            if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
+                throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
+            }
+            ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
+
+            size_done += ggml_nbytes(full);
+            continue;
+        }
+
         if (use_mmap) {
             const auto & mapping = mappings.at(weight->idx);
             ggml_backend_buffer_t buf_mmap = nullptr;
@@ -1004,12 +1240,6 @@ bool llama_model_loader::load_all_data(
             }
             uint8_t * data = (uint8_t *) mapping->addr() + weight->offs;
 
-            if (check_tensors) {
-                validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
-                    return std::make_pair(cur, ggml_validate_row_data(cur->type, data, n_size));
-                }));
-            }
-
             GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
             if (buf_mmap && cur->data == nullptr) {
                 ggml_backend_tensor_alloc(buf_mmap, cur, data);
@@ -1027,13 +1257,7 @@ bool llama_model_loader::load_all_data(
         } else {
             const auto & file = files.at(weight->idx);
             if (ggml_backend_buffer_is_host(cur->buffer)) {
-                file->seek(weight->offs, SEEK_SET);
-                file->read_raw(cur->data, n_size);
-                if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                        return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                    }));
-                }
+                // already read by the reader threads
             } else {
                 // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
                 if (upload_backend) {
@@ -1078,12 +1302,17 @@ bool llama_model_loader::load_all_data(
     }
     ggml_backend_free(upload_backend);
 
+    if (size_pooled > 0) {
+        const double t_ms = (ggml_time_us() - t_load_start_us)/1000.0;
+        LLAMA_LOG_INFO("%s: loaded %.2f MiB with %zu reader threads in %.2f ms (%.2f MiB/s)\n", __func__,
+                size_pooled/1024.0/1024.0, readers.threads.size(), t_ms, size_pooled/1024.0/1024.0/(t_ms/1000.0 + 1e-9));
+    }
+
     // check validation results
     bool validation_failed = false;
-    for (auto & future : validation_result) {
-        auto result = future.get();
-        if (!result.second) {
-            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(result.first));
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        if (!states[i].valid) {
+            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(tensors[i]));
             validation_failed = true;
         }
     }
@@ -60,6 +60,8 @@ struct llama_model_loader {
 
     static const int TENSOR_NOT_REQUIRED = 1;
     static const int TENSOR_DUPLICATED   = 2;
+    static const int TENSOR_TP_SPLIT_0   = 4; // tensor parallelism: load the slice of ne[0] that belongs to tp_rank
+    static const int TENSOR_TP_SPLIT_1   = 8; // tensor parallelism: load the slice of ne[1] that belongs to tp_rank
 
     int n_kv      = 0;
     int n_tensors = 0;
@@ -71,6 +73,12 @@ struct llama_model_loader {
     bool use_mmap = false;
     bool check_tensors;
 
+    int tp_rank = 0;
+    int tp_size = 1;
+
+    // split dimension of the tensors created with TENSOR_TP_SPLIT_*
+    std::unordered_map<std::string, int> tp_split_dim;
+
     llama_files files;
     llama_ftype ftype;
     llama_fver  fver;
@@ -91,6 +99,8 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
+    bool mmaps_prefetch = true; // the mappings are read in up front
+
     llama_model_loader(
         const std::string & fname,
         std::vector<std::string> & splits, // optional, only need if the split does not follow naming scheme
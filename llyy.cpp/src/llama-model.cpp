@@ -6,6 +6,8 @@
 #include "llama-cparams.h"
 #include "llama-model-loader.h"
 #include "llama-kv-cache.h"
+#include "llama-stream.h"
+#include "llama-tp.h"
 
 #include "ggml-cpp.h"
 
@@ -261,7 +263,7 @@ static ggml_backend_buffer_type_t select_weight_buft(const llama_hparams & hpara
 }
 
 // CPU: ACCEL -> GPU host -> CPU extra -> CPU
-static buft_list_t make_cpu_buft_list(const std::vector<ggml_backend_dev_t> & devices) {
+static buft_list_t make_cpu_buft_list(const std::vector<ggml_backend_dev_t> & devices, bool use_extra_bufts, bool use_hugepages) {
     buft_list_t buft_list;
 
     // add ACCEL buffer types
@@ -296,7 +298,7 @@ static buft_list_t make_cpu_buft_list(const std::vector<ggml_backend_dev_t> & de
     auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
     auto ggml_backend_dev_get_extra_bufts_fn = (ggml_backend_dev_get_extra_bufts_t)
         ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_dev_get_extra_bufts");
-    if (ggml_backend_dev_get_extra_bufts_fn) {
+    if (ggml_backend_dev_get_extra_bufts_fn && use_extra_bufts) {
         ggml_backend_buffer_type_t * extra_bufts = ggml_backend_dev_get_extra_bufts_fn(cpu_dev);
         while (extra_bufts && *extra_bufts) {
             buft_list.emplace_back(cpu_dev, *extra_bufts);
@@ -305,10 +307,11 @@ static buft_list_t make_cpu_buft_list(const std::vector<ggml_backend_dev_t> & de
     }
 
     // add the CPU buffer type
+    // with huge pages the weights are no longer used from the mapping, since it is not the default buffer type
     for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
         ggml_backend_dev_t dev = ggml_backend_dev_get(i);
         if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU) {
-            buft_list.emplace_back(dev, ggml_backend_dev_buffer_type(dev));
+            buft_list.emplace_back(dev, use_hugepages ? ggml_backend_cpu_hugepage_buffer_type() : ggml_backend_dev_buffer_type(dev));
         }
     }
 
@@ -1417,19 +1420,31 @@ void llama_model::load_vocab(llama_model_loader & ml) {
 }
 
 bool llama_model::load_tensors(llama_model_loader & ml) {
-    const auto & split_mode   = params.split_mode;
-    const auto & n_gpu_layers = params.n_gpu_layers;
-    const auto & use_mlock    = params.use_mlock;
-    const auto & tensor_split = params.tensor_split;
+    const auto & split_mode    = params.split_mode;
+    const auto & n_gpu_layers  = params.n_gpu_layers;
+    const auto & use_mlock     = params.use_mlock;
+    const auto & tensor_split  = params.tensor_split;
+    const auto & use_hugepages = params.use_hugepages;
 
     const int n_layer = hparams.n_layer;
 
     const bool use_mmap_buffer = true;
 
+    bool use_stream = params.n_layer_stream > 0;
+    if (use_stream && (!ml.use_mmap || use_mlock || use_hugepages)) {
+        LLAMA_LOG_WARN("%s: layer streaming requires mmap and neither mlock nor huge pages, disabling it\n", __func__);
+        use_stream = false;
+    }
+    if (use_stream && params.n_layer_stream >= n_layer - 1) {
+        LLAMA_LOG_WARN("%s: layer streaming %d layers ahead keeps all the %d layers resident, disabling it\n", __func__, params.n_layer_stream, n_layer);
+        use_stream = false;
+    }
+
     LLAMA_LOG_INFO("%s: loading model tensors, this can take a while... (mmap = %s)\n", __func__, ml.use_mmap ? "true" : "false");
 
     // build a list of buffer types for the CPU and GPU devices
-    pimpl->cpu_buft_list = make_cpu_buft_list(devices);
+    // the extra buffer types (repacked weights) copy the weights out of the mapping, which defeats the streaming
+    pimpl->cpu_buft_list = make_cpu_buft_list(devices, !use_stream, use_hugepages);
     for (auto * dev : devices) {
         buft_list_t buft_list = make_gpu_buft_list(dev, split_mode, tensor_split);
         // add CPU buffer types as a fallback
@@ -1522,6 +1537,22 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     const auto TENSOR_DUPLICATED   = llama_model_loader::TENSOR_DUPLICATED;
     const auto TENSOR_NOT_REQUIRED = llama_model_loader::TENSOR_NOT_REQUIRED;
+    const auto TENSOR_TP_SPLIT_0   = llama_model_loader::TENSOR_TP_SPLIT_0;
+    const auto TENSOR_TP_SPLIT_1   = llama_model_loader::TENSOR_TP_SPLIT_1;
+
+    const int tp_size = ml.tp_size;
+    if (tp_size > 1) {
+        // the attention and FFN blocks are split by heads / hidden units, the rest of the model is replicated
+        if (arch != LLM_ARCH_LLAMA || hparams.n_expert > 0) {
+            throw std::runtime_error(format("tensor parallelism is not supported for %s models", arch_name().c_str()));
+        }
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            if (hparams.n_head(il) % tp_size != 0 || hparams.n_head_kv(il) % tp_size != 0 || hparams.n_ff(il) % tp_size != 0) {
+                throw std::runtime_error(format("layer %u: n_head = %u, n_head_kv = %u, n_ff = %u are not divisible by the tensor parallel size %d",
+                            il, hparams.n_head(il), hparams.n_head_kv(il), hparams.n_ff(il), tp_size));
+            }
+        }
+    }
 
     // create tensors for the weights
     {
@@ -1638,8 +1669,21 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                 }
             }
 
+            // the tensor parallel ranks hold a slice of the split tensors, the buffer type must support the shape of the slice
+            ggml_tensor t_slice;
+            ggml_tensor * t_select = t_meta;
+            if (tp_size > 1 && (flags & (TENSOR_TP_SPLIT_0 | TENSOR_TP_SPLIT_1))) {
+                t_slice = *t_meta;
+                t_slice.ne[(flags & TENSOR_TP_SPLIT_0) ? 0 : 1] /= tp_size;
+                t_slice.nb[1] = t_slice.nb[0]*(t_slice.ne[0]/ggml_blck_size(t_slice.type));
+                for (int i = 2; i < GGML_MAX_DIMS; i++) {
+                    t_slice.nb[i] = t_slice.nb[i - 1]*t_slice.ne[i - 1];
+                }
+                t_select = &t_slice;
+            }
+
             if (!buft) {
-                buft = select_weight_buft(hparams, t_meta, op, *buft_list);
+                buft = select_weight_buft(hparams, t_select, op, *buft_list);
                 if (!buft) {
                     throw std::runtime_error(format("failed to find a compatible buffer type for tensor %s", tn.str().c_str()));
                 }
@@ -1700,15 +1744,16 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
                         layer.attn_norm = create_tensor(tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd}, 0);
 
-                        layer.wq = create_tensor(tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head}, 0);
-                        layer.wk = create_tensor(tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa}, 0);
-                        layer.wv = create_tensor(tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa}, 0);
-                        layer.wo = create_tensor(tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd}, 0);
+                        // with tensor parallelism, each rank gets a slice of the heads: Q/K/V are split by rows, the output projection by columns
+                        layer.wq = create_tensor(tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head}, TENSOR_TP_SPLIT_1);
+                        layer.wk = create_tensor(tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa}, TENSOR_TP_SPLIT_1);
+                        layer.wv = create_tensor(tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa}, TENSOR_TP_SPLIT_1);
+                        layer.wo = create_tensor(tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd}, TENSOR_TP_SPLIT_0);
 
                         // optional bias tensors
-                        layer.bq = create_tensor(tn(LLM_TENSOR_ATTN_Q,   "bias", i), {n_embd},     TENSOR_NOT_REQUIRED);
-                        layer.bk = create_tensor(tn(LLM_TENSOR_ATTN_K,   "bias", i), {n_embd_gqa}, TENSOR_NOT_REQUIRED);
-                        layer.bv = create_tensor(tn(LLM_TENSOR_ATTN_V,   "bias", i), {n_embd_gqa}, TENSOR_NOT_REQUIRED);
+                        layer.bq = create_tensor(tn(LLM_TENSOR_ATTN_Q,   "bias", i), {n_embd},     TENSOR_NOT_REQUIRED | TENSOR_TP_SPLIT_0);
+                        layer.bk = create_tensor(tn(LLM_TENSOR_ATTN_K,   "bias", i), {n_embd_gqa}, TENSOR_NOT_REQUIRED | TENSOR_TP_SPLIT_0);
+                        layer.bv = create_tensor(tn(LLM_TENSOR_ATTN_V,   "bias", i), {n_embd_gqa}, TENSOR_NOT_REQUIRED | TENSOR_TP_SPLIT_0);
                         layer.bo = create_tensor(tn(LLM_TENSOR_ATTN_OUT, "bias", i), {n_embd},     TENSOR_NOT_REQUIRED);
 
                         layer.ffn_norm = create_tensor(tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd}, 0);
@@ -1722,14 +1767,14 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                         }
 
                         if (n_expert == 0) {
-                            layer.ffn_gate = create_tensor(tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff}, 0);
-                            layer.ffn_down = create_tensor(tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd}, 0);
-                            layer.ffn_up   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, 0);
+                            layer.ffn_gate = create_tensor(tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff}, TENSOR_TP_SPLIT_1);
+                            layer.ffn_down = create_tensor(tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd}, TENSOR_TP_SPLIT_0);
+                            layer.ffn_up   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, TENSOR_TP_SPLIT_1);
 
                             // optional MLP bias
-                            layer.ffn_gate_b = create_tensor(tn(LLM_TENSOR_FFN_GATE, "bias", i), {n_ff}, TENSOR_NOT_REQUIRED);
+                            layer.ffn_gate_b = create_tensor(tn(LLM_TENSOR_FFN_GATE, "bias", i), {n_ff}, TENSOR_NOT_REQUIRED | TENSOR_TP_SPLIT_0);
                             layer.ffn_down_b = create_tensor(tn(LLM_TENSOR_FFN_DOWN, "bias", i), {n_embd}, TENSOR_NOT_REQUIRED);
-                            layer.ffn_up_b   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "bias", i), {n_ff}, TENSOR_NOT_REQUIRED);
+                            layer.ffn_up_b   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "bias", i), {n_ff}, TENSOR_NOT_REQUIRED | TENSOR_TP_SPLIT_0);
                         } else {
                             layer.ffn_gate_inp  = create_tensor(tn(LLM_TENSOR_FFN_GATE_INP,  "weight", i), {n_embd, n_expert}, 0);
                             layer.ffn_gate_exps = create_tensor(tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i), {n_embd,   n_ff, n_expert}, TENSOR_NOT_REQUIRED);
@@ -4051,7 +4096,16 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr);
+    if (tp_size > 1) {
+        // from here on the model describes the slice of this rank
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            hparams.n_head_arr[il]    /= tp_size;
+            hparams.n_head_kv_arr[il] /= tp_size;
+            hparams.n_ff_arr[il]      /= tp_size;
+        }
+    }
+
+    ml.init_mappings(!use_stream, use_mlock ? &pimpl->mlock_mmaps : nullptr);
     pimpl->mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -4155,9 +4209,16 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     }
 
     // populate tensors_by_name
-    for (auto & ctx : pimpl->ctxs) {
-        for (auto * cur = ggml_get_first_tensor(ctx.get()); cur != NULL; cur = ggml_get_next_tensor(ctx.get(), cur)) {
-            tensors_by_name.emplace_back(ggml_get_name(cur), cur);
+    // the copies of a duplicated tensor (e.g. the token embeddings used as the output) share the id of the first one,
+    // so that the adapter weights bound by name apply to all of them
+    {
+        std::unordered_map<std::string, int32_t> ids_by_name;
+        for (auto & ctx : pimpl->ctxs) {
+            for (auto * cur = ggml_get_first_tensor(ctx.get()); cur != NULL; cur = ggml_get_next_tensor(ctx.get(), cur)) {
+                const auto it = ids_by_name.emplace(ggml_get_name(cur), (int32_t) tensors_by_name.size()).first;
+                tensor_ids[cur] = it->second;
+                tensors_by_name.emplace_back(ggml_get_name(cur), cur);
+            }
         }
     }
 
@@ -4170,12 +4231,81 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    // with --numa shard, move the rows of the host weight matrices to the nodes whose threads compute them
+    if (auto * dev_cpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU)) {
+        auto * reg_cpu = ggml_backend_dev_backend_reg(dev_cpu);
+        auto * shard_fn = (size_t (*)(ggml_tensor **, int)) ggml_backend_reg_get_proc_address(reg_cpu, "ggml_backend_cpu_numa_shard_tensors");
+        if (shard_fn) {
+            std::vector<ggml_tensor *> weights;
+            for (auto & it : tensors_by_name) {
+                ggml_tensor * cur = it.second;
+                if (cur->buffer && ggml_backend_buffer_is_host(cur->buffer) && ggml_n_dims(cur) == 2) {
+                    weights.push_back(cur);
+                }
+            }
+            const size_t n_placed = shard_fn(weights.data(), (int) weights.size());
+            if (n_placed > 0) {
+                LLAMA_LOG_INFO("%s: NUMA sharded %.2f MiB of weights\n", __func__, n_placed / 1024.0 / 1024.0);
+            }
+        }
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             pimpl->mappings.emplace_back(std::move(mapping));
         }
     }
 
+    if (use_hugepages) {
+        size_t n_total       = 0;
+        size_t n_explicit    = 0;
+        size_t n_transparent = 0;
+        for (auto & buf : pimpl->bufs) {
+            if (ggml_backend_buffer_get_type(buf.get()) != ggml_backend_cpu_hugepage_buffer_type()) {
+                continue;
+            }
+            size_t n_buf_explicit;
+            size_t n_buf_transparent;
+            ggml_backend_cpu_buffer_get_huge_size(buf.get(), &n_buf_explicit, &n_buf_transparent);
+            n_total       += ggml_backend_buffer_get_size(buf.get());
+            n_explicit    += n_buf_explicit;
+            n_transparent += n_buf_transparent;
+        }
+        LLAMA_LOG_INFO("%s: huge pages back %.2f of the %.2f MiB of weights in huge page buffers (explicit %.2f MiB, transparent %.2f MiB)\n", __func__,
+                (n_explicit + n_transparent)/1024.0/1024.0, n_total/1024.0/1024.0, n_explicit/1024.0/1024.0, n_transparent/1024.0/1024.0);
+    }
+
+    if (use_stream) {
+        stream = std::make_unique<llama_layer_stream>(n_layer, params.n_layer_stream);
+
+        // the layer weights that are used from the mappings
+        for (auto & it : tensors_by_name) {
+            const ggml_tensor * cur = it.second;
+
+            int il = -1;
+            if (sscanf(it.first.c_str(), "blk.%d.", &il) != 1 || il < 0 || il >= n_layer || !cur->data) {
+                continue;
+            }
+
+            for (const auto & mapping : pimpl->mappings) {
+                const uint8_t * base = (const uint8_t *) mapping->addr();
+                const uint8_t * data = (const uint8_t *) cur->data;
+                if (data >= base && data + ggml_nbytes(cur) <= base + mapping->size()) {
+                    stream->add(il, mapping.get(), data - base, data - base + ggml_nbytes(cur));
+                    break;
+                }
+            }
+        }
+
+        LLAMA_LOG_INFO("%s: streaming the layer weights, %d layers ahead (%.2f MiB per layer)\n", __func__,
+                params.n_layer_stream, stream->layer_size(0)/1024.0/1024.0);
+    }
+
+    if (tp_size > 1) {
+        // blocks until all the ranks have loaded their slices
+        tp = std::make_unique<llama_tp>(params.tp_shm ? params.tp_shm : "llama-tp", ml.tp_rank, tp_size);
+    }
+
     return true;
 }
 
@@ -4416,6 +4546,15 @@ const ggml_tensor * llama_model::get_tensor(const char * name) const {
     return it->second;
 }
 
+int32_t llama_model::get_tensor_id(const ggml_tensor * t) const {
+    const auto it = tensor_ids.find(t);
+    if (it == tensor_ids.end()) {
+        return -1;
+    }
+
+    return it->second;
+}
+
 struct llm_build_llama : public llm_graph_context {
     llm_build_llama(const llama_model & model, const llm_graph_params & params, ggml_cgraph * gf) : llm_graph_context(params) {
         const int64_t n_embd_head = hparams.n_embd_head_v;
@@ -4426,7 +4565,8 @@ struct llm_build_llama : public llm_graph_context {
         ggml_tensor * cur;
         ggml_tensor * inpL;
 
-        inpL = build_inp_embd(model.tok_embd);
+        // the full decode of drafted tokens resumes from their hidden states at the exit layer of the draft
+        inpL = il_start > 0 ? build_inp_hidden() : build_inp_embd(model.tok_embd);
 
         // inp_pos - contains the positions
         ggml_tensor * inp_pos = build_inp_pos();
@@ -4440,7 +4580,7 @@ struct llm_build_llama : public llm_graph_context {
         auto * inp_attn = build_attn_inp_kv_unified();
 
         const float kq_scale = hparams.f_attention_scale == 0.0f ? 1.0f/sqrtf(float(n_embd_head)) : hparams.f_attention_scale;
-        for (int il = 0; il < n_layer; ++il) {
+        for (int il = il_start; il < il_end; ++il) {
             ggml_tensor * inpSA = inpL;
 
             bool use_rope = arch == LLM_ARCH_LLAMA4
@@ -4618,6 +4758,15 @@ struct llm_build_llama : public llm_graph_context {
 
         cur = inpL;
 
+        if (il_end < n_layer) {
+            // early exit of a draft: the hidden states of all the tokens are kept, the full model resumes from them
+            ggml_set_output(cur);
+            res->t_hidden = cur;
+
+            ggml_tensor * inp_out_ids = build_inp_out_ids();
+            cur = ggml_get_rows(ctx0, cur, inp_out_ids);
+        }
+
         cur = build_norm(cur,
                 model.output_norm, NULL,
                 LLM_NORM_RMS, -1);
@@ -4626,7 +4775,7 @@ struct llm_build_llama : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         // For Granite architecture
         if (hparams.f_logit_scale) {
@@ -4790,7 +4939,7 @@ struct llm_build_deci : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         // For Granite architecture
         if (hparams.f_logit_scale) {
@@ -4917,7 +5066,7 @@ struct llm_build_baichuan : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5030,7 +5179,7 @@ struct llm_build_xverse : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5154,7 +5303,7 @@ struct llm_build_falcon : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5311,7 +5460,7 @@ struct llm_build_grok : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         // Grok
         // multiply logits by output_multiplier_scale of 0.5773502691896257
@@ -5443,7 +5592,7 @@ struct llm_build_dbrx : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5552,7 +5701,7 @@ struct llm_build_starcoder : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5651,7 +5800,7 @@ struct llm_build_refact : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5922,7 +6071,7 @@ struct llm_build_bloom : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6064,7 +6213,7 @@ struct llm_build_mpt : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6216,7 +6365,7 @@ struct llm_build_stablelm : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6332,7 +6481,7 @@ struct llm_build_qwen : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6450,7 +6599,7 @@ struct llm_build_qwen2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6571,7 +6720,7 @@ struct llm_build_qwen2vl : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6730,7 +6879,7 @@ struct llm_build_qwen2moe : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6851,7 +7000,7 @@ struct llm_build_qwen3 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6979,7 +7128,7 @@ struct llm_build_qwen3moe : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -7375,7 +7524,7 @@ struct llm_build_plamo : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -7485,7 +7634,7 @@ struct llm_build_gpt2 : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -7601,7 +7750,7 @@ struct llm_build_codeshell : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -7728,7 +7877,7 @@ struct llm_build_orion : public llm_graph_context {
     res->t_embd = cur;
 
     // lm_head
-    cur = build_lora_mm(model.output, cur);
+    cur = build_output(model.output, cur);
 
     cb(cur, "result_output", -1);
     res->t_logits = cur;
@@ -7855,7 +8004,7 @@ struct llm_build_internlm2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8068,7 +8217,7 @@ struct llm_build_minicpm3 : public llm_graph_context {
         cb(cur, "lmhead_scaling", -1);
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8184,7 +8333,7 @@ struct llm_build_gemma : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8316,7 +8465,7 @@ struct llm_build_gemma2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         // final logit soft-capping
         cur = ggml_scale(ctx0, cur, 1.0f / hparams.f_final_logit_softcapping);
@@ -8457,7 +8606,7 @@ struct llm_build_gemma3 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8586,7 +8735,7 @@ struct llm_build_starcoder2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8644,7 +8793,7 @@ struct llm_build_mamba : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8919,7 +9068,7 @@ struct llm_build_command_r : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         if (f_logit_scale) {
             cur = ggml_scale(ctx0, cur, f_logit_scale);
@@ -9049,7 +9198,7 @@ struct llm_build_cohere2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         if (f_logit_scale) {
             cur = ggml_scale(ctx0, cur, f_logit_scale);
@@ -9187,7 +9336,7 @@ struct llm_build_olmo : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -9312,7 +9461,7 @@ struct llm_build_olmo2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -9444,7 +9593,7 @@ struct llm_build_olmoe : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -9573,7 +9722,7 @@ struct llm_build_openelm : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -9721,7 +9870,7 @@ struct llm_build_gptneox : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -9859,7 +10008,7 @@ struct llm_build_arctic : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -10022,7 +10171,7 @@ struct llm_build_deepseek : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -10717,7 +10866,7 @@ struct llm_build_t5_dec : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -10812,7 +10961,7 @@ struct llm_build_jais : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -10945,7 +11094,7 @@ struct llm_build_chatglm : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -11096,7 +11245,7 @@ struct llm_build_glm4 : public llm_graph_context {
         res->t_embd = cur;
 
         // Output projection
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -11225,7 +11374,7 @@ struct llm_build_nemotron : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -11356,7 +11505,7 @@ struct llm_build_exaone : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -11664,7 +11813,7 @@ struct llm_build_rwkv6 : public llm_build_rwkv6_base {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -11752,7 +11901,7 @@ struct llm_build_rwkv6qwen2 : public llm_build_rwkv6_base {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -12015,7 +12164,7 @@ struct llm_build_rwkv7 : public llm_build_rwkv7_base {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -12104,7 +12253,7 @@ struct llm_build_arwkv7 : public llm_build_rwkv7_base {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -12611,7 +12760,7 @@ struct llm_build_plm : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -12755,7 +12904,7 @@ struct llm_build_bailingmoe : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_output(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -13082,10 +13231,15 @@ llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.tp_rank                     =*/ 0,
+        /*.tp_size                     =*/ 1,
+        /*.tp_shm                      =*/ nullptr,
+        /*.n_layer_stream              =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.use_hugepages               =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -15,6 +15,8 @@
 struct llama_cparams;
 struct llama_ubatch;
 struct llama_model_loader;
+struct llama_tp;
+struct llama_layer_stream;
 
 // available models
 enum llm_type {
@@ -355,6 +357,15 @@ struct llama_model {
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
+    // index of each weight in tensors_by_name, the copies of a duplicated weight share the index of the first one
+    llama_tensor_ids tensor_ids;
+
+    // shared memory transport of the tensor parallel ranks (null if tensor parallelism is disabled)
+    std::unique_ptr<llama_tp> tp;
+
+    // paging of the layer weights driven by the computation (null if streaming is disabled)
+    std::unique_ptr<llama_layer_stream> stream;
+
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
@@ -390,6 +401,9 @@ struct llama_model {
 
     const struct ggml_tensor * get_tensor(const char * name) const;
 
+    // returns -1 if t is not a weight of the model
+    int32_t get_tensor_id(const struct ggml_tensor * t) const;
+
     // TODO: move this to new llm_arch_model_i interface
     llama_memory_i * create_memory() const; // TODO: params
 
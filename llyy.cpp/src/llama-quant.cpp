@@ -8,7 +8,13 @@
 #include <cmath>
 #include <cstring>
 #include <cinttypes>
+#include <cstdio>
 #include <fstream>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
 #include <mutex>
 #include <regex>
 #include <thread>
@@ -54,78 +60,6 @@ struct tensor_quantization {
     ggml_type quant = GGML_TYPE_COUNT;
 };
 
-static void llama_tensor_dequantize_impl(
-    ggml_tensor * tensor, std::vector<no_init<float>> & output, std::vector<std::thread> & workers,
-    const size_t nelements, const int nthread
-) {
-    if (output.size() < nelements) {
-        output.resize(nelements);
-    }
-    float * f32_output = (float *) output.data();
-
-    const ggml_type_traits * qtype = ggml_get_type_traits(tensor->type);
-    if (ggml_is_quantized(tensor->type)) {
-        if (qtype->to_float == NULL) {
-            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
-        }
-    } else if (tensor->type != GGML_TYPE_F16 &&
-               tensor->type != GGML_TYPE_BF16) {
-        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
-    }
-
-    if (nthread < 2) {
-        if (tensor->type == GGML_TYPE_F16) {
-            ggml_fp16_to_fp32_row((ggml_fp16_t *)tensor->data, f32_output, nelements);
-        } else if (tensor->type == GGML_TYPE_BF16) {
-            ggml_bf16_to_fp32_row((ggml_bf16_t *)tensor->data, f32_output, nelements);
-        } else if (ggml_is_quantized(tensor->type)) {
-            qtype->to_float(tensor->data, f32_output, nelements);
-        } else {
-            GGML_ABORT("fatal error"); // unreachable
-        }
-        return;
-    }
-
-    size_t block_size;
-    if (tensor->type == GGML_TYPE_F16 ||
-        tensor->type == GGML_TYPE_BF16) {
-        block_size = 1;
-    } else {
-        block_size = (size_t)ggml_blck_size(tensor->type);
-    }
-
-    size_t block_size_bytes = ggml_type_size(tensor->type);
-
-    GGML_ASSERT(nelements % block_size == 0);
-    size_t nblocks = nelements / block_size;
-    size_t blocks_per_thread = nblocks / nthread;
-    size_t spare_blocks = nblocks - (blocks_per_thread * nthread); // if blocks aren't divisible by thread count
-
-    size_t in_buff_offs = 0;
-    size_t out_buff_offs = 0;
-
-    for (int tnum = 0; tnum < nthread; tnum++) {
-        size_t thr_blocks = blocks_per_thread + (tnum == nthread - 1 ? spare_blocks : 0); // num blocks for this thread
-        size_t thr_elems = thr_blocks * block_size; // number of elements for this thread
-        size_t thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
-
-        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
-            if (typ == GGML_TYPE_F16) {
-                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
-            } else if (typ == GGML_TYPE_BF16) {
-                ggml_bf16_to_fp32_row((ggml_bf16_t *)inbuf, outbuf, nels);
-            } else {
-                qtype->to_float(inbuf, outbuf, nels);
-            }
-        };
-        workers.emplace_back(compute, tensor->type, (uint8_t *) tensor->data + in_buff_offs, f32_output + out_buff_offs, thr_elems);
-        in_buff_offs += thr_block_bytes;
-        out_buff_offs += thr_elems;
-    }
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
-}
-
 static ggml_type llama_tensor_get_type(quantize_state_impl & qs, ggml_type new_type, const ggml_tensor * tensor, llama_ftype ftype) {
     const std::string name = ggml_get_name(tensor);
 
@@ -416,58 +350,166 @@ static ggml_type llama_tensor_get_type(quantize_state_impl & qs, ggml_type new_t
     return new_type;
 }
 
-static size_t llama_tensor_quantize_impl(enum ggml_type new_type, const float * f32_data, void * new_data, const int64_t chunk_size, int64_t nrows, int64_t n_per_row, const float * imatrix, std::vector<std::thread> & workers, const int nthread) {
-    if (nthread < 2) {
-        // single-thread
-        size_t new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nrows, n_per_row, imatrix);
-        if (!ggml_validate_row_data(new_type, new_data, new_size)) {
-            throw std::runtime_error("quantized data validation failed");
-        }
-        return new_size;
+// elements per task of the quantization pool - small enough to balance the work of a tensor over the threads,
+// large enough to amortize the queueing and for the f32 conversion buffer to stay in cache
+static const int64_t quantize_task_size = 64 * 1024;
+
+// upper bound of the input + output bytes of the tensors in flight between the reader and the writer
+static const size_t quantize_max_inflight = 2ull * 1024 * 1024 * 1024;
+
+// 128-bit content hash for the keys of the quantized tensor cache (MurmurHash3 x64_128), one pass over the data
+struct llama_quant_hash {
+    uint64_t h0;
+    uint64_t h1;
+};
+
+static llama_quant_hash llama_quant_hash_data(const void * data, size_t size) {
+    auto rotl = [](uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    };
+    auto fmix = [](uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdull;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ull;
+        k ^= k >> 33;
+        return k;
+    };
+
+    const uint64_t c1 = 0x87c37b91114253d5ull;
+    const uint64_t c2 = 0x4cf5ad432745937full;
+
+    const uint8_t * p = (const uint8_t *) data;
+    uint64_t h0 = 0;
+    uint64_t h1 = 0;
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        uint64_t k0;
+        uint64_t k1;
+        memcpy(&k0, p + i,     8);
+        memcpy(&k1, p + i + 8, 8);
+
+        h0 ^= rotl(k0*c1, 31)*c2;
+        h0  = (rotl(h0, 27) + h1)*5 + 0x52dce729;
+        h1 ^= rotl(k1*c2, 33)*c1;
+        h1  = (rotl(h1, 31) + h0)*5 + 0x38495ab5;
     }
 
-    std::mutex mutex;
-    int64_t counter = 0;
-    size_t new_size = 0;
-    bool valid = true;
-    auto compute = [&mutex, &counter, &new_size, &valid, new_type, f32_data, new_data, chunk_size,
-            nrows, n_per_row, imatrix]() {
-        const int64_t nrows_per_chunk = chunk_size / n_per_row;
-        size_t local_size = 0;
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex);
-            int64_t first_row = counter; counter += nrows_per_chunk;
-            if (first_row >= nrows) {
-                if (local_size > 0) {
-                    new_size += local_size;
-                }
-                break;
-            }
-            lock.unlock();
-            const int64_t this_nrow = std::min(nrows - first_row, nrows_per_chunk);
-            size_t this_size = ggml_quantize_chunk(new_type, f32_data, new_data, first_row * n_per_row, this_nrow, n_per_row, imatrix);
-            local_size += this_size;
+    // the remaining 0-15 bytes, little-endian as in the reference implementation
+    uint64_t k0 = 0;
+    uint64_t k1 = 0;
+    for (size_t j = size - i; j > 8; --j) {
+        k1 = (k1 << 8) | p[i + j - 1];
+    }
+    for (size_t j = std::min<size_t>(size - i, 8); j > 0; --j) {
+        k0 = (k0 << 8) | p[i + j - 1];
+    }
+    if (size - i > 8) {
+        h1 ^= rotl(k1*c2, 33)*c1;
+    }
+    if (size - i > 0) {
+        h0 ^= rotl(k0*c1, 31)*c2;
+    }
 
-            // validate the quantized data
-            const size_t row_size  = ggml_row_size(new_type, n_per_row);
-            void * this_data = (char *) new_data + first_row * row_size;
-            if (!ggml_validate_row_data(new_type, this_data, this_size)) {
-                std::unique_lock<std::mutex> lock(mutex);
-                valid = false;
-                break;
-            }
+    h0 ^= size;
+    h1 ^= size;
+    h0 += h1;
+    h1 += h0;
+    h0  = fmix(h0);
+    h1  = fmix(h1);
+    h0 += h1;
+    h1 += h0;
+
+    return { h0, h1 };
+}
+
+// a tensor going through the quantization pipeline: read -> convert/quantize (row chunks) -> write
+struct quantize_job {
+    const llama_model_loader::llama_tensor_weight * weight = nullptr;
+
+    bool          quantize = false;
+    ggml_type     new_type = GGML_TYPE_COUNT;
+    const float * imatrix  = nullptr;
+    size_t        new_size = 0;
+    size_t        inflight = 0; // bytes accounted against quantize_max_inflight
+
+    std::vector<no_init<uint8_t>> read_data; // input, when the file is not mmapped
+    std::vector<no_init<uint8_t>> new_data;  // output, when quantized
+
+    // quantized tensor cache
+    llama_quant_hash  imatrix_hash = {}; // of the importance matrix slice of the tensor
+    std::string       cache_file;        // content-addressed file of the output, empty when not cacheable
+    bool              cached = false;    // the output was read from the cache, the workers still validate it
+    std::atomic<bool> cache_invalid { false }; // some of the cached rows failed validation and were quantized again
+
+    bool loaded = false;
+    std::atomic<int64_t> n_pending { 0 }; // row chunks not processed yet
+};
+
+// a chunk of rows of a tensor, rows never cross a matrix (expert) boundary
+struct quantize_task {
+    quantize_job * job;
+    int64_t i_mat;
+    int64_t first_row;
+    int64_t nrows;
+};
+
+static void llama_tensor_convert_rows(ggml_type type, const void * src, float * dst, int64_t n) {
+    if (type == GGML_TYPE_F16) {
+        ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, dst, n);
+    } else if (type == GGML_TYPE_BF16) {
+        ggml_bf16_to_fp32_row((const ggml_bf16_t *) src, dst, n);
+    } else {
+        ggml_get_type_traits(type)->to_float(src, dst, n);
+    }
+}
+
+// validate the input rows and quantize them into the output of the job
+// the rows of a cached output are validated instead, and only quantized if they are invalid
+static void llama_tensor_quantize_task(const quantize_task & task, std::vector<no_init<float>> & f32_buf) {
+    quantize_job & job = *task.job;
+    const ggml_tensor * tensor = job.weight->tensor;
+
+    const int64_t n_per_row = tensor->ne[0];
+    const int64_t row0      = task.i_mat*tensor->ne[1] + task.first_row;
+
+    const size_t row_size = ggml_row_size(tensor->type, n_per_row);
+    const char * src = (const char *) tensor->data + row0*row_size;
+
+    if (!ggml_validate_row_data(tensor->type, src, task.nrows*row_size)) {
+        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(tensor)));
+    }
+
+    if (!job.quantize) {
+        return;
+    }
+
+    void * dst = (char *) job.new_data.data() + row0*ggml_row_size(job.new_type, n_per_row);
+
+    if (job.cached) {
+        if (ggml_validate_row_data(job.new_type, dst, task.nrows*ggml_row_size(job.new_type, n_per_row))) {
+            return;
         }
-    };
-    for (int it = 0; it < nthread - 1; ++it) {
-        workers.emplace_back(compute);
+        job.cache_invalid = true;
     }
-    compute();
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
-    if (!valid) {
+
+    const float * f32_data = (const float *) src;
+    if (tensor->type != GGML_TYPE_F32) {
+        if (f32_buf.size() < (size_t) (task.nrows*n_per_row)) {
+            f32_buf.resize(task.nrows*n_per_row);
+        }
+        llama_tensor_convert_rows(tensor->type, src, (float *) f32_buf.data(), task.nrows*n_per_row);
+        f32_data = (const float *) f32_buf.data();
+    }
+
+    // each expert has its own importance matrix
+    const float * imatrix = job.imatrix ? job.imatrix + task.i_mat*n_per_row : nullptr;
+
+    const size_t size = ggml_quantize_chunk(job.new_type, f32_data, dst, 0, task.nrows, n_per_row, imatrix);
+    if (!ggml_validate_row_data(job.new_type, dst, size)) {
         throw std::runtime_error("quantized data validation failed");
     }
-    return new_size;
 }
 
 static void llama_model_quantize_impl(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
@@ -533,8 +575,9 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
         kv_overrides = v->data();
     }
 
+    // the tensor data is validated by the quantization pool, row chunk by row chunk
     std::vector<std::string> splits = {};
-    llama_model_loader ml(fname_inp, splits, use_mmap, /*check_tensors*/ true, kv_overrides, nullptr);
+    llama_model_loader ml(fname_inp, splits, use_mmap, /*check_tensors*/ false, kv_overrides, nullptr);
     ml.init_mappings(false); // no prefetching
 
     llama_model model(llama_model_default_params());
@@ -645,15 +688,6 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
-    std::vector<std::thread> workers;
-    workers.reserve(nthread);
-
-    int idx = 0;
-
-    std::vector<no_init<uint8_t>> read_data;
-    std::vector<no_init<uint8_t>> work;
-    std::vector<no_init<float>> f32_conv_buf;
-
     uint16_t n_split = 1;
 
     // Assume split index is continuous
@@ -684,61 +718,17 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
         }
     }
 
-    int cur_split = -1;
-    std::ofstream fout;
-    auto close_ofstream = [&]() {
-        // Write metadata and close file handler
-        if (fout.is_open()) {
-            fout.seekp(0);
-            std::vector<uint8_t> data(gguf_get_meta_size(ctx_outs[cur_split].get()));
-            gguf_get_meta_data(ctx_outs[cur_split].get(), data.data());
-            fout.write((const char *) data.data(), data.size());
-            fout.close();
-        }
-    };
-    auto new_ofstream = [&](int index) {
-        cur_split = index;
-        GGML_ASSERT(ctx_outs[cur_split] && "Find uninitialized gguf_context");
-        std::string fname = fname_out;
-        if (params->keep_split) {
-            std::vector<char> split_path(llama_path_max(), 0);
-            llama_split_path(split_path.data(), split_path.size(), fname_out.c_str(), cur_split, n_split);
-            fname = std::string(split_path.data());
-        }
-
-        fout = std::ofstream(fname, std::ios::binary);
-        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-        const size_t meta_size = gguf_get_meta_size(ctx_outs[cur_split].get());
-        // placeholder for the meta data
-        ::zeros(fout, meta_size);
-    };
-
     const auto tn = LLM_TN(model.arch);
-    new_ofstream(0);
+
+    // choose the type of every tensor up front - this only needs the shapes and names, and must be done in order
+    // because llama_tensor_get_type counts the layers it has seen
+    std::vector<std::unique_ptr<quantize_job>> jobs;
+    jobs.reserve(tensors.size());
     for (const auto * it : tensors) {
-        const auto & weight = *it;
-        ggml_tensor * tensor = weight.tensor;
-        if (weight.idx != cur_split && params->keep_split) {
-            close_ofstream();
-            new_ofstream(weight.idx);
-        }
+        ggml_tensor * tensor = it->tensor;
 
         const std::string name = ggml_get_name(tensor);
 
-        if (!ml.use_mmap) {
-            if (read_data.size() < ggml_nbytes(tensor)) {
-                read_data.resize(ggml_nbytes(tensor));
-            }
-            tensor->data = read_data.data();
-        }
-        ml.load_data_for(tensor);
-
-        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
-               ++idx, ml.n_tensors,
-               ggml_get_name(tensor),
-               llama_format_tensor_shape(tensor).c_str(),
-               ggml_type_name(tensor->type));
-
         // This used to be a regex, but <regex> has an extreme cost to compile times.
         bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
 
@@ -783,9 +773,8 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
         // do not quantize relative position bias (T5)
         quantize &= name.find("attn_rel_b.weight") == std::string::npos;
 
-        ggml_type new_type;
-        void * new_data;
-        size_t new_size;
+        ggml_type new_type = tensor->type;
+        const float * imatrix = nullptr;
 
         if (quantize) {
             new_type = default_type;
@@ -799,7 +788,7 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
                     for (const auto & [tname, qtype] : tensor_types) {
                         if (std::regex pattern(tname); std::regex_search(tensor->name, pattern)) {
                             if (qtype != new_type) {
-                                LLAMA_LOG_DEBUG("(overriding %s -> %s), ", ggml_type_name(new_type), ggml_type_name(qtype));
+                                LLAMA_LOG_DEBUG("%s: %s (overriding %s -> %s)\n", __func__, tensor->name, ggml_type_name(new_type), ggml_type_name(qtype));
                             }
                             new_type = qtype;
                             break;
@@ -821,13 +810,7 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
 
         if (!quantize) {
             new_type = tensor->type;
-            new_data = tensor->data;
-            new_size = ggml_nbytes(tensor);
-            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
         } else {
-            const int64_t nelements = ggml_nelements(tensor);
-
-            const float * imatrix = nullptr;
             if (imatrix_data) {
                 auto it = imatrix_data->find(tensor->name);
                 if (it == imatrix_data->end()) {
@@ -863,63 +846,321 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
                 throw std::runtime_error(format("Missing importance matrix for tensor %s in a very low-bit quantization", tensor->name));
             }
 
-            float * f32_data;
+            if (tensor->type != GGML_TYPE_F32) {
+                if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
+                    throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
+                }
+                if (ggml_is_quantized(tensor->type) && ggml_get_type_traits(tensor->type)->to_float == NULL) {
+                    throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
+                }
+                if (!ggml_is_quantized(tensor->type) && tensor->type != GGML_TYPE_F16 && tensor->type != GGML_TYPE_BF16) {
+                    throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
+                }
+            }
+        }
+
+        auto job = std::make_unique<quantize_job>();
+        job->weight   = it;
+        job->quantize = quantize;
+        job->new_type = new_type;
+        job->imatrix  = imatrix;
+        if (imatrix) {
+            job->imatrix_hash = llama_quant_hash_data(imatrix, tensor->ne[0]*tensor->ne[2]*sizeof(float));
+        }
+        job->new_size = quantize ? ggml_row_size(new_type, tensor->ne[0])*(ggml_nelements(tensor)/tensor->ne[0]) : ggml_nbytes(tensor);
+        job->inflight = (ml.use_mmap ? 0 : ggml_nbytes(tensor)) + (quantize ? job->new_size : 0);
 
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
-                throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_tensor_dequantize_impl(tensor, f32_conv_buf, workers, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
+        // update the gguf meta data
+        const uint16_t i_split = params->keep_split ? it->idx : 0;
+        gguf_set_tensor_type(ctx_outs[i_split].get(), name.c_str(), new_type);
+        GGML_ASSERT(gguf_get_tensor_size(ctx_outs[i_split].get(), gguf_find_tensor(ctx_outs[i_split].get(), name.c_str())) == job->new_size);
+
+        jobs.push_back(std::move(job));
+    }
+
+    int cur_split = -1;
+    std::ofstream fout;
+    auto close_ofstream = [&]() {
+        // Write metadata and close file handler
+        if (fout.is_open()) {
+            fout.seekp(0);
+            std::vector<uint8_t> data(gguf_get_meta_size(ctx_outs[cur_split].get()));
+            gguf_get_meta_data(ctx_outs[cur_split].get(), data.data());
+            fout.write((const char *) data.data(), data.size());
+            fout.close();
+        }
+    };
+    auto new_ofstream = [&](int index) {
+        cur_split = index;
+        GGML_ASSERT(ctx_outs[cur_split] && "Find uninitialized gguf_context");
+        std::string fname = fname_out;
+        if (params->keep_split) {
+            std::vector<char> split_path(llama_path_max(), 0);
+            llama_split_path(split_path.data(), split_path.size(), fname_out.c_str(), cur_split, n_split);
+            fname = std::string(split_path.data());
+        }
+
+        fout = std::ofstream(fname, std::ios::binary);
+        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
+        const size_t meta_size = gguf_get_meta_size(ctx_outs[cur_split].get());
+        // placeholder for the meta data
+        ::zeros(fout, meta_size);
+    };
+
+    // the pipeline: a reader thread loads the tensors in file order, a persistent pool of nthread workers
+    // converts and quantizes row chunks of whichever tensors have been loaded, and this thread writes the
+    // finished tensors in order - so that reading, quantizing and writing overlap
+    // with a cache directory, quantized tensors are looked up by the hash of their inputs and stored after a miss,
+    // so that re-running with a slightly different mix only quantizes the tensors whose type or imatrix changed
+    const char * cache_dir = params->cache_dir;
+    int n_cached = 0;
+
+    std::mutex              mutex;
+    std::condition_variable cv_reader; // the in-flight budget was released
+    std::condition_variable cv_work;   // tasks were queued
+    std::condition_variable cv_writer; // a tensor was finished
+
+    std::deque<quantize_task> tasks;
+    size_t inflight = 0;
+    bool   done     = false;
+    bool   failed   = false;
+    std::exception_ptr error;
+
+    auto set_error = [&](std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!failed) {
+                error  = e;
+                failed = true;
+            }
+        }
+        cv_reader.notify_all();
+        cv_work.notify_all();
+        cv_writer.notify_all();
+    };
+
+    auto worker = [&]() {
+        std::vector<no_init<float>> f32_buf;
+        while (true) {
+            quantize_task task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_work.wait(lock, [&]() { return !tasks.empty() || done || failed; });
+                if (tasks.empty() || failed) {
+                    return;
+                }
+                task = tasks.front();
+                tasks.pop_front();
+            }
+
+            try {
+                llama_tensor_quantize_task(task, f32_buf);
+            } catch (...) {
+                set_error(std::current_exception());
+                return;
+            }
+
+            if (--task.job->n_pending == 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                cv_writer.notify_one();
+            }
+        }
+    };
+
+    auto reader = [&]() {
+        try {
+            for (auto & job : jobs) {
+                ggml_tensor * tensor = job->weight->tensor;
+
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv_reader.wait(lock, [&]() { return failed || inflight == 0 || inflight + job->inflight <= quantize_max_inflight; });
+                    if (failed) {
+                        return;
+                    }
+                    inflight += job->inflight;
+                }
+
+                const bool use_cache = cache_dir && job->quantize;
+
+                if (ml.use_mmap) {
+                    tensor->data = nullptr;
+                    ml.load_data_for(tensor);
+
+                    // fault the pages in here rather than in the workers (hashing for the cache touches them too)
+                    if (!use_cache) {
+                        const size_t page_size = 4096;
+                        const uint8_t * data = (const uint8_t *) tensor->data;
+                        uint8_t sum = 0;
+                        for (size_t i = 0; i < ggml_nbytes(tensor); i += page_size) {
+                            sum += ((const volatile uint8_t *) data)[i];
+                        }
+                        GGML_UNUSED(sum);
+                    }
+                } else {
+                    job->read_data.resize(ggml_nbytes(tensor));
+                    tensor->data = job->read_data.data();
+                    ml.load_data_for(tensor);
+                }
+
+                if (job->quantize) {
+                    job->new_data.resize(job->new_size);
+                }
+
+                if (use_cache) {
+                    // the output only depends on the source data and type, the row size, the target type and the imatrix slice
+                    const llama_quant_hash h = llama_quant_hash_data(tensor->data, ggml_nbytes(tensor));
+                    job->cache_file = format("%s/%016" PRIx64 "%016" PRIx64 "-%s-%" PRId64 "-%016" PRIx64 "%016" PRIx64 "-%s-v%d.bin",
+                            cache_dir, h.h0, h.h1, ggml_type_name(tensor->type), tensor->ne[0], job->imatrix_hash.h0, job->imatrix_hash.h1,
+                            ggml_type_name(job->new_type), GGML_QNT_VERSION);
+
+                    std::ifstream fin(job->cache_file, std::ios::binary | std::ios::ate);
+                    if (fin && (size_t) fin.tellg() == job->new_size) {
+                        fin.seekg(0);
+                        job->cached = (bool) fin.read((char *) job->new_data.data(), job->new_size);
+                    }
+                }
+
+                // a cached output still goes through the workers, which validate the source rows and the cached rows
+                // split the tensor in row chunks, the rows of a chunk belong to the same matrix
+                const int64_t n_per_row = tensor->ne[0];
+                const int64_t nrows     = tensor->ne[1];
+                const int64_t n_mat     = ggml_nrows(tensor)/nrows;
+                const int64_t nrows_per_task = std::max<int64_t>(1, quantize_task_size/n_per_row);
+
+                std::vector<quantize_task> job_tasks;
+                for (int64_t i_mat = 0; i_mat < n_mat; ++i_mat) {
+                    for (int64_t first_row = 0; first_row < nrows; first_row += nrows_per_task) {
+                        job_tasks.push_back({ job.get(), i_mat, first_row, std::min(nrows_per_task, nrows - first_row) });
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    job->n_pending = job_tasks.size();
+                    job->loaded    = true;
+                    tasks.insert(tasks.end(), job_tasks.begin(), job_tasks.end());
+                }
+                cv_work.notify_all();
+                if (job_tasks.empty()) {
+                    cv_writer.notify_one();
+                }
             }
+        } catch (...) {
+            set_error(std::current_exception());
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(nthread);
+    for (int i = 0; i < nthread; ++i) {
+        workers.emplace_back(worker);
+    }
+    std::thread reader_thread(reader);
 
-            LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(new_type));
-            fflush(stdout);
+    try {
+        new_ofstream(0);
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            quantize_job & job = *jobs[i];
+            const ggml_tensor * tensor = job.weight->tensor;
 
-            if (work.size() < (size_t)nelements * 4) {
-                work.resize(nelements * 4); // upper bound on size
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_writer.wait(lock, [&]() { return failed || (job.loaded && job.n_pending == 0); });
+                if (failed) {
+                    break;
+                }
             }
-            new_data = work.data();
 
-            const int64_t n_per_row = tensor->ne[0];
-            const int64_t nrows = tensor->ne[1];
+            if (job.weight->idx != cur_split && params->keep_split) {
+                close_ofstream();
+                new_ofstream(job.weight->idx);
+            }
 
-            static const int64_t min_chunk_size = 32 * 512;
-            const int64_t chunk_size = (n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row));
+            const void * new_data = job.quantize ? (const void *) job.new_data.data() : tensor->data;
+
+            if (job.quantize) {
+                LLAMA_LOG_INFO("[%4zu/%4d] %36s - [%s], type = %6s, %s %s .. size = %8.2f MiB -> %8.2f MiB\n",
+                       i + 1, ml.n_tensors,
+                       ggml_get_name(tensor),
+                       llama_format_tensor_shape(tensor).c_str(),
+                       ggml_type_name(tensor->type),
+                       job.cached && !job.cache_invalid ? "cached" : "converting to",
+                       ggml_type_name(job.new_type),
+                       ggml_nbytes(tensor)/1024.0/1024.0, job.new_size/1024.0/1024.0);
+            } else {
+                LLAMA_LOG_INFO("[%4zu/%4d] %36s - [%s], type = %6s, size = %8.3f MB\n",
+                       i + 1, ml.n_tensors,
+                       ggml_get_name(tensor),
+                       llama_format_tensor_shape(tensor).c_str(),
+                       ggml_type_name(tensor->type),
+                       ggml_nbytes(tensor)/1024.0/1024.0);
+            }
 
-            const int64_t nelements_matrix = tensor->ne[0] * tensor->ne[1];
-            const int64_t nchunk = (nelements_matrix + chunk_size - 1)/chunk_size;
-            const int64_t nthread_use = nthread > 1 ? std::max((int64_t)1, std::min((int64_t)nthread, nchunk)) : 1;
+            total_size_org += ggml_nbytes(tensor);
+            total_size_new += job.new_size;
 
-            // quantize each expert separately since they have different importance matrices
-            new_size = 0;
-            for (int64_t i03 = 0; i03 < tensor->ne[2]; ++i03) {
-                const float * f32_data_03 = f32_data + i03 * nelements_matrix;
-                void * new_data_03 = (char *)new_data + ggml_row_size(new_type, n_per_row) * i03 * nrows;
-                const float * imatrix_03 = imatrix ? imatrix + i03 * n_per_row : nullptr;
+            // write tensor data + padding
+            fout.write((const char *) new_data, job.new_size);
+            zeros(fout, GGML_PAD(job.new_size, align) - job.new_size);
 
-                new_size += llama_tensor_quantize_impl(new_type, f32_data_03, new_data_03, chunk_size, nrows, n_per_row, imatrix_03, workers, nthread_use);
+            if (job.cache_invalid) {
+                LLAMA_LOG_WARN("%s: the cached %s failed validation and was quantized again\n", __func__, ggml_get_name(tensor));
             }
-            LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB\n", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
+
+            if (job.cached && !job.cache_invalid) {
+                n_cached++;
+            } else if (!job.cache_file.empty()) {
+                // write to a temporary file and rename, so that an interrupted run never leaves a truncated entry
+                const std::string tmp = job.cache_file + ".tmp";
+                std::ofstream fcache(tmp, std::ios::binary);
+                if (fcache.write((const char *) new_data, job.new_size) && (fcache.close(), !fcache.fail()) &&
+                    std::rename(tmp.c_str(), job.cache_file.c_str()) == 0) {
+                    // stored
+                } else {
+                    LLAMA_LOG_WARN("%s: failed to store %s in the cache\n", __func__, ggml_get_name(tensor));
+                    std::remove(tmp.c_str());
+                }
+            }
+
+            // release the buffers of the tensor
+            job.read_data = {};
+            job.new_data  = {};
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                inflight -= job.inflight;
+            }
+            cv_reader.notify_one();
         }
-        total_size_org += ggml_nbytes(tensor);
-        total_size_new += new_size;
+    } catch (...) {
+        set_error(std::current_exception());
+    }
 
-        // update the gguf meta data as we go
-        gguf_set_tensor_type(ctx_outs[cur_split].get(), name.c_str(), new_type);
-        GGML_ASSERT(gguf_get_tensor_size(ctx_outs[cur_split].get(), gguf_find_tensor(ctx_outs[cur_split].get(), name.c_str())) == new_size);
-        gguf_set_tensor_data(ctx_outs[cur_split].get(), name.c_str(), new_data);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cv_work.notify_all();
+    cv_reader.notify_all();
+
+    reader_thread.join();
+    for (auto & w : workers) {
+        w.join();
+    }
 
-        // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+    if (failed) {
+        std::rethrow_exception(error);
     }
+
     close_ofstream();
 
     LLAMA_LOG_INFO("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
     LLAMA_LOG_INFO("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
 
+    if (cache_dir) {
+        LLAMA_LOG_INFO("%s: %d tensor(s) reused from the cache in %s\n", __func__, n_cached, cache_dir);
+    }
+
     if (qs.n_fallback > 0) {
         LLAMA_LOG_WARN("%s: WARNING: %d of %d tensor(s) required fallback quantization\n",
                 __func__, qs.n_fallback, qs.n_k_quantized + qs.n_fallback);
@@ -944,6 +1185,7 @@ llama_model_quantize_params llama_model_quantize_default_params() {
         /*.imatrix                     =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
         /*.tensor_type                 =*/ nullptr,
+        /*.cache_dir                   =*/ nullptr,
     };
 
     return result;
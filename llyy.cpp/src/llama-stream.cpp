@@ -0,0 +1,38 @@
+#include "llama-stream.h"
+
+#include "llama-mmap.h"
+
+llama_layer_stream::llama_layer_stream(int n_layer, int n_ahead) : n_layer(n_layer), n_ahead(n_ahead), layers(n_layer) {}
+
+void llama_layer_stream::add(int il, const llama_mmap * mapping, size_t first, size_t last) {
+    auto & ranges = layers.at(il);
+
+    // the weights of a layer are usually contiguous in the file
+    if (!ranges.empty() && ranges.back().mapping == mapping && first >= ranges.back().last && first - ranges.back().last < 4096) {
+        ranges.back().last = last;
+        return;
+    }
+
+    ranges.push_back({ mapping, first, last });
+}
+
+void llama_layer_stream::begin_layer(int il) const {
+    // the layers wrap around, so that the end of a pass reads in the first layers of the next one
+    for (int i = 0; i <= n_ahead; ++i) {
+        for (const auto & r : layers[(il + i) % n_layer]) {
+            r.mapping->prefetch(r.first, r.last);
+        }
+    }
+
+    for (const auto & r : layers[(il + n_layer - 1) % n_layer]) {
+        r.mapping->evict(r.first, r.last);
+    }
+}
+
+size_t llama_layer_stream::layer_size(int il) const {
+    size_t size = 0;
+    for (const auto & r : layers.at(il)) {
+        size += r.last - r.first;
+    }
+    return size;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+struct llama_mmap;
+
+// streaming of the layer weights from the mapped model files, for models that do not fit in memory
+//
+// the computation reports each layer it starts, the weights of the next n_ahead layers are then read in ahead of
+// their use and the pages of the previous layer are released - rather than leaving it to the page cache to evict
+// whatever it picks, which thrashes once the model is larger than the memory
+struct llama_layer_stream {
+    llama_layer_stream(int n_layer, int n_ahead);
+
+    // a weight of layer il stored at [first, last) of the mapped file
+    void add(int il, const llama_mmap * mapping, size_t first, size_t last);
+
+    // the computation of layer il is starting
+    void begin_layer(int il) const;
+
+    // bytes of the mapped weights of layer il
+    size_t layer_size(int il) const;
+
+    const int n_layer;
+    const int n_ahead;
+
+private:
+    struct range {
+        const llama_mmap * mapping;
+
+        size_t first;
+        size_t last;
+    };
+
+    std::vector<std::vector<range>> layers;
+};
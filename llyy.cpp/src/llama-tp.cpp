@@ -0,0 +1,255 @@
+#include "llama-tp.h"
+
+#include "llama-impl.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// number of floats exchanged per round, larger all-reduces are done in several rounds
+#define LLAMA_TP_CHUNK (1 << 20)
+
+#define LLAMA_TP_MAGIC 0x6c6c616d61747031ull // "llamatp1"
+
+// how long a rank waits for the others to attach
+#define LLAMA_TP_ATTACH_TIMEOUT_MS 60000
+
+// how long a rank waits for the others at a barrier before the group is considered broken
+#define LLAMA_TP_BARRIER_TIMEOUT_MS 60000
+
+// the ranks are tracked with one bit each
+#define LLAMA_TP_MAX_RANKS 64
+
+// the segment is zero-filled by ftruncate, rank 0 sets magic/size and then ready
+struct llama_tp_header {
+    uint64_t magic;
+    int32_t  size;
+
+    std::atomic<uint32_t> ready;
+
+    alignas(64) std::atomic<uint32_t> n_attached;
+    alignas(64) std::atomic<uint64_t> attached; // bit r is set once rank r has attached
+    alignas(64) std::atomic<uint32_t> n_waiting;
+    alignas(64) std::atomic<uint32_t> gen;
+
+    // number of barriers entered by each rank, tells the ranks that went missing
+    alignas(64) std::atomic<uint64_t> n_entered[LLAMA_TP_MAX_RANKS];
+};
+
+static std::string llama_tp_ranks_str(uint64_t mask) {
+    std::string res;
+    for (int r = 0; r < LLAMA_TP_MAX_RANKS; ++r) {
+        if (mask & (uint64_t(1) << r)) {
+            res += (res.empty() ? "" : ", ") + std::to_string(r);
+        }
+    }
+    return res;
+}
+
+static size_t llama_tp_data_offset() {
+    return (sizeof(llama_tp_header) + 63) & ~size_t(63);
+}
+
+static size_t llama_tp_segment_size(int size) {
+    // one slot per rank for the inputs and one for the reduced result
+    return llama_tp_data_offset() + size_t(size + 1)*LLAMA_TP_CHUNK*sizeof(float);
+}
+
+#if !defined(_WIN32)
+
+llama_tp::llama_tp(const std::string & name, int rank, int size) : rank(rank), size(size), name(name) {
+    if (size < 2 || size > LLAMA_TP_MAX_RANKS || rank < 0 || rank >= size) {
+        throw std::runtime_error(format("invalid tensor parallel rank %d of %d", rank, size));
+    }
+    if (name.empty() || name[0] != '/') {
+        this->name = "/" + name;
+    }
+
+    addr_size = llama_tp_segment_size(size);
+
+    const auto t_start = std::chrono::steady_clock::now();
+    auto timed_out = [&]() {
+        return std::chrono::steady_clock::now() - t_start > std::chrono::milliseconds(LLAMA_TP_ATTACH_TIMEOUT_MS);
+    };
+
+    int fd = -1;
+    if (rank == 0) {
+        // drop a segment left over by a previous run that did not get to unlink it
+        shm_unlink(this->name.c_str());
+
+        fd = shm_open(this->name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) {
+            throw std::runtime_error(format("shm_open(%s) failed: %s", this->name.c_str(), strerror(errno)));
+        }
+        if (ftruncate(fd, addr_size) != 0) {
+            close(fd);
+            shm_unlink(this->name.c_str());
+            throw std::runtime_error(format("ftruncate(%s) failed: %s", this->name.c_str(), strerror(errno)));
+        }
+    } else {
+        // wait for rank 0 to create the segment
+        struct stat st;
+        while ((fd = shm_open(this->name.c_str(), O_RDWR, 0600)) < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < addr_size) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (timed_out()) {
+                throw std::runtime_error(format("timed out waiting for tensor parallel rank 0 to create %s", this->name.c_str()));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    addr = mmap(nullptr, addr_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        addr = nullptr;
+        throw std::runtime_error(format("mmap(%s) failed: %s", this->name.c_str(), strerror(errno)));
+    }
+
+    hdr = (llama_tp_header *) addr;
+
+    if (rank == 0) {
+        hdr->magic = LLAMA_TP_MAGIC;
+        hdr->size  = size;
+        hdr->ready.store(1, std::memory_order_release);
+    } else {
+        while (hdr->ready.load(std::memory_order_acquire) == 0) {
+            if (timed_out()) {
+                throw std::runtime_error(format("timed out waiting for tensor parallel rank 0 to initialize %s", this->name.c_str()));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (hdr->magic != LLAMA_TP_MAGIC || hdr->size != size) {
+            throw std::runtime_error(format("%s is not a tensor parallel segment for %d ranks", this->name.c_str(), size));
+        }
+    }
+
+    // wait for all the ranks, after that the name is no longer needed
+    hdr->attached.fetch_or(uint64_t(1) << rank, std::memory_order_acq_rel);
+    hdr->n_attached.fetch_add(1, std::memory_order_acq_rel);
+    while (hdr->n_attached.load(std::memory_order_acquire) < (uint32_t) size) {
+        if (timed_out()) {
+            const uint64_t all = size == LLAMA_TP_MAX_RANKS ? ~uint64_t(0) : (uint64_t(1) << size) - 1;
+            throw std::runtime_error(format("timed out waiting for tensor parallel ranks %s to attach to %s",
+                        llama_tp_ranks_str(all & ~hdr->attached.load(std::memory_order_acquire)).c_str(), this->name.c_str()));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (rank == 0) {
+        shm_unlink(this->name.c_str());
+    }
+
+    LLAMA_LOG_INFO("%s: rank %d of %d attached to %s (%.2f MiB)\n", __func__, rank, size, this->name.c_str(), addr_size/1024.0/1024.0);
+}
+
+llama_tp::~llama_tp() {
+    if (addr) {
+        munmap(addr, addr_size);
+    }
+}
+
+#else
+
+llama_tp::llama_tp(const std::string & name, int rank, int size) : rank(rank), size(size), name(name) {
+    throw std::runtime_error("tensor parallelism is not supported on this platform");
+}
+
+llama_tp::~llama_tp() {}
+
+#endif
+
+float * llama_tp::slot(int r) const {
+    return (float *) ((char *) addr + llama_tp_data_offset()) + size_t(r)*LLAMA_TP_CHUNK;
+}
+
+bool llama_tp::barrier() {
+    const uint32_t gen = hdr->gen.load(std::memory_order_acquire);
+
+    const uint64_t n_entered = hdr->n_entered[rank].fetch_add(1, std::memory_order_acq_rel) + 1;
+
+    if (hdr->n_waiting.fetch_add(1, std::memory_order_acq_rel) == (uint32_t) size - 1) {
+        // last one in releases the others
+        hdr->n_waiting.store(0, std::memory_order_relaxed);
+        hdr->gen.fetch_add(1, std::memory_order_acq_rel);
+        return true;
+    }
+
+    // the ranks usually arrive within a few microseconds of each other, spin before yielding the core
+    std::chrono::steady_clock::time_point t_start;
+    for (int i = 0; hdr->gen.load(std::memory_order_acquire) == gen; ++i) {
+        if (i < 1024) {
+            continue;
+        }
+        if (i == 1024) {
+            t_start = std::chrono::steady_clock::now();
+        }
+        if (i % 1024 == 0 && std::chrono::steady_clock::now() - t_start > std::chrono::milliseconds(LLAMA_TP_BARRIER_TIMEOUT_MS)) {
+            // a rank that crashed or stopped decoding never arrives, the group cannot be used any more
+            uint64_t missing = 0;
+            for (int r = 0; r < size; ++r) {
+                if (hdr->n_entered[r].load(std::memory_order_acquire) < n_entered) {
+                    missing |= uint64_t(1) << r;
+                }
+            }
+            LLAMA_LOG_ERROR("%s: rank %d timed out waiting for tensor parallel ranks %s\n", __func__, rank, llama_tp_ranks_str(missing).c_str());
+            return false;
+        }
+        std::this_thread::yield();
+    }
+
+    return true;
+}
+
+bool llama_tp::all_reduce(float * data, int64_t n) {
+    if (broken) {
+        return false;
+    }
+
+    float * result = slot(size);
+
+    for (int64_t i0 = 0; i0 < n; i0 += LLAMA_TP_CHUNK) {
+        const int64_t nc = std::min<int64_t>(LLAMA_TP_CHUNK, n - i0);
+
+        memcpy(slot(rank), data + i0, nc*sizeof(float));
+
+        if (!barrier()) {
+            broken = true;
+            return false;
+        }
+
+        // each rank reduces its share of the chunk
+        const int64_t j0 = (nc*rank      )/size;
+        const int64_t j1 = (nc*(rank + 1))/size;
+
+        for (int64_t j = j0; j < j1; ++j) {
+            float sum = slot(0)[j];
+            for (int r = 1; r < size; ++r) {
+                sum += slot(r)[j];
+            }
+            result[j] = sum;
+        }
+
+        if (!barrier()) {
+            broken = true;
+            return false;
+        }
+
+        // the next round overwrites result only after every rank has arrived at its first barrier, i.e. after this copy
+        memcpy(data + i0, result, nc*sizeof(float));
+    }
+
+    return true;
+}
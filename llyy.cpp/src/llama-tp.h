@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct llama_tp_header;
+
+// tensor parallelism across processes on the same host
+//
+// each of the tp_size ranks holds a slice of the attention heads and of the FFN hidden units of every layer,
+// the partial outputs of the attention output and FFN down projections are summed over a POSIX shared memory
+// segment that all the ranks map
+struct llama_tp {
+    llama_tp(const std::string & name, int rank, int size);
+    ~llama_tp();
+
+    // sum n floats over all ranks, in place
+    // the summation order is fixed, so that every rank gets bitwise identical results
+    // returns false if a rank did not arrive in time, the group is then broken and all the next calls fail
+    bool all_reduce(float * data, int64_t n);
+
+    bool is_broken() const {
+        return broken;
+    }
+
+    const int rank;
+    const int size;
+
+private:
+    // false on timeout, the missing ranks are logged
+    bool barrier();
+
+    bool broken = false;
+
+    float * slot(int r) const;
+
+    std::string name;
+
+    void * addr      = nullptr;
+    size_t addr_size = 0;
+
+    llama_tp_header * hdr = nullptr;
+};
@@ -92,7 +92,13 @@ static int llama_model_load(const std::string & fname, std::vector<std::string>
     model.t_start_us = tm.t_start_us;
 
     try {
-        llama_model_loader ml(fname, splits, params.use_mmap, params.check_tensors, params.kv_overrides, params.tensor_buft_overrides);
+        // tensor parallel ranks read their slices of the weights, they cannot be mapped from the file
+        const bool use_mmap = params.use_mmap && params.tp_size <= 1;
+
+        llama_model_loader ml(fname, splits, use_mmap, params.check_tensors, params.kv_overrides, params.tensor_buft_overrides);
+
+        ml.tp_rank = params.tp_rank;
+        ml.tp_size = std::max(1, params.tp_size);
 
         ml.print_info();
 